@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+# run.sh
+#
+# shell overhead benchmarks, comparing mysh against dash and bash (whichever are installed):
+#
+#   parse     lines/sec of the parser alone (sh -n over a generated script)
+#   spawn     latency of starting a single external `true`
+#   pipeline  throughput of an N-stage pipeline moving a large amount of data
+#   script    per-line overhead of a script made of builtin no-ops
+#
+# each workload runs RUNS times per shell and the fastest run is reported, which is the least
+# disturbed by whatever else the machine is doing
+#
+# usage: bench/run.sh [mysh binary]
+# environment: RUNS, PARSE_LINES, SPAWN_COUNT, PIPE_MB, PIPE_STAGES, SCRIPT_LINES, SHELLS
+
+MYSH=${1:-./mysh}
+RUNS=${RUNS:-3}
+PARSE_LINES=${PARSE_LINES:-200000}
+SPAWN_COUNT=${SPAWN_COUNT:-2000}
+PIPE_MB=${PIPE_MB:-512}
+PIPE_STAGES=${PIPE_STAGES:-4}
+SCRIPT_LINES=${SCRIPT_LINES:-200000}
+SHELLS=${SHELLS:-"$MYSH dash bash"}
+
+if [ ! -x "$MYSH" ]; then
+    echo "run.sh: $MYSH: not built, run make first" >&2
+    exit 1
+fi
+
+TRUE=$(command -v true)
+case $TRUE in
+/*) ;;
+*) TRUE=/bin/true ;;
+esac
+
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/mysh-bench.XXXXXX") || exit 1
+trap 'rm -rf "$TMP"' EXIT INT TERM
+
+# generate the inputs once, in a form every shell under test can run
+awk -v n="$PARSE_LINES" 'BEGIN { for (i = 0; i < n; i++)
+    printf "grep -v \"pattern %d\" < /etc/passwd | sort -r | head -n 3 > /dev/null\n", i }' > "$TMP/parse.sh"
+awk -v n="$SPAWN_COUNT" -v t="$TRUE" 'BEGIN { for (i = 0; i < n; i++) print t }' > "$TMP/spawn.sh"
+awk -v n="$SCRIPT_LINES" 'BEGIN { for (i = 0; i < n; i++) print ": word" i }' > "$TMP/script.sh"
+{
+    printf 'head -c %d /dev/zero' $((PIPE_MB * 1024 * 1024))
+    i=0
+    while [ $i -lt "$PIPE_STAGES" ]; do
+        # tr really touches the data, unlike cat which mysh would drop from the pipeline
+        printf ' | tr a b'
+        i=$((i + 1))
+    done
+    printf ' > /dev/null\n'
+} > "$TMP/pipeline.sh"
+
+now_ns() {
+    date +%s%N
+}
+
+# best_ns shell args...: fastest of RUNS runs of `shell args...`, in nanoseconds
+best_ns() {
+    best=
+    run=0
+    while [ $run -lt "$RUNS" ]; do
+        start=$(now_ns)
+        "$@" > /dev/null 2>&1 < /dev/null
+        elapsed=$(($(now_ns) - start))
+        if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+            best=$elapsed
+        fi
+        run=$((run + 1))
+    done
+    echo "$best"
+}
+
+# report workload shell ns count unit: one result line, with count items per run as a rate
+report() {
+    awk -v w="$1" -v sh="$2" -v ns="$3" -v n="$4" -v unit="$5" 'BEGIN {
+        s = ns / 1e9
+        if (unit == "us/spawn" || unit == "us/line")
+            printf "%-10s %-10s %10.3f s %14.2f %s\n", w, sh, s, ns / 1e3 / n, unit
+        else
+            printf "%-10s %-10s %10.3f s %14.0f %s\n", w, sh, s, n / s, unit
+    }'
+}
+
+printf '%-10s %-10s %12s %14s\n' workload shell time result
+for sh in $SHELLS; do
+    if ! command -v "$sh" > /dev/null 2>&1; then
+        echo "run.sh: $sh: not installed, skipped" >&2
+        continue
+    fi
+    name=$(basename "$sh")
+
+    report parse "$name" "$(best_ns "$sh" -n "$TMP/parse.sh")" "$PARSE_LINES" lines/s
+    report spawn "$name" "$(best_ns "$sh" "$TMP/spawn.sh")" "$SPAWN_COUNT" us/spawn
+    report pipeline "$name" "$(best_ns "$sh" "$TMP/pipeline.sh")" "$PIPE_MB" MB/s
+    report script "$name" "$(best_ns "$sh" "$TMP/script.sh")" "$SCRIPT_LINES" us/line
+done
@@ -0,0 +1,128 @@
+/*
+ * spawn_bench.c
+ *
+ * microbenchmark comparing the two ways mysh can start a pipeline entry: fork + execvp and
+ * posix_spawnp. the cost of fork grows with the size of the parent, so the parent can be
+ * inflated with an arbitrary amount of touched memory to imitate a large batch driver
+ *
+ * usage: spawn_bench [-n iterations] [-m ballast_mb] [program]
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <time.h>
+
+extern char **environ;
+
+double now();
+double bench_fork(char *prog, int iterations);
+double bench_posix_spawn(char *prog, int iterations);
+
+int
+main(int argc, char *argv[])
+{
+    int opt, iterations = 1000;
+    long ballast_mb = 0;
+    char *ballast, *prog = "true";
+    double fork_us, spawn_us;
+
+    while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'm':
+            ballast_mb = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-m ballast_mb] [program]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind < argc) {
+        prog = argv[optind];
+    }
+    if (iterations <= 0) {
+        fprintf(stderr, "iterations must be positive\n");
+        exit(1);
+    }
+
+    // touch every page so that it is really mapped and has to be copied by fork
+    if (ballast_mb > 0) {
+        if ((ballast = malloc(ballast_mb << 20)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        memset(ballast, 1, ballast_mb << 20);
+    }
+
+    fork_us = bench_fork(prog, iterations);
+    spawn_us = bench_posix_spawn(prog, iterations);
+
+    printf("program: %s, iterations: %d, ballast: %ld MiB\n", prog, iterations, ballast_mb);
+    printf("fork+execvp:  %10.1f us/spawn\n", fork_us);
+    printf("posix_spawnp: %10.1f us/spawn\n", spawn_us);
+    printf("speedup:      %10.2fx\n", fork_us / spawn_us);
+    return 0;
+}
+
+double
+now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+double
+bench_fork(char *prog, int iterations)
+{
+    /*
+     * returns average microseconds to fork, exec and reap prog
+     */
+
+    char *args[] = {prog, NULL};
+    double start = now();
+    pid_t pid;
+
+    for (int i = 0; i < iterations; i++) {
+        if ((pid = fork()) < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            execvp(prog, args);
+            perror("execvp");
+            _exit(3);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return (now() - start) / iterations;
+}
+
+double
+bench_posix_spawn(char *prog, int iterations)
+{
+    /*
+     * returns average microseconds to posix_spawnp and reap prog
+     */
+
+    char *args[] = {prog, NULL};
+    double start = now();
+    pid_t pid;
+    int err;
+
+    for (int i = 0; i < iterations; i++) {
+        if ((err = posix_spawnp(&pid, prog, NULL, NULL, args, environ)) != 0) {
+            fprintf(stderr, "posix_spawnp: %s\n", strerror(err));
+            exit(1);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return (now() - start) / iterations;
+}
@@ -0,0 +1,185 @@
+/*
+ * fuzz_parse.c
+ *
+ * libFuzzer target for the parser and the word expansion of mysh. every input is fed to the
+ * shell like the string of -c, split into lines by next_line, parsed line by line and every
+ * word of the parsed tree is expanded the way the executor would right before running it.
+ * nothing is ever run: the shell is in -n mode, where $(...) only parses its command
+ *
+ * mysh.c is built into this file with its main renamed, so the harness sees the same statics
+ * and the shell itself does not change
+ *
+ * build with clang (make fuzz):
+ *  clang -g -O1 -fsanitize=fuzzer,address -DFUZZ_LIBFUZZER -o fuzz/fuzz_parse fuzz/fuzz_parse.c
+ *  fuzz/fuzz_parse fuzz/corpus
+ *
+ * without -DFUZZ_LIBFUZZER (gcc, make test) the file has a main of its own, which runs every
+ * file named on the command line once, so the corpus and any crash libFuzzer found can be
+ * replayed under plain ASan
+ */
+
+#define main mysh_main
+#include "../mysh.c"
+#undef main
+
+#include <stdint.h>
+
+void expand_node(struct arena *arena, struct node *node);
+void expand_body(struct arena *arena, struct command *cmd);
+void drop_parse_cache();
+
+int
+LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    /*
+     * function to set the shell up once, like main does before reading its input
+     *
+     * returns:
+     *  0
+     */
+
+    init_vars("mysh");
+    init_options();
+    noexec = 1;
+    return 0;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    /*
+     * function to parse and expand one input, line by line
+     *
+     * returns:
+     *  0, libFuzzer only cares about crashes
+     */
+
+    struct input input;
+    struct arena arena = {NULL, NULL};
+    struct node *list;
+    char *line;
+
+    memset(&input, 0, sizeof(input));
+    input.fd = -1;
+    input.name = "fuzz";
+    input.len = size;
+    input.cap = size + 1;
+    if ((input.buf = malloc(size + 1)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(input.buf, data, size);
+    input.buf[size] = 0;
+    current_input = &input;
+
+    while ((line = next_line(&input)) != NULL) {
+        if ((list = parse_line(&arena, line, &input)) != NULL && list != &empty_line) {
+            expand_node(&arena, list);
+        }
+        arena_reset(&arena);
+    }
+
+    current_input = NULL;
+    free(input.buf);
+    arena_free(&arena);
+    drop_parse_cache();
+    return 0;
+}
+
+void
+expand_node(struct arena *arena, struct node *node)
+{
+    /*
+     * helper function to expand every pipeline of a list and of everything nested in it
+     *
+     * args:
+     *  struct arena *arena: where the expanded words go
+     *  struct node *node: first node of the list
+     */
+
+    struct command *cmd;
+
+    for (; node != NULL; node = node->next) {
+        if (node->type == NODE_PIPELINE) {
+            if (node->pipeline->expand) {
+                expand_pipeline(arena, node->pipeline);
+            }
+            for (cmd = node->pipeline->commands; cmd != NULL; cmd = cmd->next) {
+                expand_body(arena, cmd);
+            }
+        }
+        else if (node->type == NODE_FUNCTION) {
+            expand_body(arena, node->function);
+        }
+        if (node->type == NODE_FOR && node->words != NULL) {
+            expand_command(arena, node->words);
+        }
+        expand_node(arena, node->cond);
+        expand_node(arena, node->body);
+        expand_node(arena, node->orelse);
+    }
+}
+
+void
+expand_body(struct arena *arena, struct command *cmd)
+{
+    /*
+     * helper function to expand a compound command, along with the redirections after it
+     *
+     * args:
+     *  struct arena *arena: where the expanded words go
+     *  struct command *cmd: the command, which may be a plain one
+     */
+
+    if (cmd != NULL && cmd->body != NULL) {
+        expand_command(arena, cmd);
+        expand_node(arena, cmd->body);
+    }
+}
+
+void
+drop_parse_cache()
+{
+    /*
+     * helper function to empty the cache the $(...) commands were parsed into, which otherwise
+     * grows with every input
+     */
+
+    for (int i = 0; i < PARSE_CACHE_BUCKETS; i++) {
+        while (parse_cache[i] != NULL) {
+            parse_cache_drop(parse_cache[i]);
+        }
+    }
+}
+
+#ifndef FUZZ_LIBFUZZER
+int
+main(int argc, char *argv[])
+{
+    /*
+     * function to replay inputs without libFuzzer
+     *
+     * usage: fuzz_replay file...
+     */
+
+    struct stat st;
+    uint8_t *data;
+    int fd;
+
+    LLVMFuzzerInitialize(&argc, &argv);
+    for (int i = 1; i < argc; i++) {
+        if ((fd = open(argv[i], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+            perror(argv[i]);
+            return 1;
+        }
+        if ((data = malloc(st.st_size + 1)) == NULL || read(fd, data, st.st_size) != st.st_size) {
+            perror(argv[i]);
+            return 1;
+        }
+        close(fd);
+        LLVMFuzzerTestOneInput(data, st.st_size);
+        free(data);
+    }
+    return 0;
+}
+#endif
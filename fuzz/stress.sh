@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+# stress.sh
+#
+# stress runs of the executor, checking that the shell gives back everything it took:
+#
+#   pipeline  a STAGES-stage pipeline moving data, run PIPE_RUNS times, output checked
+#   jobs      JOBS background `true` jobs, then a wait
+#   pipejobs  PIPE_JOBS background pipelines, then a wait
+#
+# before and after each workload the shell lists /proc/$$/fd, which has to come out the same,
+# and once all jobs are waited for no child of the shell may be left, zombie or not
+#
+# usage: fuzz/stress.sh [mysh binary]
+# environment: STAGES, PIPE_RUNS, JOBS, PIPE_JOBS
+
+MYSH=${1:-./mysh}
+STAGES=${STAGES:-150}
+PIPE_RUNS=${PIPE_RUNS:-20}
+JOBS=${JOBS:-3000}
+PIPE_JOBS=${PIPE_JOBS:-500}
+
+if [ ! -x "$MYSH" ]; then
+    echo "stress.sh: $MYSH: not built, run make first" >&2
+    exit 1
+fi
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+# every stage is a real process, middle cats would be dropped by the shell
+stages=""
+i=0
+while [ $i -lt "$STAGES" ]; do
+    stages="$stages | tr x x"
+    i=$((i + 1))
+done
+
+# the checks run inside mysh, its children get the redirections so its own fds stay untouched
+check() {
+    echo "ls /proc/\$\$/fd > $tmp/fd.$1"
+    echo "ps -o pid=,stat=,args= --ppid \$\$ > $tmp/children.$1"
+}
+
+{
+    check start
+    i=0
+    while [ $i -lt "$PIPE_RUNS" ]; do
+        echo "seq 1 100000 $stages > $tmp/pipeline.out"
+        echo "cmp -s $tmp/pipeline.out $tmp/pipeline.expected || echo pipeline: run $i: wrong output"
+        i=$((i + 1))
+    done
+    check pipeline
+
+    i=0
+    while [ $i -lt "$JOBS" ]; do
+        echo "true &"
+        i=$((i + 1))
+    done
+    echo "wait"
+    check jobs
+
+    i=0
+    while [ $i -lt "$PIPE_JOBS" ]; do
+        echo "seq 1 1000 | tr x x | wc -l > /dev/null &"
+        i=$((i + 1))
+    done
+    echo "wait"
+    check pipejobs
+} > "$tmp/script"
+
+seq 1 100000 > "$tmp/pipeline.expected"
+start=$(date +%s)
+if ! "$MYSH" "$tmp/script" > "$tmp/output" 2>&1; then
+    echo "stress.sh: $MYSH exited with $?" >&2
+    failed=1
+fi
+if [ -s "$tmp/output" ]; then
+    sed 's/^/stress.sh: /' "$tmp/output" >&2
+    failed=1
+fi
+
+for step in pipeline jobs pipejobs; do
+    if [ ! -f "$tmp/fd.$step" ] || ! cmp -s "$tmp/fd.start" "$tmp/fd.$step"; then
+        echo "stress.sh: $step: open fds changed from $(wc -l < "$tmp/fd.start") to $(cat "$tmp/fd.$step" 2>/dev/null | wc -l)" >&2
+        failed=1
+    fi
+    # the only child left is the ps listing them
+    if [ -f "$tmp/children.$step" ] && grep -v " ps " "$tmp/children.$step" | grep -q .; then
+        echo "stress.sh: $step: children left behind:" >&2
+        grep -v " ps " "$tmp/children.$step" >&2
+        failed=1
+    fi
+done
+
+if [ $failed -eq 0 ]; then
+    echo "stress.sh: $STAGES stages x $PIPE_RUNS, $JOBS jobs, $PIPE_JOBS pipeline jobs: ok ($(($(date +%s) - start))s)"
+fi
+exit $failed
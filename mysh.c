@@ -6,305 +6,11815 @@
  * utilizing several commands:
  * fork(2) -- lets us split parent process into an identical child
  * exec(2) -- lets us begin new process within child
+ * posix_spawn(3) -- lets us start a new process without copying the parent (vfork-style)
  * wait(2) -- lets parent process wait until child is finished
  * pipe(2) -- lets us make a channel between two file descriptors
  * dup(2) -- lets us reassign file descriptors
- * fgets(3) -- lets us take user input
- * strtok(3) -- helps with string parsing
+ * read(2) -- lets us take user input, a large chunk at a time
+ *
+ * every line is lexed and parsed exactly once, in the parent, into a small tree
+ * (pipeline -> commands -> argv and redirections) that lives in a per-line arena.
+ * children never parse anything, they only dup2 and exec. the arena keeps its chunks between
+ * lines and the input buffer is reused too, so a typical line costs no allocations at all
+ *
+ * usage: mysh [-i] [-n] [--norc] [--startup-profile] [-c command | script]
+ * without a script or -c, commands are read from stdin. prompts are only printed when stdin is
+ * a terminal (or with -i), so piping commands into mysh produces nothing but their output.
+ * -n only parses the input and reports syntax errors, without running anything
+ *
+ * an interactive shell runs /etc/mysh.rc and ~/.myshrc through source first (unless --norc),
+ * scripts and -c read neither. anything that can wait, like the history file, is only set up
+ * when it is first used, and --startup-profile reports what the steps of starting up cost
+ *
+ * words are expanded right before their command runs: $NAME, ${NAME} (with :-, -, :=, =, :+, +,
+ * :? and ?), ${#NAME}, $?, $!, $$, $#, positional parameters, $@, $*, ${PIPESTATUS[n]} and ~.
+ * the lexer leaves a word in an encoded form only when it has something to expand, so plain
+ * words cost nothing extra. shell variables live in a hash table; exported ones are turned into
+ * the envp of children once and cached until one of them changes
+ *
+ * files run with . (source) and the text of $(...) are parsed once and kept in a cache of
+ * their own arenas, so running them again only walks the tree. a file is parsed again when its
+ * inode, size or mtime change
+ *
+ * unquoted *, ? and [...] are expanded against directories listed with getdents64, whose d_type
+ * spares a stat per entry. the last few listings are cached and used again until the
+ * directory's mtime changes, so a glob in a loop over a big directory reads it only once
+ *
+ * $(...) runs through the same executor with stdout on a pipe the shell drains while it waits,
+ * builtins inside it run without forking and write into a memfd instead
+ *
+ * here-documents (<<, <<-) and here-strings (<<<) are fed from a pipe, or from a memfd when
+ * the text does not fit in one atomic pipe write, so no temporary files are ever created
+ *
+ * on a terminal, lines are read through a small built-in line editor (raw termios) with a
+ * history ring of HISTORY_SIZE entries. Ctrl-R searches the history through a trigram index,
+ * so a search only looks at entries that could match. the history is kept in $MYSH_HISTFILE
+ * (~/.mysh_history by default), which every accepted line is appended to. Tab completes
+ * command names from a prefix trie of the PATH executables, in which only directories whose
+ * mtime changed are read again, and anything else from the directory it names
+ *
+ * lines are lists of pipelines joined by ;, &&, || and the compound commands around them (if,
+ * while, until, for, { }, ( ) and function definitions), which can go on over several lines.
+ * the control flow is run by the shell itself, only the pipelines at the leaves get processes,
+ * and loop bodies give their arena space back every round. functions keep a copy of their
+ * body in an arena of their own
+ *
+ * builtins (cd, echo, printf, test, ...) run inside the shell without forking when they are not
+ * part of a pipeline. in a pipeline they run in a forked child, since posix_spawn can only exec
+ *
+ * right before a pipeline starts, plain `cat` stages are optimized away where possible:
+ * `cat file | prog` becomes `prog < file` and a `cat` in the middle of a pipeline just joins its
+ * neighbours. cat is also a builtin that moves data with copy_file_range/sendfile/splice, so the
+ * bytes never pass through a userspace buffer when the kernel can avoid it
+ *
+ * every pipeline that starts processes gets an entry in the job table. children are reaped with
+ * waitpid and their statuses are recorded per stage, giving $? (the last stage) and PIPESTATUS
+ * (every stage). a pipeline ending in & runs in the background (see jobs, wait, fg, bg)
+ *
+ * SIGCHLD stays blocked and is read from a signalfd instead. the shell sleeps in poll(2) on the
+ * signalfd together with whatever else it waits for (the terminal at the prompt, output pipes in
+ * parallel), so children are reaped whenever they finish, in whatever order, without a signal
+ * handler touching the job table behind the main code's back
+ *
+ * commands are looked up in $PATH once and remembered in a hash table (see the hash builtin),
+ * so children exec the resolved path directly instead of execvp trying every PATH directory
+ *
+ * pipeline stages are started either with fork + exec or with posix_spawn. the default is
+ * chosen at build time (make SPAWN=fork) and can be overridden at runtime with MYSH_SPAWN=fork
+ * or MYSH_SPAWN=posix_spawn, or with `set -o spawn=fork`
+ *
+ * an interactive shell on a terminal puts every job in a process group of its own and hands a
+ * foreground job the terminal (setpgid, tcsetpgrp), so Ctrl-C and Ctrl-Z reach the job and not
+ * the shell. when the last stage of a pipeline exits, the stages feeding it get SIGPIPE at once
+ * (and SIGTERM if they survive that), rather than whenever they happen to write next
+ *
+ * `set -o pipebuf=SIZE` (or MYSH_PIPE_SZ=SIZE) resizes every pipe the shell creates with
+ * F_SETPIPE_SZ, which cuts down on context switches between throughput-bound stages
+ *
+ * `set -o pin=compact` pins the stages of a pipeline to neighbouring CPUs of one NUMA node
+ * (sched_setaffinity, inherited through posix_spawn), and pin=rr spreads parallel instances
+ * over the nodes round-robin
+ *
+ * `limit mem=2G cpu=2 -- pipeline` runs the pipeline in a cgroup v2 of its own, which each stage
+ * is started straight into (clone3 with CLONE_INTO_CGROUP), and setrlimit covers as, files and
+ * the like in every stage
+ *
+ * `timeout 10 pipeline` is enforced by the shell itself: the job's deadline is a timerfd in the
+ * same poll as SIGCHLD, and the whole process group gets SIGTERM, then SIGKILL. $? is 124 while
+ * PIPESTATUS keeps what each stage died of
+ *
+ * `set -o log=FILE` (or MYSH_LOG=FILE) passes the output of every job through pipes of the
+ * shell, which tee(2) it into a mapped ring file for a log shipper and splice(2) it on to where
+ * it was going, without an extra tee process or a copy through user space
+ *
+ * `time pipeline` reports wall and CPU time when the pipeline ends, and MYSH_TRACE=FILE (or
+ * `set -o trace=FILE`) appends a JSON line per stage and per pipeline to FILE, with wait4
+ * resource usage and the shell's own parse and spawn latencies
+ *
+ * the parallel builtin runs one command per argument over a pool of as many workers as there
+ * are CPUs, collecting each instance's output through its own pipe so it comes out in one piece
  */
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <pwd.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <linux/sched.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <dirent.h>
+#include <ctype.h>
+
+#define ARENA_CHUNK_SIZE 8192
+#define ARENA_KEEP_CHUNKS 8
+#define ARGV_INITIAL_SLOTS 16
+#define PATH_TABLE_INITIAL_SLOTS 64
+#define VAR_TABLE_INITIAL_SLOTS 128
+#define PARSE_CACHE_BUCKETS 256
+#define SOURCE_MAX_DEPTH 100
+#define FUNCTION_BUCKETS 64
+#define FUNCTION_MAX_DEPTH 1000
+#define PARSE_MAX_DEPTH 1000     // compound commands that can be open inside each other
+#define SUBST_MAX_DEPTH 1000     // $(...) that can be run inside each other
+#define DEFAULT_PATH "/usr/local/bin:/usr/bin:/bin"
+#define READ_CHUNK_SIZE 65536
+#define COPY_CHUNK_SIZE (1 << 20)
+#define JOBS_INITIAL_SLOTS 8
+#define PROMPT "$ "
+#define PROMPT2 "> "             // while the lines of a here-document or an unfinished command are typed
+#define HISTORY_SIZE 100000
+#define TRIGRAM_BUCKETS 65536
+#define LINE_INITIAL_SIZE 256
+#define TRIE_INITIAL_NODES 4096
+#define FINISHED_SLOTS 256
+#define TEARDOWN_GRACE_MS 200    // a stage that survives the SIGPIPE of a torn down job gets SIGTERM after this
+#define TIMEOUT_KILL_MS 2000     // a job that outlives the signal of its timeout gets SIGKILL after this
+#define TIMEOUT_STATUS 124       // $? of a job that ran out of time, as with timeout(1)
+#define PARALLEL_READ_SIZE 65536
+#define SYSTEM_RC "/etc/mysh.rc"  // run by every interactive shell, before ~/.myshrc
+#define USER_RC ".myshrc"         // in $HOME
+#define STARTUP_STEPS 16         // steps of starting up --startup-profile keeps the times of
+#define DIR_CACHE_SLOTS 8        // directories globs keep the names of
+#define DIR_CACHE_RACY_NS 20000000 // a directory changed within this of being read is read again next time
+#define GLOB_DENTS_SIZE 65536    // getdents64 buffer
+#define LOG_RING_SIZE (4 << 20)  // bytes of records in a set -o log ring
+#define LOG_HEADER_SIZE 4096     // the ring's header, one page in front of the records
+#define LOG_CHUNK 65536          // most output moved into the ring as one record
+#define LOG_WRAP 0xffffffffu     // length of the record that pads the ring up to its end
+
+#define SPAWN_FORK 0
+#define SPAWN_POSIX 1
+
+#ifndef DEFAULT_SPAWN_MODE
+#define DEFAULT_SPAWN_MODE SPAWN_POSIX
+#endif
+
+#define LIMIT_MAX_RLIMITS 8
+#define CPU_PERIOD_US 100000     // period of the cpu.max quota limit cpu= sets
+
+#define PIN_OFF 0
+#define PIN_COMPACT 1            // a job's stages on neighbouring CPUs of one NUMA node
+#define PIN_ROUND_ROBIN 2        // the same, but parallel instances dealt out over the nodes in turn
+
+// states of a process in the job table
+#define PROC_RUNNING 0
+#define PROC_STOPPED 1
+#define PROC_DONE 2
+
+#define TIME_NONE 0
+#define TIME_DEFAULT 1
+#define TIME_POSIX 2
+
+// tokens produced by the lexer
+#define TOKEN_END 0
+#define TOKEN_WORD 1
+#define TOKEN_PIPE 2
+#define TOKEN_LESS 3
+#define TOKEN_GREAT 4
+#define TOKEN_DGREAT 5
+#define TOKEN_AMP 6
+#define TOKEN_DLESS 7
+#define TOKEN_DLESSDASH 8
+#define TOKEN_TLESS 9
+#define TOKEN_LESSAND 10
+#define TOKEN_GREATAND 11
+#define TOKEN_LESSGREAT 12
+#define TOKEN_ANDGREAT 13
+#define TOKEN_ANDDGREAT 14
+#define TOKEN_SEMI 15
+#define TOKEN_AND_IF 16
+#define TOKEN_OR_IF 17
+#define TOKEN_LPAREN 18
+#define TOKEN_RPAREN 19
+
+// kinds of struct node
+#define NODE_PIPELINE 0
+#define NODE_AND 1               // a && b, cond is a and body is b
+#define NODE_OR 2                // a || b
+#define NODE_IF 3
+#define NODE_WHILE 4
+#define NODE_UNTIL 5
+#define NODE_FOR 6
+#define NODE_GROUP 7             // { list; }
+#define NODE_SUBSHELL 8          // ( list ), always run in a child
+#define NODE_FUNCTION 9          // name() compound-command, defines the function when it runs
+
+// redirection kinds, one per redirection operator
+#define REDIR_IN 0
+#define REDIR_OUT 1
+#define REDIR_APPEND 2
+#define REDIR_RDWR 3             // <>
+#define REDIR_DUP 4              // n>&m and n<&m, path is m or - to close n
+#define REDIR_HEREDOC 5          // <<, the body is expanded. here-documents come last
+#define REDIR_HEREDOC_LITERAL 6  // << with a quoted delimiter, the body is used as it is
+#define REDIR_HERESTRING 7       // <<<
+
+// descriptors a builtin run in the shell can redirect, io numbers are a single digit
+#define SAVED_FDS 10
+
+// how the lexer marks up words that need expansion. quotes become these bytes so quoted text
+// is still known after the lexer removed the quotes, without the word ever getting longer
+#define MARK_SQUOTE '\x01'   // start of single-quoted text
+#define MARK_DQUOTE '\x02'   // start of double-quoted text
+#define MARK_END '\x03'      // end of either
+#define MARK_ESCAPE '\x04'   // the next character was escaped with a backslash
+#define MARKS "\x01\x02\x03\x04"
+
+#define VAR_EXPORTED 1
+
+// keys the line editor decodes from escape sequences, above any byte value
+#define KEY_UP 256
+#define KEY_DOWN 257
+#define KEY_RIGHT 258
+#define KEY_LEFT 259
+#define KEY_HOME 260
+#define KEY_END 261
+#define KEY_DELETE 262
+#define KEY_EOF 263
+
+// bump allocator, everything allocated while handling one line is released at once
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+struct arena {
+    struct arena_chunk *head;       // first chunk, kept across resets
+    struct arena_chunk *current;    // chunk allocations are being carved from
+};
+
+// a point in an arena to go back to, giving up everything allocated since (one round of a loop)
+struct arena_mark {
+    struct arena_chunk *chunk;
+    size_t used;
+};
+
+struct redir {
+    struct redir *next;
+    int type;
+    int fd;            // the descriptor being redirected
+    char *path;        // file name, the delimiter of a here-document or the word of a here-string
+    char *body;        // text of a here-document, read from the lines after the command
+    int strip_tabs;    // <<-, leading tabs are removed from the body lines
+    int source;        // here-document contents while posix_spawn is being set up
+    struct redir *next_heredoc;    // next here-document on the same line, while bodies are being read
+};
+
+// NAME=value before a command
+struct assign {
+    struct assign *next;
+    char *name;
+    char *value;
+};
+
+// a single pipe-separated entry, parsed in the parent so it can be handed to either spawn path
+struct command {
+    struct command *next;
+    char **argv;
+    int argc;
+    struct redir *redirs;
+    struct assign *assigns;
+    int expand;        // some word needs expanding before the command can run
+    char *path;        // executable argv[0] resolved to, filled in right before spawning
+    struct builtin *builtin;    // set instead of path when argv[0] is a builtin
+    struct function *function;  // set instead of builtin when argv[0] is a shell function
+    struct node *body;          // compound command (if, while, for, { }, ( )) run instead of argv
+};
+
+struct pipeline {
+    struct command *commands;
+    int num_commands;
+    int background;             // ended with &
+    int timed;                  // prefixed with time (or time -p)
+    int expand;                 // some command needs expanding
+    int negate;                 // started with !, the status is inverted
+    struct command *limits;     // the name=value words of a limit prefix, NULL without one
+    struct command *timeout;    // the options and duration of a timeout prefix, NULL without one
+    char *dropped;              // after optimize_pipeline, per stage written: 1 if it was left out
+    int num_stages;             // stages written, with the ones left out
+};
+
+// header of a set -o log ring file, which a log shipper maps to read the records that follow
+// it. head only grows: the next record goes to LOG_HEADER_SIZE + head % size, and head is
+// stored once the record is complete. records are 8 byte aligned and never cross the end
+struct log_ring {
+    char magic[8];                 // "MYSHLOG", with the 0
+    unsigned int version;          // 1
+    unsigned int header_size;      // LOG_HEADER_SIZE
+    unsigned long long size;       // bytes of records
+    unsigned long long head;       // bytes of records written since the file was made
+};
+
+// in front of every piece of output in the ring
+struct log_record {
+    unsigned int len;              // bytes of output that follow, LOG_WRAP to go on at the start
+    unsigned short job;            // job number, as in jobs and the trace
+    unsigned char stream;          // 1 for stdout, 2 for stderr
+    unsigned char unused;
+};
+
+// what a limit prefix asks for, for every stage of its pipeline
+struct limits {
+    int num_rlimits;
+    char *names[LIMIT_MAX_RLIMITS];      // as given, for error messages
+    int resources[LIMIT_MAX_RLIMITS];    // RLIMIT_*, set in the child
+    rlim_t values[LIMIT_MAX_RLIMITS];
+    long long memory_max;                // for the job's cgroup, -1 where not given
+    long long cpu_quota;                 // microseconds per CPU_PERIOD_US
+    long long pids_max;
+    char *cgroup;                        // the job's cgroup, NULL without one
+    int cgroup_fd;
+};
+
+// one command of a list: a pipeline, or the control flow around pipelines. the tree is never
+// changed by running it, so loops and functions run the same tree again and again
+struct node {
+    struct node *next;          // next command of the same list
+    int type;                   // NODE_
+    struct pipeline *pipeline;  // NODE_PIPELINE
+    struct node *cond;          // condition of if, while and until, left side of && and ||
+    struct node *body;          // then part, loop body, right side of && and ||, list of { } and ( )
+    struct node *orelse;        // else part of if, where elif is another NODE_IF
+    char *name;                 // variable of for, name of a function
+    struct command *words;      // words after for ... in, expanded like arguments. NULL for "$@"
+    struct command *function;   // NODE_FUNCTION: the compound command that becomes the body
+};
+
+struct lexer {
+    char *pos;         // next character to be scanned
+    char *word;        // text of the last TOKEN_WORD, unquoted in place
+    int token;         // last token returned by next_token
+    int held_token;    // operator scanned while ending a word, returned on the next call
+    int expand;        // the last word was left encoded for expansion
+    int quoted;        // the last word had quotes or backslashes in it
+    int io_number;     // n of a n> or n< just scanned, -1 without one
+    struct redir *heredocs;        // here-documents whose bodies still have to be read
+    struct redir **heredoc_tail;
+    struct input *input;           // where an unfinished command goes on, NULL if it cannot
+    struct arena *arena;           // the lines read from there are copied into this
+    int depth;                     // compound commands open, where a newline does not end the input
+    int more_lines;    // the last TOKEN_END was a line end inside the text, its next line is at pos
+    int held_newline;  // a word ended at a line end, TOKEN_END with more_lines comes next
+};
+
+// a shell variable. the value is kept as "name=value", so it can go into envp as it is
+struct var {
+    char *name;        // NULL marks a free slot
+    char *pair;        // NULL while the variable has no value (export NAME before NAME=...)
+    size_t name_len;
+    int flags;         // VAR_EXPORTED
+};
+
+struct var_table {
+    struct var *slots;
+    size_t num_slots;  // always a power of two
+    size_t count;
+};
+
+// words being built while expanding
+struct expansion {
+    struct arena *arena;
+    int split;         // split unquoted expansions into fields, otherwise build one string
+    char *start;       // start of the word, where ~ is expanded
+    char *buf;         // field being built
+    size_t len;
+    size_t cap;
+    int has_field;     // the current field exists even if it is empty ("")
+    char **fields;
+    int num_fields;
+    int cap_fields;
+    int failed;        // ${NAME:?} reported an error
+    int nested;        // inside the word of ${NAME-word}, where unquoted text is split too
+    int glob;          // the field has an unquoted * ? or [ in it
+    int escaped;       // a quoted one is in there behind a MARK_ESCAPE
+};
+
+// the names in a directory as a glob last read them, so the next glob over it can skip the read
+struct dir_listing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;     // as it was when read, it changes with the names in the directory
+    long long read_ns;         // CLOCK_REALTIME of the read
+    unsigned long used;        // for replacing the least recently used, 0 for a free slot
+    char *entries;             // for every entry but . and ..: its d_type, then the name and its 0
+    size_t size;
+};
+
+// one started pipeline. stages that could not be started are recorded as already done
+struct process {
+    pid_t pid;               // -1 for a stage that never started
+    int status;              // wait status once the process is done
+    int state;
+    char name[32];           // argv[0], for traces
+    int feeds_pipe;          // writes into the pipe to the next stage, after its redirections
+    int cpu;                 // CPU it was pinned to, -1 if it was not
+    long long start_ns;      // when the shell started spawning it
+    long long end_ns;        // when it was reaped
+    long long spawn_ns;      // time spent in spawn_command
+    long long exec_ns;       // fork to exec, -1 where it is not measured
+    struct rusage rusage;    // from wait4
+};
+
+struct job {
+    int id;            // job number, starting at 1
+    pid_t pgid;        // process group the stages run in
+    int background;    // nobody is waiting for it, report it when it finishes
+    unsigned long seq; // when the job was started (or last stopped), for %+ and %-
+    char *command;     // text shown by jobs
+    char *cgroup;      // transient cgroup of a limit prefix, removed with the job
+    int timed;         // TIME_NONE, or the format time reports in
+    long long start_ns;
+    long long parse_ns;
+    long long spawn_ns; // the whole spawn loop
+    long long teardown_ns; // when the stages feeding the finished last one got SIGPIPE, -1 after SIGTERM
+    long long deadline_ns; // next thing a timeout prefix does: the signal, then SIGKILL. 0 for nothing
+    long long kill_after_ns; // from the signal to SIGKILL, 0 for never
+    int timeout_signal;
+    int timed_out;     // got the signal of its timeout
+    int log_fds[2];    // with set -o log, read ends of the job's stdout and stderr pipes, -1 once closed
+    char *dropped;     // stages of the pipeline as written that were left out, NULL for none
+    int num_stages;    // stages as written, the PIPESTATUS entries the job makes
+    int num_procs;
+    struct process procs[];
+};
+
+// one instance of a parallel command, with the output it produced so far
+struct parallel_task {
+    char *value;       // the argument this instance runs with
+    int fd;            // read end of its stdout pipe, -1 once it hit end of file (or ungrouped)
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+// background jobs that were already reported and removed, so `wait pid` can still get their status
+struct finished_proc {
+    pid_t pid;
+    int status;
+};
+
+// commands run by the shell itself. the table is kept sorted by name for bsearch
+struct builtin {
+    char *name;
+    int (*func)(char **argv);
+    int (*handles)(char **argv);    // optional, returns 0 for arguments only the external program understands
+    int state;                      // changes the shell itself, so inside $(...) it gets a child like a subshell
+};
+
+// output of a $(...) being run. children write into the pipe, builtins run in the shell write
+// into the memfd, since nothing would read the pipe while they run
+struct capture {
+    int fd;            // read end of the pipe, non-blocking
+    int memfd;         // -1 until a builtin needs it
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+// command name -> absolute path cache, open addressing with linear probing
+struct path_entry {
+    char *name;        // NULL marks an empty slot
+    char *path;
+    unsigned hits;
+};
+
+struct path_table {
+    struct path_entry *slots;
+    size_t num_slots;  // always a power of two
+    size_t count;
+    char *path_var;    // copy of $PATH the entries were resolved against
+};
+
+// source text parsed once and kept, so running it again skips the lexer and the parser. files
+// run with . are keyed by their path, and reparsed when the file changes. $(...) bodies are
+// keyed by their text
+struct parsed_line {
+    struct parsed_line *next;
+    struct node *list;              // NULL for a line with a syntax error, reported when it was parsed
+    int line_number;
+};
 
-#define MAX_INPUT_LEN 4096
-#define MAX_ARGS 10
+struct parse_entry {
+    struct parse_entry *next;       // next entry in the same bucket
+    char *key;                      // the path, or the text itself
+    int is_file;
+    struct stat st;                 // the file as it was when it was parsed
+    struct arena arena;             // holds everything below, and the key
+    struct parsed_line *lines;
+    int users;                      // runs of it still going on (a file can . itself)
+    int stale;                      // dropped from the cache, freed once nobody uses it
+};
+
+// a shell function. the body is copied out of the line that defined it, into an arena of its own
+struct function {
+    struct function *next;          // next function in the same bucket
+    char *name;
+    struct command *body;           // compound command, with the redirections after it
+    struct arena arena;
+    int users;                      // calls of it still running (it may redefine itself)
+    int stale;                      // redefined or unset, freed once the last call returns
+};
+
+// where lines come from: stdin, a script file or the -c string
+struct input {
+    int fd;            // descriptor lines are read from, -1 once it hit end of file (or for -c)
+    char *buf;
+    size_t len;        // bytes of buf holding input
+    size_t pos;        // start of the next line
+    size_t cap;
+    char *name;        // script name used in error messages, NULL when reading stdin or -c
+    int line_number;
+    int interactive;   // print a prompt before every line
+    int editing;       // stdin is a terminal, lines come from the line editor
+};
+
+// one bucket of the history's trigram index: the entries containing a trigram that hashes here,
+// oldest first. entries that fell out of the ring are dropped lazily from the front
+struct trigram_list {
+    unsigned int *seqs;
+    int start;         // first live element
+    int len;
+    int cap;
+};
+
+// the last HISTORY_SIZE lines, by sequence number: seq lives in entries[seq % HISTORY_SIZE]
+struct history {
+    char **entries;
+    unsigned long count;              // lines ever added, which is the seq of the next one
+    int fd;                           // history file, opened for appending, -1 if there is none
+    struct trigram_list *trigrams;    // TRIGRAM_BUCKETS lists
+};
+
+// state of the line being edited
+struct line_editor {
+    char *buf;
+    size_t len;
+    size_t pos;        // cursor
+    size_t cap;
+    long browse;       // history seq being shown, -1 for the line being typed
+    char *typed;       // the line being typed, kept while browsing the history
+    struct termios cooked;
+};
+
+// a PATH directory the executables in the trie came from
+struct path_dir {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;     // as it was when read, it changes with the names in the directory
+    long long read_ns;         // CLOCK_REALTIME of the read, 0 before the first one
+    char *names;               // the executables found in it, each with its 0
+    size_t size;
+};
+
+// prefix trie of the executables in PATH, for completing command names. the nodes live in one
+// array and refer to each other by index, node 0 is the root
+struct trie_node {
+    int child;                 // first child, 0 for none
+    int next;                  // next sibling, in byte order
+    int names;                 // names in the subtree, a name in two directories counts twice
+    int ends;                  // names ending right here
+    unsigned char c;
+};
+
+struct command_trie {
+    struct trie_node *nodes;
+    int num_nodes;
+    int cap;
+    struct path_dir *dirs;     // the directories of path_var, in order
+    int num_dirs;
+    char *path_var;            // copy of $PATH the trie was built from
+};
+
+// the matches of a completion, in the arena of the completion
+struct completions {
+    char **items;
+    int count;
+    int cap;
+};
+
+extern char **environ;
+
+int spawn_mode = DEFAULT_SPAWN_MODE;
+int noexec;                  // -n: parse commands without running them
+int norc;                    // --norc: an interactive shell skips the rc files
+int startup_profile;         // --startup-profile: report what starting up spent its time on
+char *startup_names[STARTUP_STEPS];
+long long startup_ns[STARTUP_STEPS];  // when each step of starting up was done
+int num_startup_steps;
+struct history history;
+int history_wanted;          // the line editor is on, so the history is loaded when first needed
+struct line_editor editor;
+struct var_table vars;
+char **env_cache;              // envp built from the exported variables
+int env_dirty = 1;             // an exported variable changed since env_cache was built
+char **positional;             // $0, $1, ...
+char *default_positional[1];   // positional parameters of an interactive shell, just $0
+int num_positional;            // $#
+pid_t shell_pid;               // $$
+long pipe_size;              // size requested with set -o pipebuf, 0 for the kernel default
+long pipe_size_effective;    // size the kernel actually gives our pipes
+struct path_table path_table;
+struct command_trie command_trie;
+struct dir_listing dir_cache[DIR_CACHE_SLOTS];
+struct parse_entry *parse_cache[PARSE_CACHE_BUCKETS];
+int source_depth;              // files being run with . right now
+struct node empty_line = {NULL, NODE_GROUP};  // what parse_line returns for a line without commands
+struct function *functions[FUNCTION_BUCKETS];
+int num_functions;             // so commands skip the lookup while no function is defined
+int function_depth;            // function calls being run
+int loop_depth;                // loops being run in the current function, the most break can leave
+int breaking;                  // loops a break still has to leave
+int continuing;                // loops a continue still has to leave, it goes on with the last one
+int returning;                 // a return is on its way out of the function or file
+struct input *current_input;
+char *prompt = PROMPT;         // printed by print_prompt and the line editor
+struct capture *current_capture;  // innermost $(...) being run, NULL outside of one
+int subst_depth;               // $(...) being run right now
+int subst_status = -1;         // status of the last $(...) of the command being expanded, -1 if none
+int last_status;               // $?
+int *pipestatus;               // PIPESTATUS, the status of every stage of the last pipeline
+int pipestatus_len;
+int pipestatus_kept;           // a builtin set PIPESTATUS itself (parallel), running it alone keeps that
+int pipestatus_cap;
+struct job **jobs;             // job table, indexed by job id - 1. NULL marks a free slot
+int jobs_cap;
+unsigned long job_seq;
+pid_t last_bg_pid;             // $!
+struct finished_proc finished[FINISHED_SLOTS];
+int finished_next;
+sigset_t sigchld_mask;         // just SIGCHLD, which the shell keeps blocked
+sigset_t child_sigmask;        // mask the shell started with, which children get back
+int sigchld_fd = -1;           // signalfd delivering SIGCHLD
+int timer_fd = -1;             // timerfd armed for the earliest deadline of a timeout job, made when first needed
+sigset_t child_sigdefault;     // signals children put back to their default action before they exec
+volatile sig_atomic_t interrupted; // a SIGINT stops the current line
+int job_control;               // interactive on a terminal: every job gets a process group and the terminal
+int interactive_shell;         // the shell's own input is interactive, it survives what ends a script
+int tty_fd = -1;               // the terminal, while job control is on
+pid_t shell_pgid;              // process group of the shell itself
+struct termios shell_tmodes;   // terminal modes put back after a job stopped or died of a signal
+pid_t spawn_pgid = -1;         // group spawn_command puts children in: -1 the shell's, 0 a new one
+int spawn_foreground;          // spawn_command hands a new group the terminal
+int spawn_cpu = -1;            // CPU spawn_command pins the child to, -1 for none
+struct limits *spawn_limits;   // limits of the pipeline spawn_command starts a stage of, or NULL
+char *cgroup_root;             // the cgroup v2 directory job cgroups are made in, once found
+char *cgroup_leaf;             // leaf cgroup find_cgroup_root moved the shell into, NULL if it did not
+char cgroup_enabled[64];       // controllers find_cgroup_root turned on, as "-memory -cpu" to undo it
+int cgroup_state;              // 0 before looking for cgroup_root, 1 if found, -1 if there is none
+unsigned long cgroup_seq;      // for the names of job cgroups
+int pin_policy = PIN_OFF;      // set -o pin
+cpu_set_t pin_allowed;         // the shell's own affinity when pinning was turned on
+int *pin_cpus;                 // the CPUs in pin_allowed, grouped by NUMA node
+int num_pin_cpus;
+int *pin_nodes;                // where each node's CPUs start in pin_cpus, and where the last ends
+int num_pin_nodes;
+int pin_cursor;                // index in pin_cpus the next compact job starts at
+FILE *trace_file;              // MYSH_TRACE, NULL when tracing is off
+char *trace_path;
+struct log_ring *log_ring;     // set -o log: the mapped header of the ring file, NULL when off
+int log_fd = -1;               // the ring file
+int log_pipe[2] = {-1, -1};    // where output is tee'd on its way into the ring
+char *log_path;
+struct sigaction log_sigpipe;  // SIGPIPE as it was before set -o log ignored it
+int spawn_stderr_fd = -1;      // stderr spawn_command gives the child, -1 to leave it
+long long line_parse_ns;       // parse time of the current line, reported with its first pipeline
+long long last_exec_ns;        // fork to exec of the last fork_command while tracing, else -1
 
 void print_prompt();
-void process_args(char *arg_str, int read_fd, int write_fd);
-int count_pipes(char *input_str);
-int count_redirs(char *arg_str);
+void init_options();
+int set_option(char *name, char *value);
+int open_log_ring(char *path);
+void close_log_ring();
+int pump_log(struct job *job, int stream);
+void log_append(struct job *job, int stream, size_t len);
+void close_log(struct job *job);
+long parse_size(char *str);
+long probe_pipe_size(long size);
+void open_input(struct input *input, int argc, char *argv[]);
+char *next_line(struct input *input);
+void shell_error(const char *fmt, ...);
+void init_history();
+void load_history();
+void load_rc_files();
+void startup_step(char *name);
+void startup_report();
+void history_add(char *line, int save);
+char *history_get(unsigned long seq);
+unsigned long history_first();
+void history_index(unsigned long seq, char *line);
+long history_search(char *query, long before);
+unsigned int trigram_hash(char *str);
+ssize_t edit_line(struct input *input);
+int edit_raw(int on);
+int read_key();
+void edit_refresh();
+void edit_insert(char *str, size_t len);
+void edit_set(char *str);
+void edit_history(int older);
+int edit_search();
+void edit_complete(int list);
+void edit_insert_quoted(char *str, size_t len);
+void edit_list(struct completions *found);
+void complete_add(struct arena *arena, struct completions *found, char *name, size_t len);
+void complete_commands(struct arena *arena, struct completions *found, char *prefix);
+void complete_files(struct arena *arena, struct completions *found, char *word);
+void trie_update();
+void trie_read_dir(struct path_dir *dir, struct stat *st);
+void trie_add(char *name, int delta);
+int trie_find(char *prefix);
+void trie_collect(struct arena *arena, struct completions *found, int node, char *name, size_t len);
+void edit_write(char *str, size_t len);
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_grow(struct arena *arena, void *ptr, size_t old_size, size_t new_size);
+void arena_reset(struct arena *arena);
+void arena_free(struct arena *arena);
+void arena_save(struct arena *arena, struct arena_mark *mark);
+void arena_rewind(struct arena *arena, struct arena_mark *mark);
+int next_token(struct lexer *lex);
+int scan_operator(struct lexer *lex);
+int next_input_line(struct lexer *lex);
+char *read_more_input(struct lexer *lex);
+int join_next_line(struct lexer *lex, char **out, char *separator);
+char *find_subst_end(struct lexer *lex, char **out);
+int skip_newlines(struct lexer *lex);
+int is_keyword(struct lexer *lex, char *word);
+int is_reserved(struct lexer *lex, char **words);
+int is_redir_token(int token);
+struct node *parse_line(struct arena *arena, char *line, struct input *input);
+struct node *parse_list(struct arena *arena, struct lexer *lex, char **ends);
+struct node *parse_body(struct arena *arena, struct lexer *lex, char **ends);
+struct node *parse_and_or(struct arena *arena, struct lexer *lex);
+struct pipeline *parse_pipeline(struct arena *arena, struct lexer *lex);
+struct command *parse_compound(struct arena *arena, struct lexer *lex);
+struct node *parse_if(struct arena *arena, struct lexer *lex);
+struct node *parse_for(struct arena *arena, struct lexer *lex);
+struct node *parse_do(struct arena *arena, struct lexer *lex);
+struct command *parse_function(struct arena *arena, struct lexer *lex, struct command *cmd);
+struct redir **parse_command_redir(struct arena *arena, struct lexer *lex, struct command *cmd, struct redir **tail);
+void add_arg(struct arena *arena, struct command *cmd, char *word, int *slots);
+struct node *new_node(struct arena *arena, int type);
+struct command *new_command(struct arena *arena);
+struct pipeline *subshell_pipeline(struct arena *arena, struct node *list);
+struct parse_entry *parse_cache_find(char *key, int is_file);
+struct parse_entry *parse_cache_add(char *key, int is_file);
+void parse_cache_drop(struct parse_entry *entry);
+void parse_cache_release(struct parse_entry *entry);
+struct node *parse_cached(char *text, size_t len);
+struct parse_entry *parse_file(char *path, struct stat *st);
+int parse_prefixes(struct arena *arena, struct lexer *lex, struct pipeline *pipeline);
+int command_follows(struct lexer *lex);
+void prefix_word(struct arena *arena, struct lexer *lex, struct command *words, int *slots);
+struct command *parse_command(struct arena *arena, struct lexer *lex);
+struct redir *parse_redir(struct arena *arena, struct lexer *lex);
+void syntax_error(struct lexer *lex);
+int word_expands(char *word);
+char *strip_marks(char *word, int force);
+struct pipeline *expand_pipeline(struct arena *arena, struct pipeline *pipeline);
+struct command *expand_command(struct arena *arena, struct command *cmd);
+char *expand_string(struct arena *arena, char *word);
+void expand_range(struct expansion *e, char *p, char *end, int dq);
+char *expand_dollar(struct expansion *e, char *p, char *end, int dq);
+char *find_brace(char *p, char *end);
+char *subst_end(char *p);
+void command_subst(struct expansion *e, char *text, size_t len, int dq);
+void capture_read(struct capture *capture);
+void capture_memfd(struct capture *capture);
+char *param_value(char *name, size_t len, char *buf);
+void expand_list(struct expansion *e, char **items, int count, int dq, int separate);
+char *expand_tilde(struct expansion *e, char *p, char *end);
+void exp_add(struct expansion *e, char *str, size_t len);
+void exp_add_value(struct expansion *e, char *value, size_t len, int dq);
+void exp_end_field(struct expansion *e);
+void exp_add_pattern(struct expansion *e, char *str, size_t len);
+void exp_push_field(struct expansion *e, char *str, size_t len);
+int glob_chars(char *word);
+void glob_walk(struct expansion *e, char *path, size_t path_len, char *pattern);
+void glob_emit(struct expansion *e, char *path, size_t path_len, int type, int slash);
+int glob_match(char *p, char *end, char *name);
+char *glob_bracket(char *p, char *end, int c, int *matched);
+int glob_meta(char *p, char *end);
+struct dir_listing *read_dir(char *path);
+int compare_strings(const void *a, const void *b);
+void exp_free(struct expansion *e);
+void init_vars(char *argv0);
+struct var *var_find(char *name, size_t len);
+char *get_var(char *name);
+char *get_var_len(char *name, size_t len);
+void set_var(char *name, char *value, int flags);
+void unset_var(char *name);
+char **get_envp();
+char **command_envp(struct command *cmd);
+unsigned long hash_bytes(char *str, size_t len);
+void read_heredocs(struct arena *arena, struct lexer *lex);
+char *read_heredoc(struct arena *arena, struct redir *redir, char **text);
+int here_fd(struct redir *redir);
+int open_redir(struct redir *redir);
+int apply_redir(struct redir *redir);
+int redir_source(char *word);
+void execute_list(struct arena *arena, struct node *list);
+void execute_node(struct arena *arena, struct node *node);
+void execute_loop(struct arena *arena, struct node *node);
+void execute_pipeline(struct arena *arena, struct pipeline *pipeline);
+int runs_here(struct command *cmd);
+int run_compound(struct arena *arena, struct command *cmd);
+pid_t spawn_command(struct command *cmd, int read_fd, int write_fd, int unused_fd);
+pid_t fork_command(struct command *cmd, int read_fd, int write_fd, int unused_fd);
+pid_t posix_spawn_command(struct command *cmd, int read_fd, int write_fd, int unused_fd);
+void process_args(struct command *cmd, int read_fd, int write_fd);
+int redir_flags(int type);
+void init_signals();
+int wait_events(int fd, int timeout_ms);
+void reap_children();
+int prepare_timeout(struct arena *arena, struct command *words, struct job *job);
+int timeout_option(char *word, char **value);
+long long parse_duration(char *str);
+int parse_signal(char *str);
+void arm_timer();
+void expire_timeouts();
+void signal_job(struct job *job, int sig);
+struct job *new_job(int num_procs);
+void free_job(struct job *job);
+int job_done(struct job *job);
+int job_stopped(struct job *job);
+void wait_for_job(struct job *job);
+void init_job_control();
+void on_sigint(int sig);
+int unwinding();
+int output_piped(struct command *cmd);
+void tear_down(struct job *job);
+void continue_job(struct job *job);
+int load_topology();
+int read_cpulist(char *path, cpu_set_t *set);
+int pin_node(int index);
+int pin_reserve(int count);
+int pin_cpu(int start, int stage);
+int pin_round_robin(int instance);
+int pin_to(pid_t pid, int cpu);
+int prepare_limits(struct arena *arena, struct command *words, struct limits *limits);
+long long limit_value(char *value, int size);
+int make_job_cgroup(struct limits *limits);
+int find_cgroup_root();
+void leave_cgroup();
+int has_controller(char *list, char *name);
+ssize_t read_text(char *path, char *buf, size_t size);
+int write_text(char *path, char *text);
+long long parse_bytes(char *str);
+void finish_foreground(struct job *job);
+void record_status(pid_t pid, int status, struct rusage *rusage);
+int notify_jobs(int verbose);
+void forget_job(struct job *job);
+void print_job(struct job *job, int show_pids);
+char *format_pipeline(struct pipeline *pipeline);
+struct job *find_job(char *spec, char *builtin_name);
+int exit_status(int wait_status);
+void set_pipestatus(struct job *job);
+void set_pipestatus_single(int status);
+void report_signal(struct job *job);
+long long now_ns();
+long long timeval_ns(struct timeval *tv);
+void print_times(int format, long long real_ns, long long user_ns, long long sys_ns);
+void trace_job(struct job *job);
+void shell_usage(struct rusage usage[2]);
+long long usage_ns(struct rusage usage[2], int sys);
+void trace_builtin(struct command *cmd, long long wall_ns, struct rusage before[2], struct rusage after[2], int status);
+void trace_string(char *str);
+char **sh_fallback_argv(struct command *cmd);
+unsigned long hash_string(char *str);
+struct path_entry *path_table_find(char *name);
+char *lookup_command(char *name);
+char *lookup_command_path(struct command *cmd);
+char *search_path(char *name, int mode);
+char *search_dirs(char *path_var, char *name, int mode);
+void path_table_forget(char *name);
+void path_table_clear();
+struct pipeline *optimize_pipeline(struct arena *arena, struct pipeline *pipeline);
+int is_middle_cat(struct command *cmd);
+int is_plain_cat(struct command *cmd);
+struct builtin *find_builtin(char **argv);
+int compare_builtin(const void *name, const void *builtin);
+int run_builtin(struct command *cmd);
+char **save_assigns(struct assign *assigns);
+void restore_assigns(struct assign *assigns, char **saved);
+struct function *find_function(char *name);
+void define_function(char *name, struct command *body);
+int remove_function(char *name);
+void release_function(struct function *function);
+int call_function(struct arena *arena, struct command *cmd);
+struct command *copy_command(struct arena *arena, struct command *cmd);
+struct node *copy_node(struct arena *arena, struct node *node);
+char *copy_string(struct arena *arena, char *str);
+int redirect_here(struct redir *redirs, int saved_fds[SAVED_FDS]);
+void restore_fds(int saved_fds[SAVED_FDS]);
+int builtin_colon(char **argv);
+int builtin_false(char **argv);
+int builtin_exit(char **argv);
+int builtin_cd(char **argv);
+int builtin_pwd(char **argv);
+int builtin_export(char **argv);
+int builtin_unset(char **argv);
+int builtin_source(char **argv);
+int builtin_break(char **argv);
+int builtin_return(char **argv);
+int compare_vars(const void *a, const void *b);
+int builtin_set(char **argv);
+int builtin_echo(char **argv);
+int builtin_printf(char **argv);
+int print_escape(char *str, int in_b);
+int print_format(char *fmt, char ***args);
+int printf_number(char *arg, long long *result);
+int printf_real(char *arg, double *result);
+int builtin_test(char **argv);
+int builtin_bracket(char **argv);
+int test_or(char **argv, int argc, int *pos);
+int test_and(char **argv, int argc, int *pos);
+int test_not(char **argv, int argc, int *pos);
+int test_primary(char **argv, int argc, int *pos);
+int test_unary(char *op, char *arg);
+int test_binary(char *left, char *op, char *right);
+int test_integer(char *str, long long *result);
+int valid_name(char *name, char *end);
+int builtin_history(char **argv);
+int builtin_jobs(char **argv);
+int builtin_wait(char **argv);
+int builtin_fg(char **argv);
+int builtin_bg(char **argv);
+int builtin_parallel(char **argv);
+char **parallel_argv(char **template, char *value);
+int parallel_read(struct parallel_task *task);
+void parallel_flush(struct parallel_task *task, int tag);
+int builtin_cat(char **argv);
+int cat_handles(char **argv);
+int copy_fd(int in_fd, int out_fd);
+int builtin_hash(char **argv);
+
+struct builtin builtins[] = {
+    {".", builtin_source, NULL, 1},
+    {":", builtin_colon},
+    {"[", builtin_bracket},
+    {"bg", builtin_bg, NULL, 1},
+    {"break", builtin_break, NULL, 1},
+    {"cat", builtin_cat, cat_handles},
+    {"cd", builtin_cd, NULL, 1},
+    {"continue", builtin_break, NULL, 1},
+    {"echo", builtin_echo},
+    {"exit", builtin_exit, NULL, 1},
+    {"export", builtin_export, NULL, 1},
+    {"false", builtin_false},
+    {"fg", builtin_fg, NULL, 1},
+    {"hash", builtin_hash, NULL, 1},
+    {"history", builtin_history},
+    {"jobs", builtin_jobs},
+    {"parallel", builtin_parallel},
+    {"printf", builtin_printf},
+    {"pwd", builtin_pwd},
+    {"return", builtin_return, NULL, 1},
+    {"set", builtin_set, NULL, 1},
+    {"source", builtin_source, NULL, 1},
+    {"test", builtin_test},
+    {"true", builtin_colon},
+    {"unset", builtin_unset, NULL, 1},
+    {"wait", builtin_wait, NULL, 1},
+};
+
+int
+main(int argc, char *argv[])
+{
+    struct input input;
+    struct arena arena = {NULL, NULL};
+    struct node *list;
+    char *line;
+
+    startup_step(NULL);
+    init_vars(argv[0]);
+    startup_step("vars");
+    init_options();
+    startup_step("options");
+    init_signals();
+    startup_step("signals");
+    open_input(&input, argc, argv);
+    current_input = &input;
+    interactive_shell = input.interactive;
+    startup_step("input");
+    if (input.interactive) {
+        init_job_control();
+        startup_step("job control");
+        if (!norc) {
+            load_rc_files();
+        }
+    }
+    startup_report();
+
+    if (input.interactive) {
+        print_prompt();
+    }
+
+    while((line = next_line(&input)) != NULL) {
+        interrupted = 0;
+        if (trace_file != NULL) {
+            line_parse_ns = now_ns();
+            list = parse_line(&arena, line, &input);
+            line_parse_ns = now_ns() - line_parse_ns;
+        }
+        else {
+            list = parse_line(&arena, line, &input);
+        }
+
+        // a NULL list means a syntax error, which has already been reported
+        if (list == NULL) {
+            last_status = 2;
+        }
+        else if (!noexec) {
+            execute_list(&arena, list);
+        }
+
+        // a Ctrl-C only stops the line it came in
+        if (interrupted) {
+            last_status = 128 + SIGINT;
+        }
+
+        // everything parse_line allocated belonged to this line only
+        arena_reset(&arena);
+
+        // background jobs that finished meanwhile are announced before the next prompt. scripts
+        // keep them until jobs or wait asks for them
+        if (input.interactive) {
+            notify_jobs(1);
+            print_prompt();
+        }
+    }
+    return last_status;
+}
+
+void
+print_prompt()
+{
+    // the line editor draws its own prompt
+    if (current_input->editing) {
+        return;
+    }
+
+    // input no longer goes through stdio, so nothing else would flush the prompt
+    fputs(prompt, stdout);
+    fflush(stdout);
+}
+
+void
+init_options()
+{
+    /*
+     * helper function to apply options given through the environment: MYSH_SPAWN overrides the
+     * build-time spawn path, MYSH_PIPE_SZ sets the pipe buffer size, MYSH_TRACE turns on
+     * tracing and MYSH_PIN pinning, like set -o would
+     */
+
+    char *value;
+
+    if ((value = get_var("MYSH_SPAWN")) != NULL && *value != 0 && set_option("spawn", value) < 0) {
+        fprintf(stderr, "mysh: ignoring MYSH_SPAWN\n");
+    }
+    if ((value = get_var("MYSH_PIPE_SZ")) != NULL && *value != 0 && set_option("pipebuf", value) < 0) {
+        fprintf(stderr, "mysh: ignoring MYSH_PIPE_SZ\n");
+    }
+    if ((value = get_var("MYSH_TRACE")) != NULL && *value != 0 && set_option("trace", value) < 0) {
+        fprintf(stderr, "mysh: ignoring MYSH_TRACE\n");
+    }
+    if ((value = get_var("MYSH_PIN")) != NULL && *value != 0 && set_option("pin", value) < 0) {
+        fprintf(stderr, "mysh: ignoring MYSH_PIN\n");
+    }
+    if ((value = get_var("MYSH_LOG")) != NULL && *value != 0 && set_option("log", value) < 0) {
+        fprintf(stderr, "mysh: ignoring MYSH_LOG\n");
+    }
+}
+
+int
+set_option(char *name, char *value)
+{
+    /*
+     * function to change one of the shell options
+     *
+     * args:
+     *  char *name: option name, "spawn", "pipebuf", "trace", "pin" or "log"
+     *  char *value: new value, or NULL to go back to the default
+     *
+     * returns:
+     *  0 on success, -1 for an unknown option or a bad value (message is printed)
+     */
+
+    long size;
+
+    if (strcmp(name, "spawn") == 0) {
+        if (value == NULL) {
+            spawn_mode = DEFAULT_SPAWN_MODE;
+        }
+        else if (strcmp(value, "fork") == 0) {
+            spawn_mode = SPAWN_FORK;
+        }
+        else if (strcmp(value, "posix_spawn") == 0 || strcmp(value, "spawn") == 0) {
+            spawn_mode = SPAWN_POSIX;
+        }
+        else {
+            shell_error("spawn: %s: must be fork or posix_spawn", value);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (strcmp(name, "pipebuf") == 0) {
+        if (value == NULL) {
+            pipe_size = pipe_size_effective = 0;
+            return 0;
+        }
+        if ((size = parse_size(value)) < 0) {
+            shell_error("pipebuf: %s: invalid size", value);
+            return -1;
+        }
+        if ((pipe_size_effective = probe_pipe_size(size)) < 0) {
+            pipe_size = pipe_size_effective = 0;
+            return -1;
+        }
+        pipe_size = size;
+        if (pipe_size_effective < pipe_size) {
+            shell_error("pipebuf: %ld bytes requested, the kernel caps pipes at %ld (see /proc/sys/fs/pipe-max-size)",
+                    pipe_size, pipe_size_effective);
+        }
+        return 0;
+    }
+
+    if (strcmp(name, "trace") == 0) {
+        if (trace_file != NULL) {
+            fclose(trace_file);
+            free(trace_path);
+            trace_file = NULL;
+            trace_path = NULL;
+        }
+        if (value == NULL) {
+            return 0;
+        }
+        // "e" is close-on-exec, children must not write into the trace
+        if ((trace_file = fopen(value, "ae")) == NULL) {
+            shell_error("trace: %s: %s", value, strerror(errno));
+            return -1;
+        }
+        if ((trace_path = strdup(value)) == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+        return 0;
+    }
+
+    if (strcmp(name, "pin") == 0) {
+        if (value == NULL || strcmp(value, "off") == 0) {
+            pin_policy = PIN_OFF;
+            return 0;
+        }
+        if (strcmp(value, "compact") != 0 && strcmp(value, "rr") != 0) {
+            shell_error("pin: %s: must be compact, rr or off", value);
+            return -1;
+        }
+
+        // the topology is read once, while the shell still has its full affinity
+        if (pin_cpus == NULL && load_topology() < 0) {
+            return -1;
+        }
+        pin_policy = strcmp(value, "compact") == 0 ? PIN_COMPACT : PIN_ROUND_ROBIN;
+        return 0;
+    }
+
+    if (strcmp(name, "log") == 0) {
+        close_log_ring();
+        return value != NULL ? open_log_ring(value) : 0;
+    }
+
+    shell_error("%s: invalid option name", name);
+    return -1;
+}
+
+int
+open_log_ring(char *path)
+{
+    /*
+     * function to map the ring file of set -o log, made with the default size if it is not a
+     * ring of that size already. an existing ring goes on where it was, so a shipper that was
+     * reading it keeps its place
+     *
+     * returns:
+     *  0 on success, -1 if the file cannot be used (message is printed)
+     */
+
+    struct sigaction ignore;
+    struct log_ring *ring;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 || fstat(fd, &st) < 0) {
+        shell_error("log: %s: %s", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (st.st_size != LOG_HEADER_SIZE + LOG_RING_SIZE && ftruncate(fd, LOG_HEADER_SIZE + LOG_RING_SIZE) < 0) {
+        shell_error("log: %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if ((ring = mmap(NULL, LOG_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        shell_error("log: %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (memcmp(ring->magic, "MYSHLOG", 8) != 0 || ring->version != 1 || ring->header_size != LOG_HEADER_SIZE ||
+            ring->size != LOG_RING_SIZE) {
+        memset(ring, 0, sizeof(struct log_ring));
+        memcpy(ring->magic, "MYSHLOG", 8);
+        ring->version = 1;
+        ring->header_size = LOG_HEADER_SIZE;
+        ring->size = LOG_RING_SIZE;
+    }
+
+    // output is tee'd into this pipe and spliced on from there, it never passes through the shell
+    if (pipe2(log_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        shell_error("log: pipe: %s", strerror(errno));
+        munmap(ring, LOG_HEADER_SIZE);
+        close(fd);
+        return -1;
+    }
+    if ((log_path = strdup(path)) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    log_ring = ring;
+    log_fd = fd;
+
+    // the shell now writes output on behalf of its children. when the reader of it goes away,
+    // that is an error to deal with rather than the end of the shell. children get SIGPIPE back
+    // as always
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &log_sigpipe);
+    return 0;
+}
+
+void
+close_log_ring()
+{
+    /*
+     * helper function to turn set -o log off. jobs that are still running keep their pipes until
+     * they are done, without a ring behind them
+     */
+
+    if (log_ring == NULL) {
+        return;
+    }
+    munmap(log_ring, LOG_HEADER_SIZE);
+    close(log_fd);
+    close(log_pipe[0]);
+    close(log_pipe[1]);
+    free(log_path);
+    log_ring = NULL;
+    log_fd = log_pipe[0] = log_pipe[1] = -1;
+    log_path = NULL;
+    sigaction(SIGPIPE, &log_sigpipe, NULL);
+}
+
+int
+pump_log(struct job *job, int stream)
+{
+    /*
+     * function to pass on what a job wrote into one of its log pipes: tee(2) duplicates it into
+     * log_pipe for the ring, and splice(2) moves the original on to the shell's own stdout or
+     * stderr, wherever that is. the data itself is never copied into the shell. a target that
+     * cannot be spliced to gets it through a buffer instead
+     *
+     * args:
+     *  struct job *job: the job
+     *  int stream: 0 for its stdout, 1 for its stderr
+     *
+     * returns:
+     *  1 if something was passed on, 0 if the pipe is empty, -1 once it is closed
+     */
+
+    char buf[PARALLEL_READ_SIZE];
+    int fd = job->log_fds[stream], target = stream + 1;
+    ssize_t len, moved, written, done;
+
+    // without a ring (set +o log while the job ran) the output still has to go on
+    len = log_ring != NULL ? tee(fd, log_pipe[1], LOG_CHUNK, SPLICE_F_NONBLOCK) : splice(fd, NULL, target, NULL, LOG_CHUNK, SPLICE_F_NONBLOCK);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    if (len <= 0) {
+        close(fd);
+        job->log_fds[stream] = -1;
+        return -1;
+    }
+    if (log_ring == NULL) {
+        return 1;
+    }
+    log_append(job, stream, len);
+
+    for (size_t left = len; left > 0; left -= moved) {
+        moved = splice(fd, NULL, target, NULL, left, 0);
+        if (moved < 0 && errno == EINVAL && (moved = read(fd, buf, left < sizeof(buf) ? left : sizeof(buf))) > 0) {
+            written = 0;
+            while (written < moved && ((done = write(target, buf + written, moved - written)) > 0 || errno == EINTR)) {
+                written += done > 0 ? done : 0;
+            }
+            moved = written < moved ? -1 : moved;
+        }
+        // the log pipe is non-blocking, which makes splice into a full pipe non-blocking as well
+        if (moved < 0 && (errno == EINTR || errno == EAGAIN)) {
+            if (errno == EAGAIN) {
+                poll(&(struct pollfd){target, POLLOUT, 0}, 1, -1);
+            }
+            moved = 0;
+            continue;
+        }
+
+        // the shell's own output is gone. the job's stages then get SIGPIPE like they would have
+        if (moved <= 0) {
+            close(fd);
+            job->log_fds[stream] = -1;
+            return -1;
+        }
+    }
+    return 1;
+}
+
+void
+log_append(struct job *job, int stream, size_t len)
+{
+    /*
+     * helper function to move the len bytes tee'd into log_pipe into the ring as one record,
+     * spliced to its place in the file. head is only advanced once the record is complete, so a
+     * reader never sees half of one. it does not wait for readers: what they have not read by
+     * the time the ring comes round again is overwritten
+     */
+
+    struct log_record record = {len, job->id, stream + 1, 0};
+    unsigned long long head = log_ring->head, pos = head % LOG_RING_SIZE;
+    size_t padded = (sizeof(record) + len + 7) & ~(size_t)7;
+    char buf[PARALLEL_READ_SIZE];
+    loff_t offset;
+    ssize_t moved;
+
+    // a record that does not fit before the end is put at the start, after a wrap marker
+    if (LOG_RING_SIZE - pos < padded) {
+        record.len = LOG_WRAP;
+        pwrite(log_fd, &record, sizeof(record), LOG_HEADER_SIZE + pos);
+        record.len = len;
+        head += LOG_RING_SIZE - pos;
+        pos = 0;
+    }
+
+    pwrite(log_fd, &record, sizeof(record), LOG_HEADER_SIZE + pos);
+    offset = LOG_HEADER_SIZE + pos + sizeof(record);
+    for (size_t left = len; left > 0; left -= moved) {
+        moved = splice(log_pipe[0], NULL, log_fd, &offset, left, 0);
+        if (moved < 0 && errno == EINVAL && (moved = read(log_pipe[0], buf, left < sizeof(buf) ? left : sizeof(buf))) > 0) {
+            moved = pwrite(log_fd, buf, moved, offset);
+            offset += moved > 0 ? moved : 0;
+        }
+        if (moved < 0 && errno == EINTR) {
+            moved = 0;
+            continue;
+        }
+        if (moved <= 0) {
+            // whatever is left in the pipe belongs to this record, it must not end up in the next
+            while (read(log_pipe[0], buf, sizeof(buf)) > 0);
+            return;
+        }
+    }
+    __atomic_store_n(&log_ring->head, head + padded, __ATOMIC_RELEASE);
+}
+
+void
+close_log(struct job *job)
+{
+    /*
+     * helper function to pass on what is left in a finished job's log pipes and close them.
+     * whatever the job left running in the background cannot write there any more
+     */
+
+    for (int stream = 0; stream < 2; stream++) {
+        while (job->log_fds[stream] >= 0 && pump_log(job, stream) > 0);
+        if (job->log_fds[stream] >= 0) {
+            close(job->log_fds[stream]);
+            job->log_fds[stream] = -1;
+        }
+    }
+}
+
+long
+parse_size(char *str)
+{
+    /*
+     * helper function to parse a size like 65536, 64k or 1M
+     *
+     * returns:
+     *  the size in bytes, or -1 if str is not a valid size
+     */
+
+    long long size = parse_bytes(str);
+
+    return size > 0 && size <= INT_MAX ? size : -1;
+}
+
+long long
+parse_bytes(char *str)
+{
+    /*
+     * helper function to parse a size like parse_size, without the int limit and with T as well.
+     * 0 is a valid size here
+     *
+     * returns:
+     *  the size in bytes, or -1 if str is not a valid size
+     */
+
+    char *end;
+    long long size;
+    int shift = 0;
+
+    errno = 0;
+    size = strtoll(str, &end, 10);
+    if (end == str || size < 0 || errno != 0) {
+        return -1;
+    }
+    switch (*end) {
+    case 'k':
+    case 'K':
+        shift = 10;
+        break;
+    case 'm':
+    case 'M':
+        shift = 20;
+        break;
+    case 'g':
+    case 'G':
+        shift = 30;
+        break;
+    case 't':
+    case 'T':
+        shift = 40;
+        break;
+    }
+    end += shift > 0;
+    if (*end == 'B' || *end == 'b') {
+        end++;
+    }
+    if (*end != 0 || size > (LLONG_MAX >> shift)) {
+        return -1;
+    }
+    return size << shift;
+}
+
+long
+probe_pipe_size(long size)
+{
+    /*
+     * helper function to find out what F_SETPIPE_SZ with size really gives us. the kernel rounds
+     * up to a power of two pages and, without CAP_SYS_RESOURCE, refuses anything above
+     * /proc/sys/fs/pipe-max-size, in which case we settle for that limit
+     *
+     * returns:
+     *  the effective pipe size, or -1 if pipes cannot be resized at all (message is printed)
+     */
+
+    FILE *max_file;
+    long max_size = 0;
+    int fds[2], effective;
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    if ((effective = fcntl(fds[1], F_SETPIPE_SZ, (int)size)) < 0 && errno == EPERM) {
+        if ((max_file = fopen("/proc/sys/fs/pipe-max-size", "re")) != NULL) {
+            if (fscanf(max_file, "%ld", &max_size) != 1) {
+                max_size = 0;
+            }
+            fclose(max_file);
+        }
+        if (max_size > 0 && max_size < size) {
+            effective = fcntl(fds[1], F_SETPIPE_SZ, (int)max_size);
+        }
+    }
+    if (effective < 0) {
+        shell_error("pipebuf: F_SETPIPE_SZ: %s", strerror(errno));
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+    return effective;
+}
+
+void
+open_input(struct input *input, int argc, char *argv[])
+{
+    /*
+     * helper function to work out where commands come from, based on the command line
+     *
+     * args:
+     *  struct input *input: input to set up
+     *  int argc, char *argv[]: arguments mysh was started with
+     */
+
+    int i, force_interactive = 0;
+
+    input->fd = 0;
+    input->buf = NULL;
+    input->len = input->pos = input->cap = 0;
+    input->name = NULL;
+    input->line_number = 0;
+    input->editing = 0;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-i") == 0) {
+            force_interactive = 1;
+        }
+        else if (strcmp(argv[i], "-n") == 0) {
+            noexec = 1;
+        }
+        else if (strcmp(argv[i], "--norc") == 0) {
+            norc = 1;
+        }
+        else if (strcmp(argv[i], "--startup-profile") == 0) {
+            startup_profile = 1;
+        }
+        else if (strcmp(argv[i], "-c") == 0) {
+            if (i + 1 == argc) {
+                fprintf(stderr, "mysh: -c: option requires an argument\n");
+                exit(2);
+            }
+            // the whole command string is the input, there is nothing left to read. like sh -c,
+            // the arguments after it become $0, $1, ...
+            if (i + 2 < argc) {
+                positional = argv + i + 2;
+                num_positional = argc - i - 3;
+            }
+            input->fd = -1;
+            input->len = strlen(argv[i + 1]);
+            input->cap = input->len + 1;
+            if ((input->buf = strdup(argv[i + 1])) == NULL) {
+                perror("strdup");
+                exit(1);
+            }
+            input->interactive = force_interactive;
+            return;
+        }
+        else if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        else {
+            fprintf(stderr, "mysh: %s: invalid option\nusage: mysh [-i] [-n] [--norc] [--startup-profile] [-c command | script]\n", argv[i]);
+            exit(2);
+        }
+    }
+
+    if (i < argc) {
+        // close-on-exec, so the commands in the script do not inherit it
+        if ((input->fd = open(argv[i], O_RDONLY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "mysh: %s: %s\n", argv[i], strerror(errno));
+            exit(127);
+        }
+        input->name = argv[i];
+        input->interactive = force_interactive;
+        positional = argv + i;
+        num_positional = argc - i - 1;
+        return;
+    }
+
+    input->interactive = force_interactive || isatty(0);
+    input->editing = input->interactive && isatty(0) && isatty(1) &&
+        (get_var("TERM") == NULL || strcmp(get_var("TERM"), "dumb") != 0);
+    history_wanted = input->editing;
+}
+
+void
+load_rc_files()
+{
+    /*
+     * helper function to run the rc files of an interactive shell, /etc/mysh.rc and then
+     * ~/.myshrc, the ones that exist. they go through source, so they are parsed into the same
+     * cache as any other sourced file
+     */
+
+    char path[PATH_MAX], *home;
+
+    if (access(SYSTEM_RC, R_OK) == 0) {
+        builtin_source((char *[]){"source", SYSTEM_RC, NULL});
+        startup_step(SYSTEM_RC);
+    }
+    if ((home = get_var("HOME")) != NULL && *home != 0 &&
+            snprintf(path, sizeof(path), "%s/" USER_RC, home) < (int)sizeof(path) && access(path, R_OK) == 0) {
+        builtin_source((char *[]){"source", path, NULL});
+        startup_step("~/" USER_RC);
+    }
+}
+
+void
+startup_step(char *name)
+{
+    /*
+     * helper function to note that a step of starting up is done, for --startup-profile. the
+     * times are taken whether or not the profile was asked for, since that only becomes known
+     * once the command line has been read, and a clock_gettime is all a step costs
+     *
+     * args:
+     *  char *name: the step, NULL for the start of the first one
+     */
+
+    if (num_startup_steps < STARTUP_STEPS) {
+        startup_names[num_startup_steps] = name;
+        startup_ns[num_startup_steps++] = now_ns();
+    }
+}
+
+void
+startup_report()
+{
+    /*
+     * helper function to print the time every step of starting up took, with --startup-profile
+     */
+
+    if (!startup_profile) {
+        return;
+    }
+    for (int i = 1; i < num_startup_steps; i++) {
+        fprintf(stderr, "startup: %-16s %9.3f ms\n", startup_names[i], (startup_ns[i] - startup_ns[i - 1]) / 1e6);
+    }
+    fprintf(stderr, "startup: %-16s %9.3f ms\n", "total", (startup_ns[num_startup_steps - 1] - startup_ns[0]) / 1e6);
+}
+
+char *
+next_line(struct input *input)
+{
+    /*
+     * function to get the next line of input. the input is read READ_CHUNK_SIZE bytes at a time
+     * and lines are handed out straight from that buffer, so a script costs one read per chunk
+     * rather than per line. (on a terminal every read returns a single line anyway)
+     *
+     * like other shells we read ahead on stdin: commands in a script piped into mysh do not get
+     * to read the rest of that script
+     *
+     * args:
+     *  struct input *input: where to read from
+     *
+     * returns:
+     *  the line without its newline, valid until the next call. NULL at end of input
+     */
+
+    char *line, *newline;
+    ssize_t bytes;
+
+    while (1) {
+        if (input->pos < input->len && (newline = memchr(input->buf + input->pos, '\n', input->len - input->pos)) != NULL) {
+            line = input->buf + input->pos;
+            *newline = 0;
+            input->pos = newline + 1 - input->buf;
+            input->line_number++;
+            return line;
+        }
+
+        if (input->fd < 0) {
+            // a last line without a newline
+            if (input->pos < input->len) {
+                line = input->buf + input->pos;
+                input->buf[input->len] = 0;
+                input->pos = input->len;
+                input->line_number++;
+                return line;
+            }
+            return NULL;
+        }
+
+        // keep the unfinished line and read more behind it
+        if (input->pos > 0) {
+            memmove(input->buf, input->buf + input->pos, input->len - input->pos);
+            input->len -= input->pos;
+            input->pos = 0;
+        }
+        if (input->cap - input->len < READ_CHUNK_SIZE + 1) {
+            input->cap = input->len + READ_CHUNK_SIZE + 1 > 2 * input->cap ? input->len + READ_CHUNK_SIZE + 1 : 2 * input->cap;
+            if ((input->buf = realloc(input->buf, input->cap)) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+
+        // at the prompt, children keep being reaped while we wait for the user, and jobs that
+        // finish are announced right away instead of after the next command
+        if (input->editing) {
+            bytes = edit_line(input);
+        }
+        else {
+            if (input->interactive) {
+                while (!wait_events(input->fd, -1)) {
+                    if (notify_jobs(1) > 0) {
+                        print_prompt();
+                    }
+                }
+            }
+            bytes = read(input->fd, input->buf + input->len, input->cap - input->len - 1);
+        }
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0) {
+            perror("read");
+        }
+        if (bytes <= 0) {
+            if (input->fd > 0) {
+                close(input->fd);
+            }
+            input->fd = -1;
+            continue;
+        }
+        input->len += bytes;
+    }
+}
+
+void
+load_history()
+{
+    /*
+     * helper function to load the history the first time it is needed: when the line editor
+     * first looks at it or a line is added to it. the shell gets to its first prompt without
+     * reading the history file first
+     */
+
+    long long start;
+
+    if (!history_wanted || history.entries != NULL) {
+        return;
+    }
+    start = now_ns();
+    init_history();
+    if (startup_profile) {
+        fprintf(stderr, "startup: %-16s %9.3f ms (when first needed)\n", "history", (now_ns() - start) / 1e6);
+    }
+}
+
+void
+init_history()
+{
+    /*
+     * function to set up the history ring and load the history file into it. the file is only
+     * ever appended to, so it is compacted here once it holds more than twice what the ring keeps
+     */
+
+    char *path, *home, *data = NULL, *line, *newline, tmp_path[PATH_MAX];
+    size_t len = 0, cap = 0;
+    ssize_t got;
+    int fd, lines = 0, unterminated = 0;
+
+    if ((history.entries = calloc(HISTORY_SIZE, sizeof(char *))) == NULL ||
+            (history.trigrams = calloc(TRIGRAM_BUCKETS, sizeof(struct trigram_list))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    history.fd = -1;
+
+    if ((path = get_var("MYSH_HISTFILE")) == NULL) {
+        if ((home = get_var("HOME")) == NULL || snprintf(tmp_path, sizeof(tmp_path), "%s/.mysh_history", home) >= (int)sizeof(tmp_path)) {
+            return;
+        }
+        path = tmp_path;
+    }
+    if (*path == 0) {
+        return;
+    }
+    if ((path = strdup(path)) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+        do {
+            if (cap - len < READ_CHUNK_SIZE + 1) {
+                cap = cap == 0 ? READ_CHUNK_SIZE + 1 : 2 * cap;
+                if ((data = realloc(data, cap)) == NULL) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            while ((got = read(fd, data + len, cap - len - 1)) < 0 && errno == EINTR);
+            len += got > 0 ? got : 0;
+        } while (got > 0);
+        close(fd);
+
+        data[len] = 0;
+        for (line = data; *line != 0; line = newline + 1) {
+            newline = strchrnul(line, '\n');
+
+            // a last line without its newline, say from a shell that died while writing it
+            if (*newline == 0) {
+                history_add(line, 0);
+                lines++;
+                unterminated = 1;
+                break;
+            }
+            *newline = 0;
+            history_add(line, 0);
+            lines++;
+        }
+        free(data);
+    }
+
+    // rewrite a file that grew too long with just what the ring holds, then keep appending
+    if (lines > 2 * HISTORY_SIZE && snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) < (int)sizeof(tmp_path) &&
+            (fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) >= 0) {
+        FILE *out = fdopen(fd, "w");
+
+        for (unsigned long seq = history_first(); seq < history.count; seq++) {
+            fprintf(out, "%s\n", history_get(seq));
+        }
+        if (fclose(out) == 0 && rename(tmp_path, path) == 0) {
+            unterminated = 0;
+        }
+    }
+
+    if ((history.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+        shell_error("%s: %s", path, strerror(errno));
+    }
+    // otherwise the next line appended would be glued onto the last one
+    else if (unterminated) {
+        write(history.fd, "\n", 1);
+    }
+    free(path);
+}
+
+void
+history_add(char *line, int save)
+{
+    /*
+     * function to add a line to the history ring, dropping the oldest entry once the ring is full.
+     * empty lines and repeats of the previous line are not kept
+     *
+     * args:
+     *  char *line: the line, without its newline
+     *  int save: also append it to the history file
+     */
+
+    char **slot;
+    struct iovec parts[2];
+
+    if (history.entries == NULL || *line == 0 ||
+            (history.count > 0 && strcmp(history_get(history.count - 1), line) == 0)) {
+        return;
+    }
+
+    slot = &history.entries[history.count % HISTORY_SIZE];
+    free(*slot);
+    if ((*slot = strdup(line)) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    history_index(history.count, line);
+    history.count++;
+
+    // one append-only write per line, so concurrent shells do not clobber each other's history
+    if (save && history.fd >= 0) {
+        parts[0].iov_base = line;
+        parts[0].iov_len = strlen(line);
+        parts[1].iov_base = "\n";
+        parts[1].iov_len = 1;
+        writev(history.fd, parts, 2);
+    }
+}
+
+char *
+history_get(unsigned long seq)
+{
+    return history.entries[seq % HISTORY_SIZE];
+}
+
+unsigned long
+history_first()
+{
+    /*
+     * helper function returning the seq of the oldest entry still in the ring
+     */
+
+    return history.count > HISTORY_SIZE ? history.count - HISTORY_SIZE : 0;
+}
+
+void
+history_index(unsigned long seq, char *line)
+{
+    /*
+     * helper function to add an entry to the trigram list of every trigram it contains
+     */
+
+    struct trigram_list *list;
+    unsigned long first = history_first() + (history.count >= HISTORY_SIZE);
+
+    for (size_t i = 0; line[i] != 0 && line[i + 1] != 0 && line[i + 2] != 0; i++) {
+        list = &history.trigrams[trigram_hash(line + i)];
+
+        // an entry is only listed once per bucket, however often its trigrams land there
+        if (list->len > list->start && list->seqs[list->len - 1] == seq) {
+            continue;
+        }
+
+        // entries that left the ring are at the front. make room by dropping them first
+        while (list->start < list->len && list->seqs[list->start] < first) {
+            list->start++;
+        }
+        if (list->len == list->cap) {
+            if (list->start > 0) {
+                memmove(list->seqs, list->seqs + list->start, (list->len - list->start) * sizeof(unsigned int));
+                list->len -= list->start;
+                list->start = 0;
+            }
+            if (list->len == list->cap) {
+                list->cap = list->cap == 0 ? 8 : 2 * list->cap;
+                if ((list->seqs = realloc(list->seqs, list->cap * sizeof(unsigned int))) == NULL) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+        }
+        list->seqs[list->len++] = seq;
+    }
+}
+
+long
+history_search(char *query, long before)
+{
+    /*
+     * function to find the newest history entry older than before that contains query. for
+     * queries of three or more characters only the entries in the shortest trigram list of the
+     * query are looked at; shorter queries match so much that a plain scan finds them quickly
+     *
+     * args:
+     *  char *query: text to look for
+     *  long before: seq to search below, history.count to search everything
+     *
+     * returns:
+     *  seq of the match, or -1
+     */
+
+    struct trigram_list *list, *best = NULL;
+    unsigned long first = history_first();
+    long lo, hi, mid;
+
+    if (strlen(query) < 3) {
+        for (long seq = before - 1; seq >= (long)first; seq--) {
+            if (strstr(history_get(seq), query) != NULL) {
+                return seq;
+            }
+        }
+        return -1;
+    }
+
+    for (size_t i = 0; query[i + 2] != 0; i++) {
+        list = &history.trigrams[trigram_hash(query + i)];
+        if (best == NULL || list->len - list->start < best->len - best->start) {
+            best = list;
+        }
+    }
+
+    // the list is sorted, find the last element below before
+    lo = best->start;
+    hi = best->len;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if ((long)best->seqs[mid] < before) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    for (long i = lo - 1; i >= best->start && best->seqs[i] >= first; i--) {
+        if (strstr(history_get(best->seqs[i]), query) != NULL) {
+            return best->seqs[i];
+        }
+    }
+    return -1;
+}
+
+unsigned int
+trigram_hash(char *str)
+{
+    unsigned char *p = (unsigned char *)str;
+
+    return (p[0] * 31 * 31 + p[1] * 31 + p[2]) % TRIGRAM_BUCKETS;
+}
+
+ssize_t
+edit_line(struct input *input)
+{
+    /*
+     * function to read one line from the terminal through the line editor, and append it with
+     * its newline to the input buffer. children keep being reaped while we wait for keys, and
+     * background jobs that finish are announced above the line being edited
+     *
+     * keys: the usual emacs ones (Ctrl-A/E/B/F/K/U/W/D/L), arrows, Home, End and Delete,
+     * Up/Down (or Ctrl-P/N) for the history, Ctrl-R to search it and Tab to complete. Ctrl-C
+     * drops the line
+     *
+     * args:
+     *  struct input *input: the terminal input
+     *
+     * returns:
+     *  bytes appended to the input buffer, 0 at end of input
+     */
+
+    struct pollfd pending = {0, POLLIN, 0};
+    int key, last_key = 0;
+    size_t start;
+
+    editor.len = editor.pos = 0;
+    editor.browse = -1;
+    if (editor.buf == NULL) {
+        editor.cap = LINE_INITIAL_SIZE;
+        if ((editor.buf = malloc(editor.cap)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    editor.buf[0] = 0;
+
+    // without raw mode there is nothing to edit with, read the line as typed
+    if (edit_raw(1) < 0) {
+        print_prompt();
+        return read(input->fd, input->buf + input->len, input->cap - input->len - 1);
+    }
+    edit_refresh();
+
+    while ((key = read_key()) != KEY_EOF) {
+        if (key == 18) {                // Ctrl-R
+            if ((key = edit_search()) == KEY_EOF) {
+                break;
+            }
+        }
+
+        if (key == '\r' || key == '\n') {
+            break;
+        }
+        switch (key) {
+        case 1:                         // Ctrl-A
+        case KEY_HOME:
+            editor.pos = 0;
+            break;
+        case 5:                         // Ctrl-E
+        case KEY_END:
+            editor.pos = editor.len;
+            break;
+        case 2:                         // Ctrl-B
+        case KEY_LEFT:
+            editor.pos -= editor.pos > 0;
+            break;
+        case 6:                         // Ctrl-F
+        case KEY_RIGHT:
+            editor.pos += editor.pos < editor.len;
+            break;
+        case 127:                       // Backspace
+        case 8:                         // Ctrl-H
+            if (editor.pos > 0) {
+                memmove(editor.buf + editor.pos - 1, editor.buf + editor.pos, editor.len - editor.pos + 1);
+                editor.pos--;
+                editor.len--;
+            }
+            break;
+        case 4:                         // Ctrl-D, end of input on an empty line
+            if (editor.len == 0) {
+                edit_write("\r\n", 2);
+                edit_raw(0);
+                return 0;
+            }
+            // fall through
+        case KEY_DELETE:
+            if (editor.pos < editor.len) {
+                memmove(editor.buf + editor.pos, editor.buf + editor.pos + 1, editor.len - editor.pos);
+                editor.len--;
+            }
+            break;
+        case 11:                        // Ctrl-K
+            editor.buf[editor.len = editor.pos] = 0;
+            break;
+        case 21:                        // Ctrl-U
+            memmove(editor.buf, editor.buf + editor.pos, editor.len - editor.pos + 1);
+            editor.len -= editor.pos;
+            editor.pos = 0;
+            break;
+        case 23:                        // Ctrl-W, the word before the cursor
+            for (start = editor.pos; start > 0 && editor.buf[start - 1] == ' '; start--);
+            for (; start > 0 && editor.buf[start - 1] != ' '; start--);
+            memmove(editor.buf + start, editor.buf + editor.pos, editor.len - editor.pos + 1);
+            editor.len -= editor.pos - start;
+            editor.pos = start;
+            break;
+        case 12:                        // Ctrl-L
+            edit_write("\x1b[H\x1b[2J", 7);
+            break;
+        case 3:                         // Ctrl-C
+            edit_write("^C\r\n", 4);
+            editor.len = editor.pos = 0;
+            editor.buf[0] = 0;
+            editor.browse = -1;
+            last_status = 130;
+            break;
+        case 16:                        // Ctrl-P
+        case KEY_UP:
+            edit_history(1);
+            break;
+        case 14:                        // Ctrl-N
+        case KEY_DOWN:
+            edit_history(0);
+            break;
+        case 9:                         // Tab
+            edit_complete(last_key == 9);
+            break;
+        default:
+            if (key >= 32 && key < 256) {
+                char c = key;
+
+                edit_insert(&c, 1);
+            }
+            break;
+        }
+
+        last_key = key;
+
+        // pasted text is drawn once, not once per character
+        if (poll(&pending, 1, 0) <= 0) {
+            edit_refresh();
+        }
+    }
+
+    editor.pos = editor.len;
+    edit_refresh();
+    edit_write("\r\n", 2);
+    edit_raw(0);
+    if (key == KEY_EOF && editor.len == 0) {
+        return 0;
+    }
+
+    load_history();
+    history_add(editor.buf, 1);
+    if (input->cap - input->len < editor.len + 2) {
+        input->cap = input->len + editor.len + 2;
+        if ((input->buf = realloc(input->buf, input->cap)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(input->buf + input->len, editor.buf, editor.len);
+    input->buf[input->len + editor.len] = '\n';
+    return editor.len + 1;
+}
+
+int
+edit_raw(int on)
+{
+    /*
+     * helper function to switch the terminal into raw mode for editing and back. output
+     * processing stays on, so a newline written by anyone still starts a new line
+     *
+     * returns:
+     *  0 on success, -1 if the terminal cannot be switched
+     */
+
+    struct termios raw;
+
+    if (!on) {
+        return tcsetattr(0, TCSADRAIN, &editor.cooked);
+    }
+    if (tcgetattr(0, &editor.cooked) < 0) {
+        return -1;
+    }
+    raw = editor.cooked;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    return tcsetattr(0, TCSADRAIN, &raw);
+}
+
+int
+read_key()
+{
+    /*
+     * helper function to read one key from the terminal, decoding the escape sequences of the
+     * arrows, Home, End and Delete. while waiting, finished background jobs are announced
+     *
+     * returns:
+     *  the byte read or one of the KEY_ codes, KEY_EOF once the terminal is gone
+     */
+
+    struct pollfd pending = {0, POLLIN, 0};
+    unsigned char c, seq[3];
+
+    while (!wait_events(0, -1)) {
+        edit_write("\r\x1b[K", 4);
+        notify_jobs(1);
+        edit_refresh();
+    }
+    while (read(0, &c, 1) != 1) {
+        if (errno != EINTR) {
+            return KEY_EOF;
+        }
+    }
+    if (c != 27) {
+        return c;
+    }
+
+    // ESC [ x, ESC O x and ESC [ n ~. a lone Esc is not followed by anything straight away
+    if (poll(&pending, 1, 50) <= 0 || read(0, seq, 1) != 1 || read(0, seq + 1, 1) != 1) {
+        return 27;
+    }
+    if (seq[0] == '[' && seq[1] >= '0' && seq[1] <= '9') {
+        if (read(0, seq + 2, 1) != 1 || seq[2] != '~') {
+            return 27;
+        }
+        switch (seq[1]) {
+        case '1': case '7':
+            return KEY_HOME;
+        case '3':
+            return KEY_DELETE;
+        case '4': case '8':
+            return KEY_END;
+        }
+        return 27;
+    }
+    if (seq[0] == '[' || seq[0] == 'O') {
+        switch (seq[1]) {
+        case 'A':
+            return KEY_UP;
+        case 'B':
+            return KEY_DOWN;
+        case 'C':
+            return KEY_RIGHT;
+        case 'D':
+            return KEY_LEFT;
+        case 'H':
+            return KEY_HOME;
+        case 'F':
+            return KEY_END;
+        }
+    }
+    return 27;
+}
+
+void
+edit_refresh()
+{
+    /*
+     * helper function to redraw the prompt and the line being edited. a line wider than the
+     * terminal scrolls sideways so the cursor stays visible
+     */
+
+    static char out[4096];
+    struct winsize ws;
+    size_t cols = 80, prompt_len = strlen(prompt), start = 0, visible, used;
+
+    if (ioctl(1, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        cols = ws.ws_col;
+    }
+    if (cols > sizeof(out) - 64) {
+        cols = sizeof(out) - 64;
+    }
+
+    if (prompt_len + editor.pos >= cols) {
+        start = prompt_len + editor.pos - cols + 1;
+    }
+    visible = editor.len - start;
+    if (prompt_len + visible > cols) {
+        visible = cols - prompt_len;
+    }
+
+    used = snprintf(out, sizeof(out), "\r%s", prompt);
+    memcpy(out + used, editor.buf + start, visible);
+    used += visible;
+    used += snprintf(out + used, sizeof(out) - used, "\x1b[K\r\x1b[%zuC", prompt_len + editor.pos - start);
+    edit_write(out, used);
+}
+
+void
+edit_insert(char *str, size_t len)
+{
+    /*
+     * helper function to insert text at the cursor
+     */
+
+    if (editor.len + len + 1 > editor.cap) {
+        while (editor.len + len + 1 > editor.cap) {
+            editor.cap *= 2;
+        }
+        if ((editor.buf = realloc(editor.buf, editor.cap)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memmove(editor.buf + editor.pos + len, editor.buf + editor.pos, editor.len - editor.pos + 1);
+    memcpy(editor.buf + editor.pos, str, len);
+    editor.pos += len;
+    editor.len += len;
+}
+
+void
+edit_set(char *str)
+{
+    /*
+     * helper function to replace the whole line, with the cursor at its end
+     */
+
+    editor.len = editor.pos = 0;
+    editor.buf[0] = 0;
+    edit_insert(str, strlen(str));
+}
+
+void
+edit_history(int older)
+{
+    /*
+     * helper function to step through the history with Up and Down. the line that was being
+     * typed is kept and comes back after the newest entry
+     */
+
+    unsigned long first;
+
+    load_history();
+    first = history_first();
+    if (older) {
+        if (editor.browse == (long)first || history.count == first) {
+            return;
+        }
+        if (editor.browse < 0) {
+            free(editor.typed);
+            if ((editor.typed = strdup(editor.buf)) == NULL) {
+                perror("strdup");
+                exit(1);
+            }
+            editor.browse = history.count;
+        }
+        edit_set(history_get(--editor.browse));
+        return;
+    }
+
+    if (editor.browse < 0) {
+        return;
+    }
+    if (++editor.browse == (long)history.count) {
+        editor.browse = -1;
+        edit_set(editor.typed != NULL ? editor.typed : "");
+        return;
+    }
+    edit_set(history_get(editor.browse));
+}
+
+int
+edit_search()
+{
+    /*
+     * function for Ctrl-R: incremental search backwards through the history. every key typed
+     * extends the query and jumps to the newest match, Ctrl-R again goes to the next older one.
+     * Enter runs the match, Ctrl-G or Esc goes back to the line as it was, and any other key
+     * keeps the match and is then handled as an ordinary editing key
+     *
+     * returns:
+     *  the key that ended the search, 0 if it was cancelled
+     */
+
+    static char out[4096];
+    char query[256], *match = NULL;
+    size_t query_len = 0;
+    long found = -1, seq;
+    int key, used, failed = 0;
+
+    load_history();
+    query[0] = 0;
+    while (1) {
+        used = snprintf(out, sizeof(out), "\r(%sreverse-i-search)`%s': %s\x1b[K",
+                failed ? "failed " : "", query, match != NULL ? match : "");
+        edit_write(out, used < (int)sizeof(out) ? used : (int)sizeof(out) - 1);
+
+        key = read_key();
+        if (key == 18 || (key >= 32 && key < 127) || key == 127 || key == 8) {
+            if (key == 18) {
+                // the next older match of the same query
+                seq = found >= 0 ? found : (long)history.count;
+            }
+            else if (key == 127 || key == 8) {
+                query[query_len -= query_len > 0] = 0;
+                seq = history.count;
+            }
+            else {
+                if (query_len < sizeof(query) - 1) {
+                    query[query_len++] = key;
+                    query[query_len] = 0;
+                }
+                // a longer query can still match the current entry
+                seq = found >= 0 ? found + 1 : (long)history.count;
+            }
+            if (query_len == 0) {
+                found = -1;
+                match = NULL;
+                failed = 0;
+                continue;
+            }
+            if ((seq = history_search(query, seq)) >= 0) {
+                found = seq;
+                match = history_get(found);
+                failed = 0;
+            }
+            else {
+                failed = 1;
+            }
+            continue;
+        }
+
+        if (key == 7 || key == 27) {    // Ctrl-G, Esc
+            return 0;
+        }
+        if (match != NULL) {
+            edit_set(match);
+            editor.browse = -1;
+        }
+        return key;
+    }
+}
+
+void
+edit_write(char *str, size_t len)
+{
+    ssize_t written;
+
+    while (len > 0 && ((written = write(1, str, len)) > 0 || errno == EINTR)) {
+        if (written > 0) {
+            str += written;
+            len -= written;
+        }
+    }
+}
+
+void
+edit_complete(int list)
+{
+    /*
+     * function for Tab: completes the word before the cursor. the first word of a command is
+     * completed from the builtins, the functions and the executables in PATH, anything else (or
+     * a word with a slash in it) as a file name. as much as all matches share is inserted, and a
+     * second Tab in a row lists them when that was nothing
+     *
+     * args:
+     *  int list: the previous key was a Tab too
+     */
+
+    static char *keywords[] = {"if", "then", "else", "elif", "do", "while", "until", "!", "time", "{", NULL};
+    struct completions found = {NULL, 0, 0};
+    struct arena arena = {NULL, NULL};
+    char word[PATH_MAX], *base;
+    size_t start, len = 0, common, prev;
+    int command = 1, files = 0, unique = 0;
+
+    // the word, with the backslashes its special characters were inserted with taken out
+    for (start = editor.pos; start > 0 && (!strchr(" \t;&|()<>", editor.buf[start - 1]) ||
+            (start > 1 && editor.buf[start - 2] == '\\')); start--);
+    for (size_t i = start; i < editor.pos && len < sizeof(word) - 1; i++) {
+        if (editor.buf[i] == '\\' && i + 1 < editor.pos) {
+            i++;
+        }
+        word[len++] = editor.buf[i];
+    }
+    word[len] = 0;
+
+    // it is the command name after an operator, at the start of the line or after a keyword
+    for (prev = start; prev > 0 && editor.buf[prev - 1] == ' '; prev--);
+    if (prev > 0 && !strchr(";&|(", editor.buf[prev - 1])) {
+        size_t word_start = prev;
+
+        while (word_start > 0 && editor.buf[word_start - 1] != ' ') {
+            word_start--;
+        }
+        command = 0;
+        for (char **keyword = keywords; *keyword != NULL && !command; keyword++) {
+            command = strlen(*keyword) == prev - word_start && memcmp(editor.buf + word_start, *keyword, prev - word_start) == 0;
+        }
+    }
+
+    if (command && strchr(word, '/') == NULL) {
+        complete_commands(&arena, &found, word);
+        base = word;
+    }
+    else {
+        complete_files(&arena, &found, word);
+        base = strrchr(word, '/') != NULL ? strrchr(word, '/') + 1 : word;
+        files = 1;
+    }
+
+    if (found.count == 0) {
+        edit_write("\a", 1);
+        arena_free(&arena);
+        return;
+    }
+
+    // a builtin can be in PATH as well, and a command in several of its directories
+    qsort(found.items, found.count, sizeof(char *), compare_strings);
+    for (int i = 0; i < found.count; i++) {
+        if (unique == 0 || strcmp(found.items[i], found.items[unique - 1]) != 0) {
+            found.items[unique++] = found.items[i];
+        }
+    }
+    found.count = unique;
+    common = strlen(found.items[0]);
+    for (int i = 1; i < found.count; i++) {
+        for (len = 0; len < common && found.items[i][len] == found.items[0][len]; len++);
+        common = len;
+    }
+
+    len = strlen(base);
+    if (common > len || found.count == 1) {
+        edit_insert_quoted(found.items[0] + len, common - len);
+        if (found.count == 1) {
+            // a directory goes on with a name in it, anything else is done
+            edit_insert(files && found.items[0][common + 1] == '/' ? "/" : " ", 1);
+        }
+    }
+    else if (list) {
+        edit_list(&found);
+    }
+    else {
+        edit_write("\a", 1);
+    }
+    free(found.items);
+    arena_free(&arena);
+}
+
+void
+edit_insert_quoted(char *str, size_t len)
+{
+    /*
+     * helper function to insert completed text at the cursor, with a backslash in front of
+     * every character the lexer would otherwise take as special
+     */
+
+    for (size_t i = 0; i < len; i++) {
+        if (strchr(" \t\\'\"$`;&|<>()*?[]#~{}!", str[i])) {
+            edit_insert("\\", 1);
+        }
+        edit_insert(str + i, 1);
+    }
+}
+
+void
+edit_list(struct completions *found)
+{
+    /*
+     * helper function to list the matches of a completion in columns under the line being
+     * edited, which is then drawn again below them
+     */
+
+    struct winsize ws;
+    size_t width = 0, cols = 80, per_row, rows, len, used;
+    char *out;
+
+    for (int i = 0; i < found->count; i++) {
+        if ((len = strlen(found->items[i])) > width) {
+            width = len;
+        }
+    }
+    if (ioctl(1, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        cols = ws.ws_col;
+    }
+    width += 2;
+    per_row = cols > width ? cols / width : 1;
+    rows = (found->count + per_row - 1) / per_row;
+    if ((out = malloc(per_row * width + 2)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    edit_write("\r\n", 2);
+    for (size_t row = 0; row < rows; row++) {
+        used = 0;
+        for (size_t i = row; i < (size_t)found->count; i += rows) {
+            len = strlen(found->items[i]);
+            memcpy(out + used, found->items[i], len);
+            used += len;
+            if (i + rows < (size_t)found->count) {
+                memset(out + used, ' ', width - len);
+                used += width - len;
+            }
+        }
+        memcpy(out + used, "\r\n", 2);
+        edit_write(out, used + 2);
+    }
+    free(out);
+}
+
+void
+complete_add(struct arena *arena, struct completions *found, char *name, size_t len)
+{
+    /*
+     * helper function to add a match to the completions, copied into the arena
+     */
+
+    char *copy = arena_alloc(arena, len + 1);
+
+    memcpy(copy, name, len);
+    copy[len] = 0;
+    if (found->count == found->cap) {
+        found->cap = found->cap == 0 ? 64 : 2 * found->cap;
+        if ((found->items = realloc(found->items, found->cap * sizeof(char *))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    found->items[found->count++] = copy;
+}
+
+void
+complete_commands(struct arena *arena, struct completions *found, char *prefix)
+{
+    /*
+     * helper function to find the command names starting with prefix: builtins, functions and
+     * whatever the trie of PATH executables has under it
+     */
+
+    size_t len = strlen(prefix);
+    char name[PATH_MAX];
+    int node;
+
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strncmp(builtins[i].name, prefix, len) == 0) {
+            complete_add(arena, found, builtins[i].name, strlen(builtins[i].name));
+        }
+    }
+    for (int i = 0; i < FUNCTION_BUCKETS; i++) {
+        for (struct function *function = functions[i]; function != NULL; function = function->next) {
+            if (!function->stale && strncmp(function->name, prefix, len) == 0) {
+                complete_add(arena, found, function->name, strlen(function->name));
+            }
+        }
+    }
+
+    trie_update();
+    if (len < sizeof(name) && (node = trie_find(prefix)) >= 0) {
+        memcpy(name, prefix, len);
+        trie_collect(arena, found, node, name, len);
+    }
+}
+
+void
+complete_files(struct arena *arena, struct completions *found, char *word)
+{
+    /*
+     * helper function to find the files whose path starts with word, in the directory it names
+     * (the current one if none). names starting with a dot only match a word that does too.
+     * every match is followed by its 0 and then a / for a directory, which edit_complete looks at
+     */
+
+    struct dir_listing *listing;
+    struct stat st;
+    char dir[PATH_MAX], path[2 * PATH_MAX], *slash = strrchr(word, '/'), *base, *home;
+    size_t base_len, len;
+
+    base = slash != NULL ? slash + 1 : word;
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    }
+    else if (word[0] == '~' && word + 1 == slash && (home = get_var("HOME")) != NULL) {
+        snprintf(dir, sizeof(dir), "%s/", home);
+    }
+    else if (slash == word) {
+        strcpy(dir, "/");
+    }
+    else {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - word), word);
+    }
+    if ((listing = read_dir(dir)) == NULL) {
+        return;
+    }
+
+    base_len = strlen(base);
+    for (char *entry = listing->entries; entry < listing->entries + listing->size; entry += strlen(entry + 1) + 2) {
+        char *name = entry + 1;
+        int is_dir = *entry == DT_DIR;
+
+        if (strncmp(name, base, base_len) != 0 || (*name == '.' && *base != '.')) {
+            continue;
+        }
+        if (*entry == DT_LNK || *entry == DT_UNKNOWN) {
+            snprintf(path, sizeof(path), "%s/%s", dir, name);
+            is_dir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+
+        len = strlen(name);
+        memcpy(path, name, len);
+        path[len] = 0;
+        path[len + 1] = is_dir ? '/' : ' ';
+        complete_add(arena, found, path, len + 2);
+    }
+}
+
+void
+trie_update()
+{
+    /*
+     * function to bring the trie of PATH executables up to date before a completion. only a
+     * directory whose mtime changed since it was read is read again, and only its names are
+     * taken out of the trie and put back in, so a Tab normally costs one stat per directory.
+     * a new PATH starts the trie over
+     */
+
+    struct path_dir *dir;
+    struct stat st;
+    char *path_var = get_var("PATH"), *start, *end;
+    int i;
+
+    if (path_var == NULL) {
+        path_var = DEFAULT_PATH;
+    }
+    if (command_trie.path_var == NULL || strcmp(command_trie.path_var, path_var) != 0) {
+        for (i = 0; i < command_trie.num_dirs; i++) {
+            free(command_trie.dirs[i].path);
+            free(command_trie.dirs[i].names);
+        }
+        free(command_trie.dirs);
+        free(command_trie.path_var);
+        command_trie.dirs = NULL;
+        command_trie.num_dirs = 0;
+        if ((command_trie.path_var = strdup(path_var)) == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+        command_trie.num_nodes = 1;
+        if (command_trie.nodes == NULL) {
+            command_trie.cap = TRIE_INITIAL_NODES;
+            if ((command_trie.nodes = malloc(command_trie.cap * sizeof(struct trie_node))) == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+        }
+        memset(command_trie.nodes, 0, sizeof(struct trie_node));
+
+        // an empty entry is the current directory, which is no place to complete commands from
+        for (start = path_var; ; start = end + 1) {
+            end = strchrnul(start, ':');
+            if (end > start) {
+                if ((command_trie.dirs = realloc(command_trie.dirs, (command_trie.num_dirs + 1) * sizeof(struct path_dir))) == NULL) {
+                    perror("realloc");
+                    exit(1);
+                }
+                dir = &command_trie.dirs[command_trie.num_dirs++];
+                memset(dir, 0, sizeof(*dir));
+                if ((dir->path = strndup(start, end - start)) == NULL) {
+                    perror("strndup");
+                    exit(1);
+                }
+            }
+            if (*end == 0) {
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < command_trie.num_dirs; i++) {
+        dir = &command_trie.dirs[i];
+        if (stat(dir->path, &st) < 0) {
+            st.st_ino = 0;
+        }
+        if (dir->read_ns > 0 && dir->dev == st.st_dev && dir->ino == st.st_ino &&
+                dir->mtime.tv_sec == st.st_mtim.tv_sec && dir->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+                st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec + DIR_CACHE_RACY_NS < dir->read_ns) {
+            continue;
+        }
+        trie_read_dir(dir, &st);
+    }
+}
+
+void
+trie_read_dir(struct path_dir *dir, struct stat *st)
+{
+    /*
+     * helper function to read the executables in a PATH directory again, replacing the names
+     * it had in the trie before
+     *
+     * args:
+     *  struct path_dir *dir: the directory
+     *  struct stat *st: what stat said about it just now, st_ino 0 if it is not there
+     */
+
+    struct dir_listing *listing;
+    struct timespec now;
+    struct stat file_st;
+    char path[2 * PATH_MAX];
+    size_t size = 0, cap = 0, len;
+
+    for (char *name = dir->names; name != NULL && name < dir->names + dir->size; name += strlen(name) + 1) {
+        trie_add(name, -1);
+    }
+    free(dir->names);
+    dir->names = NULL;
+    dir->size = 0;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    dir->dev = st->st_dev;
+    dir->ino = st->st_ino;
+    dir->mtime = st->st_mtim;
+    dir->read_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    if (st->st_ino == 0 || (listing = read_dir(dir->path)) == NULL) {
+        return;
+    }
+
+    for (char *entry = listing->entries; entry < listing->entries + listing->size; entry += strlen(entry + 1) + 2) {
+        // d_type rules out directories and the like without a stat, the rest needs an exec bit
+        if (*entry != DT_REG && *entry != DT_LNK && *entry != DT_UNKNOWN) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir->path, entry + 1);
+        if (*entry == DT_REG ? access(path, X_OK) < 0 :
+                stat(path, &file_st) < 0 || !S_ISREG(file_st.st_mode) || access(path, X_OK) < 0) {
+            continue;
+        }
+
+        len = strlen(entry + 1) + 1;
+        if (size + len > cap) {
+            cap = cap == 0 ? 4096 : 2 * cap;
+            while (size + len > cap) {
+                cap *= 2;
+            }
+            if ((dir->names = realloc(dir->names, cap)) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        memcpy(dir->names + size, entry + 1, len);
+        size += len;
+        trie_add(entry + 1, 1);
+    }
+    dir->size = size;
+}
+
+void
+trie_add(char *name, int delta)
+{
+    /*
+     * helper function to add a name to the trie of PATH executables, or take it out again with
+     * a delta of -1. nodes are never freed, a name that comes back reuses them
+     */
+
+    int node = 0, *link;
+
+    // room for every node the name could need, so no link moves while it is being followed
+    while (command_trie.num_nodes + strlen(name) > (size_t)command_trie.cap) {
+        command_trie.cap *= 2;
+        if ((command_trie.nodes = realloc(command_trie.nodes, command_trie.cap * sizeof(struct trie_node))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    command_trie.nodes[0].names += delta;
+    for (; *name != 0; name++) {
+        // children are kept in byte order, so trie_collect finds the names sorted
+        for (link = &command_trie.nodes[node].child; *link != 0 && command_trie.nodes[*link].c < (unsigned char)*name;
+                link = &command_trie.nodes[*link].next);
+        if (*link == 0 || command_trie.nodes[*link].c != (unsigned char)*name) {
+            command_trie.nodes[command_trie.num_nodes] = (struct trie_node){0, *link, 0, 0, (unsigned char)*name};
+            *link = command_trie.num_nodes++;
+        }
+        node = *link;
+        command_trie.nodes[node].names += delta;
+    }
+    command_trie.nodes[node].ends += delta;
+}
+
+int
+trie_find(char *prefix)
+{
+    /*
+     * helper function to find the node of the trie that the names starting with prefix are under
+     *
+     * returns:
+     *  index of the node, -1 if no name starts with prefix
+     */
+
+    int node = 0;
+
+    for (; *prefix != 0; prefix++) {
+        for (node = command_trie.nodes[node].child; node != 0 && command_trie.nodes[node].c != (unsigned char)*prefix;
+                node = command_trie.nodes[node].next);
+        if (node == 0) {
+            return -1;
+        }
+    }
+    return command_trie.nodes[node].names > 0 ? node : -1;
+}
+
+void
+trie_collect(struct arena *arena, struct completions *found, int node, char *name, size_t len)
+{
+    /*
+     * helper function to add every name under a node of the trie to the completions
+     *
+     * args:
+     *  int node: the node
+     *  char *name, size_t len: the name the node stands for so far, with room for PATH_MAX bytes
+     */
+
+    if (command_trie.nodes[node].ends > 0) {
+        complete_add(arena, found, name, len);
+    }
+    if (len + 1 >= PATH_MAX) {
+        return;
+    }
+    for (int child = command_trie.nodes[node].child; child != 0; child = command_trie.nodes[child].next) {
+        if (command_trie.nodes[child].names > 0) {
+            name[len] = command_trie.nodes[child].c;
+            trie_collect(arena, found, child, name, len + 1);
+        }
+    }
+}
+
+void
+shell_error(const char *fmt, ...)
+{
+    /*
+     * helper function to print an error message about the input, prefixed with the script name
+     * and line when we are running a script
+     *
+     * args:
+     *  const char *fmt, ...: printf style message, without the trailing newline
+     */
+
+    va_list ap;
+
+    if (current_input != NULL && current_input->name != NULL) {
+        fprintf(stderr, "%s: line %d: ", current_input->name, current_input->line_number);
+    }
+    else {
+        fprintf(stderr, "mysh: ");
+    }
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+void *
+arena_alloc(struct arena *arena, size_t size)
+{
+    /*
+     * helper function to carve size bytes out of the arena, moving on to the next chunk when the
+     * current one is full
+     *
+     * args:
+     *  struct arena *arena: arena to allocate from
+     *  size_t size: number of bytes needed
+     *
+     * returns:
+     *  pointer to the memory, aligned for any of our structs. exits if we run out of memory
+     */
+
+    struct arena_chunk *chunk = arena->current;
+    size_t chunk_size;
+
+    // keep every allocation pointer-aligned
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        // chunks kept from earlier lines are empty again, so use the next one if it is big enough
+        if (chunk != NULL && chunk->next != NULL && chunk->next->size >= size) {
+            chunk = chunk->next;
+        }
+        else {
+            chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+            if ((chunk = malloc(sizeof(struct arena_chunk) + chunk_size)) == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            chunk->used = 0;
+            chunk->size = chunk_size;
+
+            // link it in after the current chunk so the kept ones are still found afterwards
+            if (arena->current == NULL) {
+                chunk->next = arena->head;
+                arena->head = chunk;
+            }
+            else {
+                chunk->next = arena->current->next;
+                arena->current->next = chunk;
+            }
+        }
+        arena->current = chunk;
+    }
+
+    chunk->used += size;
+    return chunk->data + chunk->used - size;
+}
+
+void *
+arena_grow(struct arena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    /*
+     * helper function to enlarge an arena allocation, used for vectors whose final size is not
+     * known up front. the newest allocation is extended in place when its chunk has room,
+     * otherwise the contents are moved to a fresh allocation
+     *
+     * args:
+     *  struct arena *arena: arena ptr was allocated from
+     *  void *ptr: the allocation, or NULL
+     *  size_t old_size: size ptr was allocated with
+     *  size_t new_size: size needed now
+     *
+     * returns:
+     *  pointer to the enlarged allocation
+     */
+
+    struct arena_chunk *chunk = arena->current;
+    size_t aligned_old = (old_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    size_t aligned_new = (new_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    void *grown;
+
+    if (ptr != NULL && chunk != NULL && (char *)ptr + aligned_old == chunk->data + chunk->used &&
+            chunk->size - chunk->used >= aligned_new - aligned_old) {
+        chunk->used += aligned_new - aligned_old;
+        return ptr;
+    }
+
+    grown = arena_alloc(arena, new_size);
+    if (ptr != NULL) {
+        memcpy(grown, ptr, old_size);
+    }
+    return grown;
+}
+
+void
+arena_reset(struct arena *arena)
+{
+    /*
+     * helper function to release everything allocated from the arena. a few regular sized chunks
+     * are kept for the next line, anything beyond that (or sized for one huge allocation) is freed
+     */
+
+    struct arena_chunk *chunk, **link = &arena->head;
+    int kept = 0;
+
+    while ((chunk = *link) != NULL) {
+        if (chunk->size > ARENA_CHUNK_SIZE || kept == ARENA_KEEP_CHUNKS) {
+            *link = chunk->next;
+            free(chunk);
+            continue;
+        }
+        chunk->used = 0;
+        kept++;
+        link = &chunk->next;
+    }
+    arena->current = arena->head;
+}
+
+void
+arena_free(struct arena *arena)
+{
+    /*
+     * helper function to give every chunk of an arena back, for arenas that are not reused
+     */
+
+    struct arena_chunk *chunk;
+
+    while ((chunk = arena->head) != NULL) {
+        arena->head = chunk->next;
+        free(chunk);
+    }
+    arena->current = NULL;
+}
+
+void
+arena_save(struct arena *arena, struct arena_mark *mark)
+{
+    /*
+     * helper function to remember how far the arena is used, for arena_rewind
+     */
+
+    mark->chunk = arena->current;
+    mark->used = arena->current != NULL ? arena->current->used : 0;
+}
+
+void
+arena_rewind(struct arena *arena, struct arena_mark *mark)
+{
+    /*
+     * helper function to give back everything allocated since arena_save. the chunks after the
+     * current one are always empty, so only the ones filled since the mark need emptying
+     */
+
+    struct arena_chunk *chunk = mark->chunk != NULL ? mark->chunk->next : arena->head;
+
+    if (mark->chunk != arena->current) {
+        for (; chunk != NULL && chunk != arena->current; chunk = chunk->next) {
+            chunk->used = 0;
+        }
+        if (chunk != NULL) {
+            chunk->used = 0;
+        }
+    }
+    if (mark->chunk != NULL) {
+        mark->chunk->used = mark->used;
+        arena->current = mark->chunk;
+    }
+    else {
+        arena->current = arena->head;
+    }
+}
+
+int
+next_token(struct lexer *lex)
+{
+    /*
+     * helper function to scan the next token of the line. words are unquoted in place: the
+     * unquoted text is never longer than the raw text, so it is written over the input and
+     * lex->word points straight into the line buffer
+     *
+     * args:
+     *  struct lexer *lex: lexer state, lex->pos is advanced past the token
+     *
+     * returns:
+     *  the token type, which is also stored in lex->token
+     */
+
+    char *out, quote, *subst, *separator;
+    int quoted = 0, braces = 0, glob = 0;
+
+    lex->io_number = -1;
+    lex->more_lines = 0;
+    if (lex->held_token != TOKEN_END) {
+        lex->token = lex->held_token;
+        lex->held_token = TOKEN_END;
+        return lex->token;
+    }
+    if (lex->held_newline) {
+        lex->held_newline = 0;
+        lex->more_lines = 1;
+        return lex->token = TOKEN_END;
+    }
+
+    // skip whitespace between tokens. a backslash at the very end of a line joins the next one
+    while (1) {
+        while (*lex->pos == ' ' || *lex->pos == '\t') {
+            lex->pos++;
+        }
+        if (*lex->pos != '\\' || lex->pos[1] != 0) {
+            break;
+        }
+        lex->word = out = ++lex->pos;
+        if (!join_next_line(lex, &out, "")) {
+            lex->pos--;
+            break;
+        }
+    }
+
+    // comments run to the end of the line. a line end inside the text (the command of a $(...)
+    // over several lines) ends the line just like the end of the text, with the next one after it
+    if (*lex->pos == '#') {
+        lex->pos += strcspn(lex->pos, "\n");
+    }
+    if (*lex->pos == '\n') {
+        lex->pos++;
+        lex->more_lines = 1;
+        return lex->token = TOKEN_END;
+    }
+    if (*lex->pos == 0) {
+        return lex->token = TOKEN_END;
+    }
+    if (strchr("|&<>;()", *lex->pos) != NULL) {
+        return lex->token = scan_operator(lex);
+    }
+
+    // a digit right before < or > is the descriptor being redirected, not a word
+    if (*lex->pos >= '0' && *lex->pos <= '9' && (lex->pos[1] == '<' || lex->pos[1] == '>')) {
+        lex->io_number = *lex->pos++ - '0';
+        return lex->token = scan_operator(lex);
+    }
+
+    // quotes and backslashes become MARK_ bytes as the word is copied down. $ and a leading ~
+    // mean the word has to stay encoded until it is expanded, otherwise the marks are dropped
+    lex->word = out = lex->pos;
+    lex->expand = *lex->pos == '~';
+    while (*lex->pos != 0) {
+        // inside ${...} blanks and operators are part of the word
+        if (braces == 0 && (*lex->pos == ' ' || *lex->pos == '\t' || *lex->pos == '\n')) {
+            lex->held_newline = *lex->pos++ == '\n';
+            break;
+        }
+        if (braces == 0 && strchr("|&<>;()", *lex->pos) != NULL) {
+            // the terminator below would overwrite the operator if nothing was unquoted,
+            // so scan the operator now and return it next time
+            if (out == lex->pos) {
+                lex->held_token = scan_operator(lex);
+            }
+            break;
+        }
+        if (*lex->pos == '\'' || *lex->pos == '"') {
+            // copy everything up to the matching quote, between marks that take the quotes' places
+            quote = *lex->pos++;
+            *out++ = quote == '"' ? MARK_DQUOTE : MARK_SQUOTE;
+            quoted = 1;
+            while (*lex->pos != quote) {
+                // the quote goes on with the next line, and the line end is part of it. in double
+                // quotes a backslash right before it joins the lines instead
+                if (*lex->pos == 0 || (quote == '"' && *lex->pos == '\\' && lex->pos[1] == 0)) {
+                    separator = *lex->pos == '\\' ? "" : "\n";
+                    lex->pos += *lex->pos == '\\';
+                    if (!join_next_line(lex, &out, separator)) {
+                        shell_error("unterminated %c quote", quote);
+                        return lex->token = -1;
+                    }
+                    continue;
+                }
+                if (quote == '"' && *lex->pos == '\\' && strchr("\\\"$`", lex->pos[1]) != NULL) {
+                    *out++ = MARK_ESCAPE;
+                    lex->pos++;
+                }
+                else if (quote == '"' && *lex->pos == '$') {
+                    lex->expand = 1;
+                    if (lex->pos[1] == '(') {
+                        if ((subst = find_subst_end(lex, &out)) == NULL) {
+                            return lex->token = -1;
+                        }
+                        while (lex->pos < subst) {
+                            *out++ = *lex->pos++;
+                        }
+                    }
+                }
+                *out++ = *lex->pos++;
+            }
+            *out++ = MARK_END;
+            lex->pos++;
+            continue;
+        }
+        if (*lex->pos == '\\' && lex->pos[1] == 0) {
+            // backslash-newline is dropped, the word goes on with the next line
+            lex->pos++;
+            if (!join_next_line(lex, &out, "")) {
+                *out++ = '\\';
+            }
+            continue;
+        }
+        if (*lex->pos == '\\') {
+            *out++ = MARK_ESCAPE;
+            quoted = 1;
+            lex->pos++;
+        }
+        else if (*lex->pos == '$' && lex->pos[1] == '(') {
+            // the command inside is lexed again when it runs, so it is copied as it is
+            if ((subst = find_subst_end(lex, &out)) == NULL) {
+                return lex->token = -1;
+            }
+            lex->expand = 1;
+            while (lex->pos < subst) {
+                *out++ = *lex->pos++;
+            }
+        }
+        else if (*lex->pos == '$' || (*lex->pos == '~' && out > lex->word && out[-1] == '=')) {
+            lex->expand = 1;
+            braces += *lex->pos == '$' && lex->pos[1] == '{';
+        }
+        else if (*lex->pos == '}' && braces > 0) {
+            braces--;
+        }
+        else if (*lex->pos == '*' || *lex->pos == '?' || *lex->pos == '[') {
+            glob = 1;
+        }
+        *out++ = *lex->pos++;
+    }
+    *out = 0;
+
+    // a quoted $ or ~ must not be mistaken for one to expand, so such words keep their marks too.
+    // so do quoted glob characters, and unquoted ones make a pattern to expand
+    if (quoted && !lex->expand && strip_marks(lex->word, 0) == NULL) {
+        lex->expand = 1;
+    }
+    if (glob && !lex->expand && glob_chars(lex->word)) {
+        lex->expand = 1;
+    }
+    lex->quoted = quoted;
+    return lex->token = TOKEN_WORD;
+}
+
+int
+scan_operator(struct lexer *lex)
+{
+    /*
+     * helper function to scan one of the operators |, ||, &, &&, &>, &>>, ;, (, ), <, <&, <>,
+     * <<, <<-, <<<, >, >|, >& or >> at lex->pos
+     *
+     * returns:
+     *  the token type of the operator
+     */
+
+    switch (*lex->pos++) {
+    case '|':
+        if (*lex->pos == '|') {
+            lex->pos++;
+            return TOKEN_OR_IF;
+        }
+        return TOKEN_PIPE;
+    case ';':
+        return TOKEN_SEMI;
+    case '(':
+        return TOKEN_LPAREN;
+    case ')':
+        return TOKEN_RPAREN;
+    case '&':
+        if (*lex->pos == '&') {
+            lex->pos++;
+            return TOKEN_AND_IF;
+        }
+        if (*lex->pos != '>') {
+            return TOKEN_AMP;
+        }
+        if (*++lex->pos == '>') {
+            lex->pos++;
+            return TOKEN_ANDDGREAT;
+        }
+        return TOKEN_ANDGREAT;
+    case '<':
+        if (*lex->pos == '&' || *lex->pos == '>') {
+            return *lex->pos++ == '&' ? TOKEN_LESSAND : TOKEN_LESSGREAT;
+        }
+        if (*lex->pos != '<') {
+            return TOKEN_LESS;
+        }
+        lex->pos++;
+        if (*lex->pos == '<') {
+            lex->pos++;
+            return TOKEN_TLESS;
+        }
+        if (*lex->pos == '-') {
+            lex->pos++;
+            return TOKEN_DLESSDASH;
+        }
+        return TOKEN_DLESS;
+    default:
+        if (*lex->pos == '>') {
+            lex->pos++;
+            return TOKEN_DGREAT;
+        }
+        if (*lex->pos == '&') {
+            lex->pos++;
+            return TOKEN_GREATAND;
+        }
+        // there is no noclobber, so >| is just >
+        if (*lex->pos == '|') {
+            lex->pos++;
+        }
+        return TOKEN_GREAT;
+    }
+}
+
+struct node *
+parse_line(struct arena *arena, char *line, struct input *input)
+{
+    /*
+     * function to turn a line typed into the shell into its command tree, in a single pass over
+     * the line. a command still open at the end of the line (an if without its fi, a trailing
+     * && or |) goes on with the next lines of input
+     *
+     * args:
+     *  struct arena *arena: arena holding everything allocated for this line
+     *  char *line: the line, which is modified in place
+     *  struct input *input: where the next lines come from, NULL if the line has to be complete
+     *
+     * returns:
+     *  the first command of the line (empty_line if there is none), or NULL on a syntax error
+     */
+
+    struct lexer lex = {line, NULL, TOKEN_END, TOKEN_END};
+    struct node *list, **tail;
+    size_t len;
+
+    lex.heredoc_tail = &lex.heredocs;
+    lex.input = input;
+    lex.arena = arena;
+
+    // here-document bodies and the rest of an unfinished command are read from the input after
+    // the line, which reuses the buffer the line is in. the words of the line have to live
+    // somewhere safer
+    if (input != NULL) {
+        len = strlen(line) + 1;
+        lex.pos = memcpy(arena_alloc(arena, len), line, len);
+    }
+
+    next_token(&lex);
+    list = parse_list(arena, &lex, NULL);
+
+    // text with line ends in it (the command of a $(...) over several lines) holds a list per line
+    for (tail = &list; lex.token == TOKEN_END && lex.more_lines; ) {
+        while (*tail != NULL) {
+            tail = &(*tail)->next;
+        }
+        read_heredocs(arena, &lex);
+        next_token(&lex);
+        *tail = parse_list(arena, &lex, NULL);
+    }
+
+    // a list only stops early at a ) or a reserved word nothing was waiting for
+    if (lex.token != TOKEN_END) {
+        syntax_error(&lex);
+        return NULL;
+    }
+    read_heredocs(arena, &lex);
+    return list != NULL ? list : &empty_line;
+}
+
+int
+next_input_line(struct lexer *lex)
+{
+    /*
+     * helper function to go on with the next line of input when the end of a line does not end
+     * the command. the here-documents of the line that ended come first
+     *
+     * returns:
+     *  1 with lex->pos at the new line, 0 if there is nothing more to read (which is reported)
+     */
+
+    char *line;
+    size_t len;
+
+    read_heredocs(lex->arena, lex);
+    // text with line ends in it already holds the next line
+    if (lex->more_lines) {
+        return 1;
+    }
+    if ((line = read_more_input(lex)) == NULL) {
+        shell_error("syntax error: unexpected end of file");
+        lex->token = -1;
+        return 0;
+    }
+    len = strlen(line) + 1;
+    lex->pos = memcpy(arena_alloc(lex->arena, len), line, len);
+    return 1;
+}
+
+char *
+read_more_input(struct lexer *lex)
+{
+    /*
+     * helper function to read the line an unfinished command goes on with, after a PS2 prompt
+     *
+     * returns:
+     *  the line, valid until the next read. NULL at the end of the input, or without one
+     */
+
+    char *line = NULL;
+
+    if (lex->input != NULL) {
+        prompt = PROMPT2;
+        if (lex->input->interactive) {
+            print_prompt();
+        }
+        line = next_line(lex->input);
+        prompt = PROMPT;
+    }
+    return line;
+}
+
+int
+join_next_line(struct lexer *lex, char **out, char *separator)
+{
+    /*
+     * helper function for a word that goes on past the end of its line: an open quote or $(,
+     * or a backslash-newline. what was unquoted of the word so far, the rest of the line and
+     * the next line are put together in the arena, so the word goes on being unquoted in place
+     *
+     * args:
+     *  char **out: where the unquoted word has got to, moved along into the new buffer
+     *  char *separator: what goes between the lines, "\n" or nothing for a backslash-newline
+     *
+     * returns:
+     *  1 with lex->pos at the same place in the new buffer, 0 if the input ended
+     */
+
+    size_t done = *out - lex->word, rest = strlen(lex->pos), sep = strlen(separator), len;
+    char *line, *buf;
+
+    if ((line = read_more_input(lex)) == NULL) {
+        return 0;
+    }
+    len = strlen(line) + 1;
+    buf = arena_alloc(lex->arena, done + rest + sep + len);
+    memcpy(buf, lex->word, done);
+    memcpy(buf + done, lex->pos, rest);
+    memcpy(buf + done + rest, separator, sep);
+    memcpy(buf + done + rest + sep, line, len);
+    lex->word = buf;
+    *out = lex->pos = buf + done;
+    return 1;
+}
+
+char *
+find_subst_end(struct lexer *lex, char **out)
+{
+    /*
+     * helper function to find the ) of the $( at lex->pos, reading more lines until there is one
+     *
+     * args:
+     *  char **out: where the unquoted word has got to, see join_next_line
+     *
+     * returns:
+     *  pointer to the ), NULL if the input ended first (which is reported)
+     */
+
+    char *end;
+
+    while ((end = subst_end(lex->pos + 2)) == NULL) {
+        if (!join_next_line(lex, out, "\n")) {
+            shell_error("unterminated $(");
+            return NULL;
+        }
+    }
+    return end;
+}
+
+int
+skip_newlines(struct lexer *lex)
+{
+    /*
+     * helper function for the places a command has to go on (after &&, || and |, before the
+     * body of a function, around the words of a for): line ends there are skipped over
+     *
+     * returns:
+     *  0, -1 if the input ended first
+     */
+
+    while (lex->token == TOKEN_END) {
+        if (!next_input_line(lex)) {
+            return -1;
+        }
+        next_token(lex);
+    }
+    return 0;
+}
+
+int
+is_keyword(struct lexer *lex, char *word)
+{
+    /*
+     * helper function to check for a reserved word. they are only recognized unquoted, and only
+     * where the parser looks for them, so `echo if` is just an echo
+     */
+
+    return lex->token == TOKEN_WORD && !lex->quoted && !lex->expand && strcmp(lex->word, word) == 0;
+}
+
+int
+is_reserved(struct lexer *lex, char **words)
+{
+    /*
+     * helper function to check whether the current token is one of the reserved words in
+     * words, a NULL-terminated list (or NULL for none). every command start goes through here,
+     * so most words are turned down on their first character
+     */
+
+    if (lex->token != TOKEN_WORD || lex->quoted || lex->expand) {
+        return 0;
+    }
+    for (; words != NULL && *words != NULL; words++) {
+        if (**words == *lex->word && strcmp(*words, lex->word) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int
+is_redir_token(int token)
+{
+    return token >= TOKEN_LESS && token <= TOKEN_ANDDGREAT && token != TOKEN_AMP;
+}
+
+struct node *
+parse_list(struct arena *arena, struct lexer *lex, char **ends)
+{
+    /*
+     * helper function to parse and-or lists separated by ;, & or line ends, up to one of the
+     * reserved words in ends, a ) or the end of the input. inside a compound command the end of
+     * a line is only a separator, the list goes on with the next line
+     *
+     * args:
+     *  char **ends: NULL-terminated reserved words that close the list (then, fi, done, ...)
+     *
+     * returns:
+     *  the first node of the list, NULL if it is empty or on a syntax error (lex->token is -1 then)
+     */
+
+    struct node *first = NULL, *node, *background, **tail = &first;
+
+    while (1) {
+        if (lex->token == TOKEN_END && lex->depth > 0) {
+            if (!next_input_line(lex)) {
+                return NULL;
+            }
+            next_token(lex);
+            continue;
+        }
+        if (lex->token < 0) {
+            return NULL;
+        }
+        if (lex->token == TOKEN_END || lex->token == TOKEN_RPAREN || is_reserved(lex, ends)) {
+            return first;
+        }
+        if ((node = parse_and_or(arena, lex)) == NULL) {
+            return NULL;
+        }
+
+        // & puts the whole and-or list in the background. a pipeline does that by itself, a
+        // longer list gets a child to run in
+        if (lex->token == TOKEN_AMP) {
+            if (node->type != NODE_PIPELINE) {
+                background = new_node(arena, NODE_PIPELINE);
+                background->pipeline = subshell_pipeline(arena, node);
+                node = background;
+            }
+            node->pipeline->background = 1;
+        }
+        *tail = node;
+        tail = &node->next;
+
+        if (lex->token == TOKEN_SEMI || lex->token == TOKEN_AMP) {
+            next_token(lex);
+        }
+        else if (lex->token != TOKEN_END && lex->token != TOKEN_RPAREN && !is_reserved(lex, ends)) {
+            syntax_error(lex);
+            return NULL;
+        }
+    }
+}
+
+struct node *
+parse_body(struct arena *arena, struct lexer *lex, char **ends)
+{
+    /*
+     * helper function to parse the list inside a compound command, which must not be empty and
+     * must end with one of the reserved words in ends
+     *
+     * returns:
+     *  the list, with lex->token left at the reserved word. NULL on a syntax error
+     */
+
+    struct node *list = parse_list(arena, lex, ends);
+
+    if (list == NULL || !is_reserved(lex, ends)) {
+        syntax_error(lex);
+        return NULL;
+    }
+    return list;
+}
+
+struct node *
+parse_and_or(struct arena *arena, struct lexer *lex)
+{
+    /*
+     * helper function to parse pipelines joined by && and ||, which group to the left
+     *
+     * returns:
+     *  the node, with lex->token left at what ended the list. NULL on a syntax error
+     */
+
+    struct node *node = new_node(arena, NODE_PIPELINE), *left;
+
+    if ((node->pipeline = parse_pipeline(arena, lex)) == NULL) {
+        return NULL;
+    }
+    while (lex->token == TOKEN_AND_IF || lex->token == TOKEN_OR_IF) {
+        left = node;
+        node = new_node(arena, lex->token == TOKEN_AND_IF ? NODE_AND : NODE_OR);
+        node->cond = left;
+        node->body = new_node(arena, NODE_PIPELINE);
+
+        // the next pipeline may be on the next line
+        next_token(lex);
+        if (skip_newlines(lex) < 0 || (node->body->pipeline = parse_pipeline(arena, lex)) == NULL) {
+            return NULL;
+        }
+    }
+    return node;
+}
+
+struct node *
+new_node(struct arena *arena, int type)
+{
+    struct node *node = arena_alloc(arena, sizeof(struct node));
+
+    memset(node, 0, sizeof(struct node));
+    node->type = type;
+    return node;
+}
+
+struct command *
+new_command(struct arena *arena)
+{
+    /*
+     * helper function to make an empty command, with an argv that holds just the NULL
+     */
+
+    struct command *cmd = arena_alloc(arena, sizeof(struct command));
+
+    memset(cmd, 0, sizeof(struct command));
+    cmd->argv = arena_alloc(arena, sizeof(char *));
+    cmd->argv[0] = NULL;
+    return cmd;
+}
+
+struct pipeline *
+subshell_pipeline(struct arena *arena, struct node *list)
+{
+    /*
+     * helper function to make a pipeline of a single stage that runs list in a child, for an
+     * and-or list put in the background and for a $(...) holding more than one pipeline
+     */
+
+    struct pipeline *pipeline = arena_alloc(arena, sizeof(struct pipeline));
+
+    memset(pipeline, 0, sizeof(struct pipeline));
+    pipeline->commands = new_command(arena);
+    pipeline->commands->body = new_node(arena, NODE_SUBSHELL);
+    pipeline->commands->body->body = list;
+    pipeline->num_commands = 1;
+    return pipeline;
+}
+
+void
+read_heredocs(struct arena *arena, struct lexer *lex)
+{
+    /*
+     * helper function to read the bodies of the here-documents of a line that was just parsed,
+     * in the order they appeared in, from the lines that follow it. text that is parsed as a
+     * whole (the command of a $(...)) holds them itself
+     */
+
+    for (struct redir *redir = lex->heredocs; redir != NULL; redir = redir->next_heredoc) {
+        redir->body = read_heredoc(arena, redir, lex->input == NULL ? &lex->pos : NULL);
+    }
+    lex->heredocs = NULL;
+    lex->heredoc_tail = &lex->heredocs;
+}
+
+char *
+read_heredoc(struct arena *arena, struct redir *redir, char **text)
+{
+    /*
+     * helper function to read one here-document body, up to the line holding only its delimiter.
+     * with an unquoted delimiter, backslash-newline joins lines and \$ keeps a $ from being
+     * expanded. the body is left encoded like a word so it can go through expand_string
+     *
+     * args:
+     *  char **text: the text to take the lines from and move past them, NULL to read the input
+     *
+     * returns:
+     *  the body in the arena, every line ending in a newline
+     */
+
+    size_t len = 0, cap = 256, line_len;
+    char *body = arena_alloc(arena, cap), *line, *p;
+
+    prompt = PROMPT2;
+    while (1) {
+        if (text != NULL) {
+            line = **text != 0 ? *text : NULL;
+            *text += strcspn(*text, "\n");
+            if (**text == '\n') {
+                *(*text)++ = 0;
+            }
+        }
+        else {
+            if (current_input->interactive) {
+                print_prompt();
+            }
+            line = next_line(current_input);
+        }
+        if (line == NULL) {
+            shell_error("here-document delimited by end of file (wanted `%s')", redir->path);
+            break;
+        }
+        if (redir->strip_tabs) {
+            while (*line == '\t') {
+                line++;
+            }
+        }
+        if (strcmp(line, redir->path) == 0) {
+            break;
+        }
+
+        // the worst case is every byte getting a mark, plus the newline
+        line_len = strlen(line);
+        if (len + 2 * line_len + 2 > cap) {
+            body = arena_grow(arena, body, cap, 2 * (len + 2 * line_len + 2));
+            cap = 2 * (len + 2 * line_len + 2);
+        }
+        if (redir->type == REDIR_HEREDOC_LITERAL) {
+            memcpy(body + len, line, line_len);
+            len += line_len;
+            body[len++] = '\n';
+            continue;
+        }
+        for (p = line; *p != 0; p++) {
+            if (*p == '\\' && (p[1] == '$' || p[1] == '`' || p[1] == '\\')) {
+                // only an escaped $ has to survive until expansion
+                if (*++p == '$') {
+                    body[len++] = MARK_ESCAPE;
+                }
+            }
+            else if (*p == '\\' && p[1] == 0) {
+                break;
+            }
+            else if (*p == '~' && len == 0) {
+                // expand_string would take a ~ at the start for a home directory
+                body[len++] = MARK_ESCAPE;
+            }
+            body[len++] = *p;
+        }
+        if (*p == 0) {
+            body[len++] = '\n';
+        }
+    }
+    prompt = PROMPT;
+    body[len] = 0;
+    return body;
+}
+
+struct parse_entry *
+parse_cache_find(char *key, int is_file)
+{
+    /*
+     * helper function to look up parsed text in the cache
+     *
+     * returns:
+     *  the entry, NULL if key was never parsed
+     */
+
+    struct parse_entry *entry = parse_cache[hash_string(key) & (PARSE_CACHE_BUCKETS - 1)];
+
+    while (entry != NULL && (entry->is_file != is_file || strcmp(entry->key, key) != 0)) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+struct parse_entry *
+parse_cache_add(char *key, int is_file)
+{
+    /*
+     * helper function to make a new, empty cache entry for key. the key is copied into the
+     * entry's own arena
+     */
+
+    struct parse_entry *entry, **bucket = &parse_cache[hash_string(key) & (PARSE_CACHE_BUCKETS - 1)];
+    size_t len = strlen(key) + 1;
+
+    if ((entry = calloc(1, sizeof(struct parse_entry))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    entry->key = memcpy(arena_alloc(&entry->arena, len), key, len);
+    entry->is_file = is_file;
+    entry->next = *bucket;
+    *bucket = entry;
+    return entry;
+}
+
+void
+parse_cache_drop(struct parse_entry *entry)
+{
+    /*
+     * helper function to take an entry out of the cache, because its file changed or it failed
+     * to parse. it is freed right away unless it is still being run
+     */
+
+    struct parse_entry **link = &parse_cache[hash_string(entry->key) & (PARSE_CACHE_BUCKETS - 1)];
+
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    entry->stale = 1;
+    parse_cache_release(entry);
+}
+
+void
+parse_cache_release(struct parse_entry *entry)
+{
+    /*
+     * helper function to free an entry that was dropped, once its last run is over
+     */
+
+    if (entry->stale && entry->users == 0) {
+        arena_free(&entry->arena);
+        free(entry);
+    }
+}
+
+struct node *
+parse_cached(char *text, size_t len)
+{
+    /*
+     * function to parse a piece of text that is likely to be run again, like the body of a
+     * $(...), only the first time it is seen
+     *
+     * args:
+     *  char *text: the text, not terminated
+     *  size_t len: its length
+     *
+     * returns:
+     *  the parsed list, owned by the cache. NULL on a syntax error (which is not cached, so it
+     *  is reported every time)
+     */
+
+    struct parse_entry *entry;
+    char *key = malloc(len + 1), *line;
+
+    if (key == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(key, text, len);
+    key[len] = 0;
+
+    if ((entry = parse_cache_find(key, 0)) == NULL) {
+        entry = parse_cache_add(key, 0);
+        // the parser works in place, the key has to stay intact
+        line = memcpy(arena_alloc(&entry->arena, len + 1), key, len + 1);
+        entry->lines = arena_alloc(&entry->arena, sizeof(struct parsed_line));
+        entry->lines->next = NULL;
+        entry->lines->line_number = 0;
+        if ((entry->lines->list = parse_line(&entry->arena, line, NULL)) == NULL) {
+            parse_cache_drop(entry);
+            free(key);
+            return NULL;
+        }
+    }
+    free(key);
+    return entry->lines->list;
+}
+
+struct parse_entry *
+parse_file(char *path, struct stat *st)
+{
+    /*
+     * function to parse a whole file into a new cache entry, reporting syntax errors (with the
+     * file's line numbers) as it goes
+     *
+     * args:
+     *  char *path: the file
+     *  struct stat *st: what stat said about it, kept to notice changes later
+     *
+     * returns:
+     *  the entry, NULL if the file could not be opened (message is printed)
+     */
+
+    struct input input, *saved_input = current_input;
+    struct parse_entry *entry;
+    struct parsed_line *parsed, **tail;
+    char *line;
+
+    memset(&input, 0, sizeof(input));
+    if ((input.fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        shell_error("%s: %s", path, strerror(errno));
+        return NULL;
+    }
+    input.name = path;
+
+    entry = parse_cache_add(path, 1);
+    entry->st = *st;
+    tail = &entry->lines;
+
+    // here-documents in the file are read from it too
+    current_input = &input;
+    while ((line = next_line(&input)) != NULL) {
+        parsed = arena_alloc(&entry->arena, sizeof(struct parsed_line));
+        parsed->next = NULL;
+        parsed->line_number = input.line_number;
+        parsed->list = parse_line(&entry->arena, line, &input);
+
+        // blank lines and comments have nothing to run
+        if (parsed->list == &empty_line) {
+            continue;
+        }
+        *tail = parsed;
+        tail = &parsed->next;
+    }
+    current_input = saved_input;
+    free(input.buf);
+    return entry;
+}
+
+struct pipeline *
+parse_pipeline(struct arena *arena, struct lexer *lex)
+{
+    /*
+     * helper function to parse commands separated by pipes, starting at the current token
+     *
+     * returns:
+     *  the pipeline, with lex->token left at the operator or end of line that ended it. NULL on a syntax error
+     */
+
+    struct pipeline *pipeline = arena_alloc(arena, sizeof(struct pipeline));
+    struct command *cmd, **tail = &pipeline->commands;
+
+    memset(pipeline, 0, sizeof(struct pipeline));
+    if (is_keyword(lex, "!")) {
+        pipeline->negate = 1;
+        next_token(lex);
+    }
+    if (parse_prefixes(arena, lex, pipeline) < 0) {
+        return NULL;
+    }
+    // time on its own times nothing
+    if (pipeline->timed && !command_follows(lex)) {
+        pipeline->commands = new_command(arena);
+        pipeline->commands->argv = arena_alloc(arena, sizeof(char *));
+        pipeline->commands->argv[0] = NULL;
+        pipeline->num_commands = 1;
+        return pipeline;
+    }
+
+    while (1) {
+        if ((cmd = parse_command(arena, lex)) == NULL) {
+            return NULL;
+        }
+        *tail = cmd;
+        tail = &cmd->next;
+        pipeline->num_commands++;
+        pipeline->expand |= cmd->expand;
+
+        if (lex->token != TOKEN_PIPE) {
+            return pipeline;
+        }
+        // the next stage may be on the next line
+        next_token(lex);
+        if (skip_newlines(lex) < 0) {
+            return NULL;
+        }
+    }
+}
+
+int
+parse_prefixes(struct arena *arena, struct lexer *lex, struct pipeline *pipeline)
+{
+    /*
+     * helper function to parse time, timeout and limit, which are prefixes of the whole
+     * pipeline rather than commands, in any order. they are only recognized unquoted at the
+     * start of the pipeline, so the command after them may as well be a compound one
+     *
+     * returns:
+     *  0 with lex->token at the first command, -1 on a syntax error
+     */
+
+    struct command *words;
+    char *value;
+    int slots, takes_value;
+
+    while (lex->token == TOKEN_WORD && !lex->quoted) {
+        if (!pipeline->timed && strcmp(lex->word, "time") == 0) {
+            pipeline->timed = TIME_DEFAULT;
+            if (next_token(lex) == TOKEN_WORD && strcmp(lex->word, "-p") == 0) {
+                pipeline->timed = TIME_POSIX;
+                next_token(lex);
+            }
+            continue;
+        }
+
+        // the words of the others are expanded when the pipeline runs, like the words of a
+        // command. timeout takes -s SIGNAL and -k DURATION, then the duration
+        if (pipeline->timeout == NULL && strcmp(lex->word, "timeout") == 0) {
+            pipeline->timeout = words = new_command(arena);
+            slots = 4;
+            words->argv = arena_alloc(arena, slots * sizeof(char *));
+            next_token(lex);
+            while (lex->token == TOKEN_WORD && lex->word[0] == '-' && lex->word[1] != 0 && strcmp(lex->word, "--") != 0) {
+                prefix_word(arena, lex, words, &slots);
+                takes_value = timeout_option(lex->word, &value) != 0 && value == NULL;
+                if (next_token(lex) == TOKEN_WORD && takes_value) {
+                    prefix_word(arena, lex, words, &slots);
+                    next_token(lex);
+                }
+            }
+            if (lex->token == TOKEN_WORD && strcmp(lex->word, "--") == 0) {
+                prefix_word(arena, lex, words, &slots);
+                next_token(lex);
+            }
+            if (lex->token == TOKEN_WORD) {
+                prefix_word(arena, lex, words, &slots);
+                next_token(lex);
+            }
+            if (words->argc == 0 || strcmp(words->argv[words->argc - 1], "--") == 0 || !command_follows(lex)) {
+                shell_error("timeout: duration and command expected");
+                lex->token = -1;
+                return -1;
+            }
+            continue;
+        }
+
+        // limit has name=value words up to a -- (or the first other word)
+        if (pipeline->limits == NULL && strcmp(lex->word, "limit") == 0) {
+            pipeline->limits = words = new_command(arena);
+            slots = 4;
+            words->argv = arena_alloc(arena, slots * sizeof(char *));
+            while (next_token(lex) == TOKEN_WORD && strcmp(lex->word, "--") != 0 && strchr(lex->word, '=') != NULL) {
+                prefix_word(arena, lex, words, &slots);
+            }
+            if (lex->token == TOKEN_WORD && strcmp(lex->word, "--") == 0) {
+                next_token(lex);
+            }
+            if (!command_follows(lex)) {
+                shell_error("limit: command expected after the limits");
+                lex->token = -1;
+                return -1;
+            }
+            continue;
+        }
+        break;
+    }
+    return 0;
+}
+
+int
+command_follows(struct lexer *lex)
+{
+    /*
+     * helper function to check that the token after a prefix can start a command
+     */
+
+    switch (lex->token) {
+    case TOKEN_END:
+    case TOKEN_PIPE:
+    case TOKEN_AMP:
+    case TOKEN_SEMI:
+    case TOKEN_AND_IF:
+    case TOKEN_OR_IF:
+    case TOKEN_RPAREN:
+        return 0;
+    default:
+        return lex->token >= 0;
+    }
+}
+
+void
+prefix_word(struct arena *arena, struct lexer *lex, struct command *words, int *slots)
+{
+    /*
+     * helper function to add the word just scanned to the words of a prefix
+     */
+
+    add_arg(arena, words, lex->word, slots);
+    words->argv[words->argc] = NULL;
+    words->expand |= lex->expand;
+}
+
+struct command *
+parse_command(struct arena *arena, struct lexer *lex)
+{
+    /*
+     * helper function to parse a single pipe-separated entry, starting at the current token
+     *
+     * args:
+     *  struct arena *arena: arena holding everything allocated for this line
+     *  struct lexer *lex: lexer positioned at the first token of the entry
+     *
+     * returns:
+     *  the command, with lex->token left at the operator or end of line that ended it. NULL on a syntax error
+     */
+
+    static char *closing[] = {"then", "elif", "else", "fi", "do", "done", "}", NULL};
+    static char *compound[] = {"if", "while", "until", "for", "{", NULL};
+    struct command *cmd;
+    struct redir **tail;
+    int slots;
+
+    struct assign *assign, **assign_tail;
+
+    // a reserved word that closes something here was not expected by anything
+    if (is_reserved(lex, closing)) {
+        syntax_error(lex);
+        return NULL;
+    }
+    if (lex->token == TOKEN_LPAREN || is_reserved(lex, compound)) {
+        return parse_compound(arena, lex);
+    }
+
+    cmd = arena_alloc(arena, sizeof(struct command));
+    memset(cmd, 0, sizeof(struct command));
+    tail = &cmd->redirs;
+    assign_tail = &cmd->assigns;
+
+    // argv doubles whenever it fills up, so the number of arguments is only limited by ARG_MAX at exec time
+    slots = ARGV_INITIAL_SLOTS;
+    cmd->argv = arena_alloc(arena, slots * sizeof(char *));
+
+    while (lex->token != TOKEN_END && lex->token != TOKEN_PIPE && lex->token != TOKEN_AMP && lex->token != TOKEN_SEMI &&
+            lex->token != TOKEN_AND_IF && lex->token != TOKEN_OR_IF && lex->token != TOKEN_RPAREN) {
+        if (lex->token == TOKEN_WORD) {
+            cmd->expand |= lex->expand;
+
+            // NAME=value words before the command name are assignments. the name is never
+            // quoted, so it cannot contain marks
+            if (cmd->argc == 0 && strchr(lex->word, '=') != NULL && valid_name(lex->word, strchr(lex->word, '='))) {
+                assign = arena_alloc(arena, sizeof(struct assign));
+                assign->next = NULL;
+                assign->name = lex->word;
+                assign->value = strchr(lex->word, '=');
+                *assign->value++ = 0;
+                *assign_tail = assign;
+                assign_tail = &assign->next;
+            }
+            else {
+                add_arg(arena, cmd, lex->word, &slots);
+            }
+        }
+        else if (is_redir_token(lex->token)) {
+            if ((tail = parse_command_redir(arena, lex, cmd, tail)) == NULL) {
+                return NULL;
+            }
+        }
+        else if (lex->token == TOKEN_LPAREN && cmd->argc == 1 && cmd->assigns == NULL && cmd->redirs == NULL && !cmd->expand) {
+            // name() starts a function definition
+            cmd->argv[1] = NULL;
+            return parse_function(arena, lex, cmd);
+        }
+        else {
+            // a ( anywhere else. problems of the lexer itself are already reported
+            syntax_error(lex);
+            return NULL;
+        }
+        next_token(lex);
+    }
+
+    // an entry needs something to run or at least something to redirect or assign
+    if (cmd->argc == 0 && cmd->redirs == NULL && cmd->assigns == NULL) {
+        syntax_error(lex);
+        return NULL;
+    }
+
+    // make sure that final entry in argv is NULL
+    cmd->argv[cmd->argc] = NULL;
+    return cmd;
+}
+
+void
+add_arg(struct arena *arena, struct command *cmd, char *word, int *slots)
+{
+    /*
+     * helper function to append a word to the argv of a command being parsed, which has *slots
+     * entries allocated
+     */
+
+    // leave room for the terminating NULL
+    if (cmd->argc == *slots - 1) {
+        cmd->argv = arena_grow(arena, cmd->argv, *slots * sizeof(char *), 2 * *slots * sizeof(char *));
+        *slots *= 2;
+    }
+    cmd->argv[cmd->argc++] = word;
+}
+
+struct redir **
+parse_command_redir(struct arena *arena, struct lexer *lex, struct command *cmd, struct redir **tail)
+{
+    /*
+     * helper function to parse a redirection of a command and append it to its list at tail
+     *
+     * returns:
+     *  the new tail of the list, NULL on a syntax error
+     */
+
+    struct redir *redir;
+
+    if ((*tail = parse_redir(arena, lex)) == NULL) {
+        return NULL;
+    }
+
+    // &> adds two of them. the body of a here-document is only read at the end of the line,
+    // so whether it expands is not known yet
+    for (redir = *tail; redir != NULL; redir = redir->next) {
+        cmd->expand |= redir->type == REDIR_HEREDOC || (redir->type != REDIR_HEREDOC_LITERAL && word_expands(redir->path));
+        tail = &redir->next;
+    }
+    return tail;
+}
+
+struct command *
+parse_compound(struct arena *arena, struct lexer *lex)
+{
+    /*
+     * helper function to parse a compound command (if, while, until, for, { } or ( )) and the
+     * redirections after it, which apply to everything inside
+     *
+     * returns:
+     *  a command with its body set, lex->token left at what ended it. NULL on a syntax error
+     */
+
+    static char *group_end[] = {"}", NULL};
+    static char *do_word[] = {"do", NULL};
+    struct command *cmd = new_command(arena);
+    struct redir **tail = &cmd->redirs;
+    struct node *node = NULL;
+
+    // the parser recurses for every level, so a pathological input must not run it out of stack
+    if (lex->depth == PARSE_MAX_DEPTH) {
+        shell_error("syntax error: compound commands nested too deeply");
+        lex->token = -1;
+        return NULL;
+    }
+    lex->depth++;
+    if (lex->token == TOKEN_LPAREN) {
+        node = new_node(arena, NODE_SUBSHELL);
+        next_token(lex);
+        if ((node->body = parse_list(arena, lex, NULL)) == NULL || lex->token != TOKEN_RPAREN) {
+            syntax_error(lex);
+            node = NULL;
+        }
+    }
+    else if (is_keyword(lex, "{")) {
+        node = new_node(arena, NODE_GROUP);
+        next_token(lex);
+        if ((node->body = parse_body(arena, lex, group_end)) == NULL) {
+            node = NULL;
+        }
+    }
+    else if (is_keyword(lex, "if")) {
+        node = parse_if(arena, lex);
+    }
+    else if (is_keyword(lex, "for")) {
+        node = parse_for(arena, lex);
+    }
+    else {
+        // while and until
+        node = new_node(arena, is_keyword(lex, "while") ? NODE_WHILE : NODE_UNTIL);
+        next_token(lex);
+        if ((node->cond = parse_body(arena, lex, do_word)) == NULL || (node->body = parse_do(arena, lex)) == NULL) {
+            node = NULL;
+        }
+    }
+    lex->depth--;
+    if (node == NULL) {
+        return NULL;
+    }
+    cmd->body = node;
+
+    // if, for and while are already past their last word, } and ) are not
+    if (node->type == NODE_GROUP || node->type == NODE_SUBSHELL) {
+        next_token(lex);
+    }
+    while (is_redir_token(lex->token)) {
+        if ((tail = parse_command_redir(arena, lex, cmd, tail)) == NULL) {
+            return NULL;
+        }
+        next_token(lex);
+    }
+    return cmd;
+}
+
+struct node *
+parse_if(struct arena *arena, struct lexer *lex)
+{
+    /*
+     * helper function to parse if list then list [elif list then list]... [else list] fi,
+     * starting at the if (or at an elif, which is parsed as an if of its own)
+     *
+     * returns:
+     *  the node, with lex->token past the fi. NULL on a syntax error
+     */
+
+    static char *then_word[] = {"then", NULL};
+    static char *then_ends[] = {"elif", "else", "fi", NULL};
+    static char *else_ends[] = {"fi", NULL};
+    struct node *node = new_node(arena, NODE_IF);
+
+    next_token(lex);
+    if ((node->cond = parse_body(arena, lex, then_word)) == NULL) {
+        return NULL;
+    }
+    next_token(lex);
+    if ((node->body = parse_body(arena, lex, then_ends)) == NULL) {
+        return NULL;
+    }
+
+    // the elif takes the fi with it
+    if (is_keyword(lex, "elif")) {
+        node->orelse = parse_if(arena, lex);
+        return node->orelse != NULL ? node : NULL;
+    }
+    if (is_keyword(lex, "else")) {
+        next_token(lex);
+        if ((node->orelse = parse_body(arena, lex, else_ends)) == NULL) {
+            return NULL;
+        }
+    }
+    next_token(lex);
+    return node;
+}
+
+struct node *
+parse_for(struct arena *arena, struct lexer *lex)
+{
+    /*
+     * helper function to parse for name [in word...]; do list done, starting at the for
+     *
+     * returns:
+     *  the node, with lex->token past the done. NULL on a syntax error
+     */
+
+    struct node *node = new_node(arena, NODE_FOR);
+    int slots = ARGV_INITIAL_SLOTS;
+
+    if (next_token(lex) != TOKEN_WORD || lex->quoted || lex->expand || !valid_name(lex->word, NULL)) {
+        syntax_error(lex);
+        return NULL;
+    }
+    node->name = lex->word;
+    next_token(lex);
+    if (skip_newlines(lex) < 0) {
+        return NULL;
+    }
+
+    if (is_keyword(lex, "in")) {
+        node->words = new_command(arena);
+        node->words->argv = arena_alloc(arena, slots * sizeof(char *));
+        while (next_token(lex) == TOKEN_WORD) {
+            add_arg(arena, node->words, lex->word, &slots);
+            node->words->expand |= lex->expand;
+        }
+        node->words->argv[node->words->argc] = NULL;
+        if (lex->token != TOKEN_SEMI && lex->token != TOKEN_END) {
+            syntax_error(lex);
+            return NULL;
+        }
+    }
+    if (lex->token == TOKEN_SEMI) {
+        next_token(lex);
+    }
+    if (skip_newlines(lex) < 0) {
+        return NULL;
+    }
+    if (!is_keyword(lex, "do")) {
+        syntax_error(lex);
+        return NULL;
+    }
+    return (node->body = parse_do(arena, lex)) != NULL ? node : NULL;
+}
+
+struct node *
+parse_do(struct arena *arena, struct lexer *lex)
+{
+    /*
+     * helper function to parse do list done, the body of a loop, starting at the do
+     *
+     * returns:
+     *  the list, with lex->token past the done. NULL on a syntax error
+     */
+
+    static char *done_word[] = {"done", NULL};
+    struct node *body;
+
+    next_token(lex);
+    if ((body = parse_body(arena, lex, done_word)) == NULL) {
+        return NULL;
+    }
+    next_token(lex);
+    return body;
+}
+
+struct command *
+parse_function(struct arena *arena, struct lexer *lex, struct command *cmd)
+{
+    /*
+     * helper function to parse the rest of name() compound-command, starting at the (. the
+     * command that had only the name so far becomes the definition
+     *
+     * returns:
+     *  cmd, with lex->token left at what ended the body. NULL on a syntax error
+     */
+
+    static char *compound[] = {"if", "while", "until", "for", "{", NULL};
+    struct node *node = new_node(arena, NODE_FUNCTION);
+
+    node->name = cmd->argv[0];
+    if (next_token(lex) != TOKEN_RPAREN) {
+        syntax_error(lex);
+        return NULL;
+    }
+    next_token(lex);
+    if (skip_newlines(lex) < 0) {
+        return NULL;
+    }
+    if (lex->token != TOKEN_LPAREN && !is_reserved(lex, compound)) {
+        syntax_error(lex);
+        return NULL;
+    }
+    if ((node->function = parse_compound(arena, lex)) == NULL) {
+        return NULL;
+    }
+    cmd->argc = 0;
+    cmd->argv[0] = NULL;
+    cmd->body = node;
+    return cmd;
+}
+
+struct pipeline *
+optimize_pipeline(struct arena *arena, struct pipeline *pipeline)
+{
+    /*
+     * function to drop cat stages whose only job is to pass data along, so one process and one
+     * copy of the data less are needed:
+     *  cat file | prog ...      ->  prog < file ...
+     *  cat < file | prog ...    ->  prog < file ...
+     *  ... | cat | ...          ->  ... | ...
+     * a trailing cat is left alone, since `prog | cat` is how one hides a terminal from prog,
+     * and so is every cat while a function of that name is defined. a dropped stage keeps its
+     * PIPESTATUS entry, as 0, so the others stay at the index they were written at
+     *
+     * this runs right before the pipeline is started, since whether the file is readable can
+     * change between runs of a parsed tree that is kept. the tree is left as it is, the stages
+     * that change are copied
+     *
+     * args:
+     *  struct arena *arena: arena of the current run, the copies are allocated from it
+     *  struct pipeline *pipeline: the pipeline about to be started
+     *
+     * returns:
+     *  the pipeline to start, which is the one passed in when there is nothing to drop
+     */
+
+    struct command *cat, *next, *first, *cmd, *copy, **tail;
+    struct pipeline *optimized;
+    struct redir *redir = NULL;
+    struct stat st;
+    char *path;
+    int middle = 0, stage;
+
+    if (pipeline->num_commands < 2 || (num_functions > 0 && find_function("cat") != NULL)) {
+        return pipeline;
+    }
+
+    // a leading cat reading a single regular file (or its redirected stdin) becomes a redirection
+    cat = pipeline->commands;
+    next = cat->next;
+    if (is_plain_cat(cat) && (cat->argc == 2) != (cat->redirs != NULL)) {
+        path = cat->argc == 2 ? cat->argv[1] : cat->redirs->path;
+        if ((cat->redirs == NULL || (cat->redirs->type == REDIR_IN && cat->redirs->fd == 0 && cat->redirs->next == NULL)) &&
+                strcmp(path, "-") != 0 && !word_expands(path) && stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, R_OK) == 0) {
+            // put it first, so a redirection prog already has still wins
+            redir = arena_alloc(arena, sizeof(struct redir));
+            memset(redir, 0, sizeof(struct redir));
+            redir->type = REDIR_IN;
+            redir->source = -1;
+            redir->path = path;
+            redir->next = next->redirs;
+        }
+    }
+
+    // a bare cat between two other stages connects a pipe to a pipe, so it can go away entirely
+    first = redir != NULL ? next : pipeline->commands;
+    for (cmd = first->next; cmd != NULL && cmd->next != NULL && !middle; cmd = cmd->next) {
+        middle = is_middle_cat(cmd);
+    }
+    if (redir == NULL && !middle) {
+        return pipeline;
+    }
+
+    optimized = arena_alloc(arena, sizeof(struct pipeline));
+    *optimized = *pipeline;
+    optimized->num_commands = 0;
+    optimized->num_stages = pipeline->num_commands;
+    optimized->dropped = memset(arena_alloc(arena, pipeline->num_commands), 0, pipeline->num_commands);
+    optimized->dropped[0] = redir != NULL;
+    tail = &optimized->commands;
+    for (cmd = first, stage = redir != NULL; cmd != NULL; cmd = cmd->next, stage++) {
+        if (cmd != first && cmd->next != NULL && is_middle_cat(cmd)) {
+            optimized->dropped[stage] = 1;
+            continue;
+        }
+        copy = arena_alloc(arena, sizeof(struct command));
+        *copy = *cmd;
+        if (cmd == next && redir != NULL) {
+            copy->redirs = redir;
+        }
+        *tail = copy;
+        tail = &copy->next;
+        optimized->num_commands++;
+    }
+    *tail = NULL;
+    return optimized;
+}
+
+int
+is_middle_cat(struct command *cmd)
+{
+    /*
+     * helper function for optimize_pipeline, true for a bare cat that only joins two pipes
+     */
+
+    return is_plain_cat(cmd) && cmd->argc == 1 && cmd->redirs == NULL;
+}
+
+struct redir *
+parse_redir(struct arena *arena, struct lexer *lex)
+{
+    /*
+     * helper function to parse a redirection operator, with its io number if it had one, and
+     * the word after it
+     *
+     * returns:
+     *  the redirection, or two of them for &> and &>> (> file, then 2>&1). NULL on a syntax error
+     */
+
+    struct redir *redir = arena_alloc(arena, sizeof(struct redir)), *dup;
+    int token = lex->token, io_number = lex->io_number;
+    char *p;
+
+    memset(redir, 0, sizeof(struct redir));
+    redir->source = -1;
+    switch (token) {
+    case TOKEN_LESS:
+        redir->type = REDIR_IN;
+        break;
+    case TOKEN_GREAT:
+    case TOKEN_ANDGREAT:
+        redir->type = REDIR_OUT;
+        break;
+    case TOKEN_DGREAT:
+    case TOKEN_ANDDGREAT:
+        redir->type = REDIR_APPEND;
+        break;
+    case TOKEN_LESSGREAT:
+        redir->type = REDIR_RDWR;
+        break;
+    case TOKEN_LESSAND:
+    case TOKEN_GREATAND:
+        redir->type = REDIR_DUP;
+        break;
+    case TOKEN_TLESS:
+        redir->type = REDIR_HERESTRING;
+        break;
+    default:
+        redir->type = REDIR_HEREDOC;
+        redir->strip_tabs = token == TOKEN_DLESSDASH;
+        break;
+    }
+    redir->fd = io_number >= 0 ? io_number :
+        redir->type == REDIR_OUT || redir->type == REDIR_APPEND || token == TOKEN_GREATAND ? 1 : 0;
+
+    // redirection target is always the following word
+    if (next_token(lex) != TOKEN_WORD) {
+        syntax_error(lex);
+        return NULL;
+    }
+    redir->path = lex->word;
+
+    if (redir->type == REDIR_HEREDOC) {
+        // the delimiter is never expanded, quoting any of it only keeps the body as it is
+        if (lex->quoted) {
+            redir->type = REDIR_HEREDOC_LITERAL;
+            strip_marks(lex->word, 1);
+        }
+        *lex->heredoc_tail = redir;
+        lex->heredoc_tail = &redir->next_heredoc;
+    }
+    else if (redir->type == REDIR_DUP && !lex->expand && strcmp(lex->word, "-") != 0) {
+        for (p = lex->word; *p >= '0' && *p <= '9'; p++);
+        if (*p != 0 || p == lex->word) {
+            // like bash, >&file without an io number is &>file
+            if (token != TOKEN_GREATAND || io_number >= 0) {
+                shell_error("%s: ambiguous redirect", lex->word);
+                lex->token = -1;
+                return NULL;
+            }
+            redir->type = REDIR_OUT;
+            token = TOKEN_ANDGREAT;
+        }
+    }
+
+    if (token == TOKEN_ANDGREAT || token == TOKEN_ANDDGREAT) {
+        dup = arena_alloc(arena, sizeof(struct redir));
+        memset(dup, 0, sizeof(struct redir));
+        dup->type = REDIR_DUP;
+        dup->fd = 2;
+        dup->path = "1";
+        dup->source = -1;
+        redir->next = dup;
+    }
+    return redir;
+}
+
+int
+is_plain_cat(struct command *cmd)
+{
+    /*
+     * helper function for optimize_pipeline, true for a cat with at most one argument and no options
+     */
+
+    return cmd->argc > 0 && cmd->argc <= 2 && strcmp(cmd->argv[0], "cat") == 0 && cmd->assigns == NULL &&
+        (cmd->argc == 1 || (cmd->argv[1][0] != '-' && !word_expands(cmd->argv[1])));
+}
+
+void
+syntax_error(struct lexer *lex)
+{
+    /*
+     * helper function to report the token the parser did not expect
+     */
+
+    static char *names[] = {"newline", "word", "|", "<", ">", ">>", "&", "<<", "<<-", "<<<", "<&", ">&", "<>", "&>", "&>>",
+        ";", "&&", "||", "(", ")"};
+
+    if (lex->token < 0) {
+        return;
+    }
+    shell_error("syntax error near unexpected token `%s'", lex->token == TOKEN_WORD ? lex->word : names[lex->token]);
+
+    // the parser unwinds from here, nothing else needs to be said about it
+    lex->token = -1;
+}
+
+int
+word_expands(char *word)
+{
+    /*
+     * helper function to tell whether a word was left encoded by the lexer, so it has to go
+     * through expansion instead of being used as it is
+     */
+
+    return *word == '~' || strpbrk(word, "$" MARKS) != NULL || glob_chars(word);
+}
+
+char *
+strip_marks(char *word, int force)
+{
+    /*
+     * helper function to drop the quote marks from a word that turned out to have nothing to
+     * expand. unless force is set, the word is only changed if the result has no $, ~, *, ? or [
+     * in it, since those would be taken as something to expand later on
+     *
+     * returns:
+     *  the word, or NULL if it was left untouched
+     */
+
+    char *in, *out;
+
+    for (in = word; *in != 0 && !force; in++) {
+        if (*in == '$' || *in == '~' || *in == '*' || *in == '?' || *in == '[') {
+            return NULL;
+        }
+    }
+    for (in = out = word; *in != 0; in++) {
+        if (*in == MARK_ESCAPE) {
+            // an escaped mark byte cannot come out of the lexer, the next byte is always text
+            *out++ = *++in;
+        }
+        else if (*in != MARK_SQUOTE && *in != MARK_DQUOTE && *in != MARK_END) {
+            *out++ = *in;
+        }
+    }
+    *out = 0;
+    return word;
+}
+
+struct pipeline *
+expand_pipeline(struct arena *arena, struct pipeline *pipeline)
+{
+    /*
+     * function to expand every word of a pipeline right before it runs. the parsed pipeline is
+     * not changed, commands with something to expand are copied into the arena
+     *
+     * returns:
+     *  the expanded pipeline, or NULL if an expansion failed (the error is already reported)
+     */
+
+    struct pipeline *expanded = arena_alloc(arena, sizeof(struct pipeline));
+    struct command *cmd, **tail = &expanded->commands;
+
+    *expanded = *pipeline;
+    expanded->expand = 0;
+    for (cmd = pipeline->commands; cmd != NULL; cmd = cmd->next) {
+        if ((*tail = expand_command(arena, cmd)) == NULL) {
+            return NULL;
+        }
+        tail = &(*tail)->next;
+    }
+    *tail = NULL;
+    return expanded;
+}
+
+struct command *
+expand_command(struct arena *arena, struct command *cmd)
+{
+    /*
+     * helper function to expand the words of a single command. arguments are split into fields,
+     * redirection targets and assigned values are expanded into a single string each
+     *
+     * returns:
+     *  copy of the command with plain words in it, NULL if an expansion failed
+     */
+
+    struct command *expanded = arena_alloc(arena, sizeof(struct command));
+    struct redir *redir, **redir_tail = &expanded->redirs;
+    struct assign *assign, **assign_tail = &expanded->assigns;
+    struct expansion e;
+    int slots;
+
+    *expanded = *cmd;
+    if (!cmd->expand) {
+        return expanded;
+    }
+    expanded->expand = 0;
+
+    memset(&e, 0, sizeof(e));
+    e.arena = arena;
+    e.split = 1;
+    for (int i = 0; i < cmd->argc && !e.failed; i++) {
+        if (!word_expands(cmd->argv[i])) {
+            e.has_field = 1;
+            exp_add(&e, cmd->argv[i], strlen(cmd->argv[i]));
+        }
+        else {
+            e.start = cmd->argv[i];
+            expand_range(&e, cmd->argv[i], cmd->argv[i] + strlen(cmd->argv[i]), 0);
+        }
+        exp_end_field(&e);
+    }
+    if (e.failed) {
+        exp_free(&e);
+        return NULL;
+    }
+
+    // every word may have expanded to nothing, then there is no command left to run
+    slots = e.num_fields + 1;
+    expanded->argv = arena_alloc(arena, slots * sizeof(char *));
+    for (int i = 0; i < e.num_fields; i++) {
+        expanded->argv[i] = e.fields[i];
+    }
+    expanded->argv[e.num_fields] = NULL;
+    expanded->argc = e.num_fields;
+    exp_free(&e);
+
+    for (redir = cmd->redirs; redir != NULL; redir = redir->next) {
+        *redir_tail = arena_alloc(arena, sizeof(struct redir));
+        **redir_tail = *redir;
+        if (redir->type == REDIR_HEREDOC) {
+            if (word_expands(redir->body) && ((*redir_tail)->body = expand_string(arena, redir->body)) == NULL) {
+                return NULL;
+            }
+        }
+        else if (redir->type != REDIR_HEREDOC_LITERAL && word_expands(redir->path) &&
+                ((*redir_tail)->path = expand_string(arena, redir->path)) == NULL) {
+            return NULL;
+        }
+        redir_tail = &(*redir_tail)->next;
+    }
+    *redir_tail = NULL;
+
+    for (assign = cmd->assigns; assign != NULL; assign = assign->next) {
+        *assign_tail = arena_alloc(arena, sizeof(struct assign));
+        **assign_tail = *assign;
+        if (word_expands(assign->value) && ((*assign_tail)->value = expand_string(arena, assign->value)) == NULL) {
+            return NULL;
+        }
+        assign_tail = &(*assign_tail)->next;
+    }
+    *assign_tail = NULL;
+    return expanded;
+}
+
+char *
+expand_string(struct arena *arena, char *word)
+{
+    /*
+     * helper function to expand a word into one string, without field splitting
+     *
+     * returns:
+     *  the expanded word in the arena, NULL if the expansion failed
+     */
+
+    struct expansion e;
+    char *str;
+
+    memset(&e, 0, sizeof(e));
+    e.arena = arena;
+    e.start = word;
+    expand_range(&e, word, word + strlen(word), 0);
+    if (e.failed) {
+        exp_free(&e);
+        return NULL;
+    }
+    str = arena_alloc(arena, e.len + 1);
+    if (e.len > 0) {
+        memcpy(str, e.buf, e.len);
+    }
+    str[e.len] = 0;
+    exp_free(&e);
+    return str;
+}
+
+void
+expand_range(struct expansion *e, char *p, char *end, int dq)
+{
+    /*
+     * helper function to expand the encoded text between p and end into e
+     *
+     * args:
+     *  struct expansion *e: where the result goes
+     *  char *p, *end: the encoded text
+     *  int dq: whether the text starts inside double quotes
+     */
+
+    char *q;
+
+    while (p < end && !e->failed) {
+        switch (*p) {
+        case MARK_SQUOTE:
+            // single quotes hold nothing but text, up to their end mark
+            e->has_field = 1;
+            for (q = ++p; q < end && *q != MARK_END; q++);
+            exp_add(e, p, q - p);
+            p = q + 1;
+            break;
+        case MARK_DQUOTE:
+            e->has_field = 1;
+            dq = 1;
+            p++;
+            break;
+        case MARK_END:
+            dq = 0;
+            p++;
+            break;
+        case MARK_ESCAPE:
+            exp_add(e, p + 1, 1);
+            p += 2;
+            break;
+        case '$':
+            p = expand_dollar(e, p, end, dq);
+            break;
+        case '~':
+            if (p == e->start && !dq) {
+                p = expand_tilde(e, p, end);
+                break;
+            }
+            // fall through
+        default:
+            // plain text in the word of ${NAME-word} came out of an expansion, so it is split too
+            if (e->nested && !dq) {
+                exp_add_value(e, p, 1, 0);
+            }
+            else if (!dq) {
+                exp_add_pattern(e, p, 1);
+            }
+            else {
+                exp_add(e, p, 1);
+            }
+            p++;
+            break;
+        }
+    }
+}
+
+char *
+expand_dollar(struct expansion *e, char *p, char *end, int dq)
+{
+    /*
+     * helper function to expand the parameter starting with the $ at p
+     *
+     * returns:
+     *  pointer just past the expansion in the encoded text
+     */
+
+    char buf[32], *name, *name_end, *brace, *value, *word = NULL, *start, *copy, **items;
+    int length = 0, colon = 0, op = 0, index = -1, list = 0, count, nested;
+    size_t len;
+    struct expansion sub;
+
+    name = p + 1;
+    if (name < end && *name == '(') {
+        if ((brace = subst_end(name + 1)) == NULL || brace >= end) {
+            shell_error("%.*s: bad substitution", (int)(end - p), p);
+            e->failed = 1;
+            return end;
+        }
+        command_subst(e, name + 1, brace - name - 1, dq);
+        return brace + 1;
+    }
+    if (name < end && *name != '{') {
+        // $NAME takes the longest name, a special parameter or a digit is a single character
+        if (*name == '_' || (*name >= 'a' && *name <= 'z') || (*name >= 'A' && *name <= 'Z')) {
+            for (name_end = name; name_end < end && (*name_end == '_' || (*name_end >= 'a' && *name_end <= 'z') ||
+                    (*name_end >= 'A' && *name_end <= 'Z') || (*name_end >= '0' && *name_end <= '9')); name_end++);
+        }
+        else if (strchr("?!$#@*0123456789", *name) != NULL && *name != 0) {
+            name_end = name + 1;
+        }
+        else {
+            // not a parameter, the $ is just text
+            exp_add(e, p, 1);
+            return p + 1;
+        }
+
+        if (*name == '@' || *name == '*') {
+            expand_list(e, positional + 1, num_positional, dq, *name == '@');
+        }
+        else if ((value = param_value(name, name_end - name, buf)) != NULL) {
+            exp_add_value(e, value, strlen(value), dq);
+        }
+        return name_end;
+    }
+    if (name == end) {
+        exp_add(e, p, 1);
+        return p + 1;
+    }
+
+    if ((brace = find_brace(name + 1, end)) == NULL) {
+        shell_error("%.*s: bad substitution", (int)(end - p), p);
+        e->failed = 1;
+        return end;
+    }
+    name++;
+
+    // ${#NAME} is the length, but ${#} alone is $#
+    if (*name == '#' && name + 1 < brace && strchr(":-=+?", name[1]) == NULL) {
+        length = 1;
+        name++;
+    }
+    if (name < brace && strchr("?!$#@*", *name) != NULL) {
+        name_end = name + 1;
+    }
+    else if (name < brace && *name >= '0' && *name <= '9') {
+        for (name_end = name; name_end < brace && *name_end >= '0' && *name_end <= '9'; name_end++);
+    }
+    else {
+        for (name_end = name; name_end < brace && (*name_end == '_' || (*name_end >= 'a' && *name_end <= 'z') ||
+                (*name_end >= 'A' && *name_end <= 'Z') || (*name_end >= '0' && *name_end <= '9')); name_end++);
+    }
+    word = name_end;
+
+    // NAME[n]: PIPESTATUS is the only array, any other variable acts as an array of one
+    if (name_end > name && word < brace && *word == '[') {
+        if (word + 2 < brace && (word[1] == '@' || word[1] == '*') && word[2] == ']') {
+            list = word[1];
+            word += 3;
+        }
+        else {
+            // past the end of PIPESTATUS any index is just as unset, so it stops growing there
+            for (index = 0, word++; word < brace && *word >= '0' && *word <= '9'; word++) {
+                if (index <= pipestatus_len) {
+                    index = index * 10 + *word - '0';
+                }
+            }
+            if (word == brace || *word != ']') {
+                name_end = name;
+            }
+            word++;
+        }
+    }
+
+    if (word < brace && *word == ':') {
+        colon = 1;
+        word++;
+    }
+    if (word < brace && strchr("-=+?", *word) != NULL) {
+        op = *word++;
+    }
+    if (name_end == name || (word < brace && op == 0) || (colon && op == 0) || (length && op != 0)) {
+        shell_error("%.*s: bad substitution", (int)(brace + 1 - p), p);
+        e->failed = 1;
+        return brace + 1;
+    }
+
+    len = name_end - name;
+    if (*name == '@' || *name == '*' || list) {
+        // ${@}, ${*} and ${PIPESTATUS[@]} are lists, which only make sense with no operator
+        if (len == 10 && memcmp(name, "PIPESTATUS", 10) == 0) {
+            count = pipestatus_len;
+            items = arena_alloc(e->arena, (count + 1) * sizeof(char *));
+            for (int i = 0; i < count; i++) {
+                sprintf(buf, "%d", pipestatus[i]);
+                items[i] = arena_alloc(e->arena, strlen(buf) + 1);
+                strcpy(items[i], buf);
+            }
+        }
+        else if (*name == '@' || *name == '*') {
+            count = num_positional;
+            items = positional + 1;
+        }
+        else {
+            // other variables have a single element
+            items = arena_alloc(e->arena, sizeof(char *));
+            items[0] = get_var_len(name, len);
+            count = items[0] != NULL;
+        }
+        if (length) {
+            sprintf(buf, "%d", count);
+            exp_add_value(e, buf, strlen(buf), dq);
+        }
+        else {
+            expand_list(e, items, count, dq, *name == '@' || list == '@');
+        }
+        return brace + 1;
+    }
+
+    if (len == 10 && memcmp(name, "PIPESTATUS", 10) == 0 && index >= 0) {
+        value = NULL;
+        if (index < pipestatus_len) {
+            sprintf(buf, "%d", pipestatus[index]);
+            value = buf;
+        }
+    }
+    else if (index > 0) {
+        value = NULL;
+    }
+    else {
+        value = param_value(name, len, buf);
+    }
+
+    if (length) {
+        sprintf(buf, "%zu", value != NULL ? strlen(value) : 0);
+        exp_add_value(e, buf, strlen(buf), dq);
+        return brace + 1;
+    }
+
+    // without : only an unset parameter counts, with it an empty one does too
+    if (op != 0 && ((value == NULL || (colon && *value == 0)) == (op != '+'))) {
+        if (op == '-' || op == '+') {
+            nested = e->nested;
+            start = e->start;
+            e->nested = 1;
+            e->start = word;
+            expand_range(e, word, brace, dq);
+            e->nested = nested;
+            e->start = start;
+            return brace + 1;
+        }
+
+        // = and ? need the word as a string of its own
+        memset(&sub, 0, sizeof(sub));
+        sub.arena = e->arena;
+        sub.start = word;
+        expand_range(&sub, word, brace, dq);
+        exp_add(&sub, "", 1);
+        if (sub.failed) {
+            e->failed = 1;
+        }
+        else if (op == '?') {
+            shell_error("%.*s: %s", (int)len, name, sub.len > 1 ? sub.buf : "parameter null or not set");
+            e->failed = 1;
+            // a script ends here. a $(...) run inside the shell only fails, like the subshell
+            // it stands for would have exited
+            if (!interactive_shell && !noexec && subst_depth == 0) {
+                exit(1);
+            }
+        }
+        else if (!valid_name(name, name_end)) {
+            shell_error("%.*s: cannot assign in this way", (int)len, name);
+            e->failed = 1;
+        }
+        else {
+            copy = arena_alloc(e->arena, len + 1);
+            memcpy(copy, name, len);
+            copy[len] = 0;
+            set_var(copy, sub.buf, 0);
+            exp_add_value(e, sub.buf, sub.len - 1, dq);
+        }
+        exp_free(&sub);
+        return brace + 1;
+    }
+    if (op != '+' && value != NULL) {
+        exp_add_value(e, value, strlen(value), dq);
+    }
+    return brace + 1;
+}
+
+char *
+subst_end(char *p)
+{
+    /*
+     * helper function to find the ) that closes a $(, skipping quoted text, escaped characters,
+     * comments and nested parentheses
+     *
+     * args:
+     *  char *p: just past the $(
+     *
+     * returns:
+     *  pointer to the ), NULL if there is none
+     */
+
+    int depth = 0;
+
+    for (; *p != 0; p++) {
+        switch (*p) {
+        case '\\':
+            if (*++p == 0) {
+                return NULL;
+            }
+            break;
+        case '\'':
+            while (*++p != '\'') {
+                if (*p == 0) {
+                    return NULL;
+                }
+            }
+            break;
+        case '"':
+            while (*++p != '"') {
+                if (*p == 0 || (*p == '\\' && *++p == 0)) {
+                    return NULL;
+                }
+                if (*p == '$' && p[1] == '(' && (p = subst_end(p + 2)) == NULL) {
+                    return NULL;
+                }
+            }
+            break;
+        case '(':
+            depth++;
+            break;
+        case ')':
+            if (depth-- == 0) {
+                return p;
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+void
+command_subst(struct expansion *e, char *text, size_t len, int dq)
+{
+    /*
+     * helper function to run the command of a $(...) and expand to its output, without its
+     * trailing newlines. the command runs through the normal executor with the shell's stdout
+     * pointing at a pipe, which is drained while the shell waits for the children. the output
+     * is split straight out of that buffer
+     *
+     * args:
+     *  struct expansion *e: where the result goes
+     *  char *text: the command, not terminated
+     *  size_t len: its length
+     *  int dq: whether the $(...) is inside double quotes
+     */
+
+    struct capture capture = {-1, -1, NULL, 0, 0}, *outer = current_capture;
+    struct node *list;
+    int fds[2], saved_stdout, status = last_status;
+
+    // every level runs on the stack of the one around it
+    if (subst_depth == SUBST_MAX_DEPTH) {
+        shell_error("$(...): nested too deeply");
+        e->failed = 1;
+        return;
+    }
+    // with -n nothing runs, the command is only checked and expands to nothing
+    if (noexec) {
+        if (parse_cached(text, len) == NULL) {
+            last_status = 2;
+        }
+        return;
+    }
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        e->failed = 1;
+        return;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    // whatever the shell printed so far belongs to its own stdout
+    fflush(stdout);
+    if ((saved_stdout = fcntl(1, F_DUPFD_CLOEXEC, SAVED_FDS)) < 0 && errno != EBADF) {
+        perror("fcntl");
+        close(fds[0]);
+        close(fds[1]);
+        e->failed = 1;
+        return;
+    }
+    dup2(fds[1], 1);
+    close(fds[1]);
+    capture.fd = fds[0];
+    current_capture = &capture;
+    subst_depth++;
+
+    // a single pipeline runs like on its own line. anything more goes into one child as a whole,
+    // so that an assignment or a cd inside is seen by the commands after it, like in a subshell
+    if ((list = parse_cached(text, len)) == NULL) {
+        last_status = 2;
+    }
+    else if (list->type == NODE_PIPELINE && list->next == NULL) {
+        execute_node(e->arena, list);
+    }
+    else if (list != &empty_line) {
+        execute_pipeline(e->arena, subshell_pipeline(e->arena, list));
+    }
+    status = last_status;
+    subst_depth--;
+
+    fflush(stdout);
+    if (saved_stdout >= 0) {
+        dup2(saved_stdout, 1);
+        close(saved_stdout);
+    }
+    else {
+        close(1);
+    }
+    current_capture = outer;
+
+    // background jobs started inside may still hold the pipe, like in other shells the output
+    // is only complete once they let go of it
+    while (1) {
+        capture_read(&capture);
+        if (capture.fd < 0) {
+            break;
+        }
+        wait_events(capture.fd, -1);
+    }
+    if (capture.memfd >= 0) {
+        close(capture.memfd);
+    }
+
+    while (capture.len > 0 && capture.buf[capture.len - 1] == '\n') {
+        capture.len--;
+    }
+    exp_add_value(e, capture.buf, capture.len, dq);
+    free(capture.buf);
+
+    last_status = subst_status = status;
+}
+
+void
+capture_read(struct capture *capture)
+{
+    /*
+     * helper function to read whatever is in the pipe of a $(...) right now. the pipe is closed
+     * (and capture->fd set to -1) once every writer is gone
+     */
+
+    ssize_t got;
+
+    while (capture->fd >= 0) {
+        if (capture->cap - capture->len < READ_CHUNK_SIZE) {
+            capture->cap = capture->cap == 0 ? READ_CHUNK_SIZE : 2 * capture->cap;
+            if ((capture->buf = realloc(capture->buf, capture->cap)) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        if ((got = read(capture->fd, capture->buf + capture->len, capture->cap - capture->len)) > 0) {
+            capture->len += got;
+            continue;
+        }
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got == 0 || errno != EAGAIN) {
+            close(capture->fd);
+            capture->fd = -1;
+        }
+        return;
+    }
+}
+
+void
+capture_memfd(struct capture *capture)
+{
+    /*
+     * helper function to move what a builtin wrote into the memfd of a $(...) over to the
+     * captured output, leaving the memfd empty for the next builtin
+     */
+
+    off_t size = lseek(capture->memfd, 0, SEEK_CUR);
+    ssize_t got;
+
+    if (size <= 0) {
+        return;
+    }
+    if (capture->len + size > capture->cap) {
+        capture->cap = capture->len + size > 2 * capture->cap ? capture->len + size : 2 * capture->cap;
+        if ((capture->buf = realloc(capture->buf, capture->cap)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    if ((got = pread(capture->memfd, capture->buf + capture->len, size, 0)) > 0) {
+        capture->len += got;
+    }
+    ftruncate(capture->memfd, 0);
+    lseek(capture->memfd, 0, SEEK_SET);
+}
+
+char *
+find_brace(char *p, char *end)
+{
+    /*
+     * helper function to find the } that closes a ${, skipping nested ${...}, escaped characters
+     * and single-quoted text
+     *
+     * returns:
+     *  pointer to the }, NULL if there is none
+     */
+
+    int depth = 0;
+
+    for (; p < end; p++) {
+        if (*p == MARK_ESCAPE) {
+            p++;
+        }
+        else if (*p == MARK_SQUOTE) {
+            while (p + 1 < end && *++p != MARK_END);
+        }
+        else if (*p == '$' && p + 1 < end && p[1] == '{') {
+            depth++;
+            p++;
+        }
+        else if (*p == '$' && p + 1 < end && p[1] == '(' && subst_end(p + 2) != NULL) {
+            p = subst_end(p + 2);
+        }
+        else if (*p == '}' && depth-- == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+char *
+param_value(char *name, size_t len, char *buf)
+{
+    /*
+     * helper function to look up a parameter: a special one, a positional one or a variable
+     *
+     * args:
+     *  char *name: the name, not terminated
+     *  size_t len: its length
+     *  char *buf: room for at least 32 bytes, for values that have to be formatted
+     *
+     * returns:
+     *  the value, NULL if the parameter is unset
+     */
+
+    long n;
+
+    if (len == 1 && strchr("?!$#", *name) != NULL) {
+        n = *name == '?' ? last_status : *name == '!' ? last_bg_pid : *name == '$' ? shell_pid : num_positional;
+        if (*name == '!' && last_bg_pid == 0) {
+            return NULL;
+        }
+        sprintf(buf, "%ld", n);
+        return buf;
+    }
+    if (*name >= '0' && *name <= '9') {
+        for (n = 0; len > 0 && n <= num_positional; len--) {
+            n = n * 10 + *name++ - '0';
+        }
+        return n <= num_positional ? positional[n] : NULL;
+    }
+    return get_var_len(name, len);
+}
+
+void
+expand_list(struct expansion *e, char **items, int count, int dq, int separate)
+{
+    /*
+     * helper function to expand a list of values, like $@ or $*. "$@" gives every value a field
+     * of its own, "$*" joins them with the first character of IFS, unquoted they are all split
+     *
+     * args:
+     *  int separate: whether this is the @ form
+     */
+
+    char *ifs = get_var("IFS");
+
+    if (dq && separate && count == 0 && e->len == 0) {
+        // "$@" with nothing to expand does not even leave an empty field behind
+        e->has_field = 0;
+    }
+    for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            if (e->split && (separate || !dq)) {
+                exp_end_field(e);
+            }
+            else if (ifs == NULL || *ifs != 0) {
+                exp_add(e, ifs == NULL ? " " : ifs, 1);
+            }
+        }
+        exp_add_value(e, items[i], strlen(items[i]), dq);
+    }
+}
+
+char *
+expand_tilde(struct expansion *e, char *p, char *end)
+{
+    /*
+     * helper function to expand the ~ or ~user at p into a home directory. anything quoted in the
+     * user name leaves the ~ as text
+     *
+     * returns:
+     *  pointer just past what was expanded
+     */
+
+    char *q, *name, *dir = NULL;
+    struct passwd *pw;
+
+    for (q = p + 1; q < end && *q != '/' && *q != '$' && strchr(MARKS, *q) == NULL; q++);
+    if (q < end && *q != '/') {
+        exp_add(e, p, 1);
+        return p + 1;
+    }
+
+    if (q == p + 1) {
+        if ((dir = get_var("HOME")) == NULL && (pw = getpwuid(getuid())) != NULL) {
+            dir = pw->pw_dir;
+        }
+    }
+    else {
+        name = arena_alloc(e->arena, q - p);
+        memcpy(name, p + 1, q - p - 1);
+        name[q - p - 1] = 0;
+        if ((pw = getpwnam(name)) != NULL) {
+            dir = pw->pw_dir;
+        }
+    }
+
+    // an unknown user is left alone
+    if (dir == NULL) {
+        exp_add(e, p, q - p);
+    }
+    else {
+        e->has_field = 1;
+        exp_add(e, dir, strlen(dir));
+    }
+    return q;
+}
+
+void
+exp_add(struct expansion *e, char *str, size_t len)
+{
+    /*
+     * helper function to append text to the field being built. when the field may become a
+     * pattern, the glob characters in it are marked as text
+     */
+
+    if (len == 0) {
+        return;
+    }
+    for (size_t i = 0; e->split && i < len; i++) {
+        if (str[i] == '*' || str[i] == '?' || str[i] == '[') {
+            e->split = 0;
+            exp_add(e, str, i);
+            exp_add(e, (char[]){MARK_ESCAPE, str[i]}, 2);
+            e->split = 1;
+            e->escaped = 1;
+            exp_add(e, str + i + 1, len - i - 1);
+            return;
+        }
+    }
+    if (e->len + len > e->cap) {
+        e->cap = e->cap == 0 ? 64 : e->cap;
+        while (e->len + len > e->cap) {
+            e->cap *= 2;
+        }
+        if ((e->buf = realloc(e->buf, e->cap)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(e->buf + e->len, str, len);
+    e->len += len;
+}
+
+void
+exp_add_value(struct expansion *e, char *value, size_t len, int dq)
+{
+    /*
+     * helper function to append the value of an expansion. quoted (or when building a single
+     * string) it goes in as it is, otherwise it is split into fields on the characters of IFS.
+     * runs of IFS whitespace make one separator, every other IFS character is a separator of its
+     * own, so "a::b" with IFS=: gives an empty field in the middle
+     */
+
+    char *ifs, *p;
+    int after_space = 0;
+
+    if (dq || !e->split) {
+        if (dq) {
+            e->has_field = 1;
+        }
+        exp_add(e, value, len);
+        return;
+    }
+
+    if ((ifs = get_var("IFS")) == NULL) {
+        ifs = " \t\n";
+    }
+    for (p = value; p < value + len; p++) {
+        if (*p == 0 || strchr(ifs, *p) == NULL) {
+            exp_add_pattern(e, p, 1);
+            after_space = 0;
+        }
+        else if (*p == ' ' || *p == '\t' || *p == '\n') {
+            exp_end_field(e);
+            after_space = 1;
+        }
+        else {
+            // whitespace right before the separator already ended the field
+            if (!after_space) {
+                e->has_field = 1;
+                exp_end_field(e);
+            }
+            after_space = 0;
+        }
+    }
+}
+
+void
+exp_add_pattern(struct expansion *e, char *str, size_t len)
+{
+    /*
+     * helper function to append unquoted text, where * ? and [ are glob characters
+     */
+
+    int split = e->split;
+
+    for (size_t i = 0; i < len && split; i++) {
+        e->glob |= str[i] == '*' || str[i] == '?' || str[i] == '[';
+    }
+    e->split = 0;
+    exp_add(e, str, len);
+    e->split = split;
+}
+
+void
+exp_end_field(struct expansion *e)
+{
+    /*
+     * helper function to finish the field being built, if there is one, copying it into the arena.
+     * a field with glob characters becomes the sorted paths it matches, or stays as it is when
+     * it matches nothing
+     */
+
+    char path[PATH_MAX], *pattern, *in, *out;
+    int start = e->num_fields;
+
+    if (e->len == 0 && !e->has_field) {
+        return;
+    }
+    if (e->glob) {
+        pattern = arena_alloc(e->arena, e->len + 1);
+        memcpy(pattern, e->buf, e->len);
+        pattern[e->len] = 0;
+        if (*pattern == '/') {
+            path[0] = '/';
+            glob_walk(e, path, 1, pattern + strspn(pattern, "/"));
+        }
+        else {
+            glob_walk(e, path, 0, pattern);
+        }
+        if (e->num_fields > start) {
+            qsort(e->fields + start, e->num_fields - start, sizeof(char *), compare_strings);
+            e->len = 0;
+            e->has_field = e->glob = e->escaped = 0;
+            return;
+        }
+    }
+
+    // the pattern matched nothing (or was not one), the marks go
+    if (e->escaped) {
+        for (in = out = e->buf; in < e->buf + e->len; in++) {
+            if (*in == MARK_ESCAPE && in + 1 < e->buf + e->len) {
+                in++;
+            }
+            *out++ = *in;
+        }
+        e->len = out - e->buf;
+    }
+    exp_push_field(e, e->buf, e->len);
+    e->len = 0;
+    e->has_field = e->glob = e->escaped = 0;
+}
+
+void
+exp_push_field(struct expansion *e, char *str, size_t len)
+{
+    /*
+     * helper function to add a field, copied into the arena
+     */
+
+    char *field;
+
+    if (e->num_fields == e->cap_fields) {
+        e->cap_fields = e->cap_fields == 0 ? ARGV_INITIAL_SLOTS : 2 * e->cap_fields;
+        if ((e->fields = realloc(e->fields, e->cap_fields * sizeof(char *))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    field = arena_alloc(e->arena, len + 1);
+    if (len > 0) {
+        memcpy(field, str, len);
+    }
+    field[len] = 0;
+    e->fields[e->num_fields++] = field;
+}
+
+int
+glob_chars(char *word)
+{
+    /*
+     * helper function to tell whether a word as the lexer left it has glob characters outside of
+     * quotes. a [ only counts with a ] after it, so the [ command is not something to expand
+     */
+
+    char *p;
+
+    for (p = word; *p != 0; p++) {
+        if (*p == MARK_SQUOTE) {
+            while (p[1] != 0 && *++p != MARK_END);
+        }
+        else if (*p == MARK_ESCAPE && p[1] != 0) {
+            p++;
+        }
+        else if (*p == '*' || *p == '?' || (*p == '[' && strchr(p + 1, ']') != NULL)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void
+glob_walk(struct expansion *e, char *path, size_t path_len, char *pattern)
+{
+    /*
+     * function to match the rest of a pattern against the directory path, one component at a
+     * time, adding every path that matches in full as a field. a component without glob
+     * characters is just taken over, only the ones with them read the directory. ** as a whole
+     * component matches any number of directories, without following symlinks
+     *
+     * args:
+     *  struct expansion *e: where matching paths go
+     *  char *path: buffer of PATH_MAX bytes, with the path so far in front
+     *  size_t path_len: length of the path so far, 0 for the current directory
+     *  char *pattern: the components still to match, glob characters marked as in exp_end_field
+     */
+
+    char *end = strchr(pattern, '/'), *rest = NULL, *matched = NULL, *entry, *name;
+    struct dir_listing *listing;
+    size_t matched_len = 0, matched_cap = 0, len;
+    int deep, hidden;
+
+    if (end != NULL) {
+        rest = end + strspn(end, "/");
+    }
+    else {
+        end = pattern + strlen(pattern);
+    }
+    if (path_len > 0 && path[path_len - 1] != '/' && path_len < PATH_MAX - 1) {
+        path[path_len++] = '/';
+    }
+
+    if (!glob_meta(pattern, end)) {
+        for (char *p = pattern; p < end && path_len < PATH_MAX - 1; p++) {
+            if (*p == MARK_ESCAPE && p + 1 < end) {
+                p++;
+            }
+            path[path_len++] = *p;
+        }
+        path[path_len] = 0;
+        if (rest == NULL || *rest == 0) {
+            glob_emit(e, path, path_len, DT_UNKNOWN, rest != NULL);
+        }
+        else {
+            glob_walk(e, path, path_len, rest);
+        }
+        return;
+    }
+
+    path[path_len] = 0;
+    if ((listing = read_dir(path_len > 0 ? path : ".")) == NULL) {
+        return;
+    }
+    deep = end - pattern == 2 && pattern[0] == '*' && pattern[1] == '*';
+    hidden = *pattern == '.' || (*pattern == MARK_ESCAPE && pattern[1] == '.');
+
+    // ** matches no directory at all as well
+    if (deep && rest != NULL && *rest != 0) {
+        glob_walk(e, path, path_len, rest);
+    }
+
+    // matches are added here, the ones to go down into are kept for after the loop, since the
+    // listing may be replaced in the directory cache by then
+    for (entry = listing->entries; entry < listing->entries + listing->size; entry += len + 2) {
+        name = entry + 1;
+        len = strlen(name);
+        if ((*name == '.' && !hidden) || (!deep && !glob_match(pattern, end, name))) {
+            continue;
+        }
+        if (path_len + len >= PATH_MAX - 1) {
+            continue;
+        }
+        memcpy(path + path_len, name, len + 1);
+        if (deep && (rest == NULL || *rest == 0)) {
+            glob_emit(e, path, path_len + len, *entry, rest != NULL);
+        }
+        if (!deep && (rest == NULL || *rest == 0)) {
+            glob_emit(e, path, path_len + len, *entry, rest != NULL);
+            continue;
+        }
+
+        // only what may be a directory is worth going down into, and ** does not follow symlinks
+        if (*entry == DT_DIR || *entry == DT_UNKNOWN || (*entry == DT_LNK && !deep)) {
+            if (matched_len + len + 2 > matched_cap) {
+                matched_cap = matched_cap == 0 ? 4096 : 2 * matched_cap;
+                while (matched_len + len + 2 > matched_cap) {
+                    matched_cap *= 2;
+                }
+                if ((matched = realloc(matched, matched_cap)) == NULL) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            memcpy(matched + matched_len, entry, len + 2);
+            matched_len += len + 2;
+        }
+    }
+
+    for (entry = matched; entry < matched + matched_len; entry += len + 2) {
+        name = entry + 1;
+        len = strlen(name);
+        memcpy(path + path_len, name, len + 1);
+        if (deep && *entry == DT_UNKNOWN) {
+            struct stat st;
+
+            if (lstat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+                continue;
+            }
+        }
+        glob_walk(e, path, path_len + len, deep ? pattern : rest);
+    }
+    free(matched);
+}
+
+void
+glob_emit(struct expansion *e, char *path, size_t path_len, int type, int slash)
+{
+    /*
+     * helper function to add a path that matched a whole pattern. for a pattern that ended in a
+     * /, it has to be a directory and gets the / back. a path whose last component was taken
+     * over as it was has to exist
+     *
+     * args:
+     *  int type: d_type of the last component, DT_UNKNOWN if it was not read from the directory
+     *  int slash: whether the pattern ended in a /
+     */
+
+    struct stat st;
+
+    if (slash && type != DT_DIR && (stat(path, &st) < 0 || !S_ISDIR(st.st_mode))) {
+        return;
+    }
+    if (!slash && type == DT_UNKNOWN && lstat(path, &st) < 0) {
+        return;
+    }
+    if (slash && path_len < PATH_MAX - 1) {
+        path[path_len++] = '/';
+    }
+    exp_push_field(e, path, path_len);
+    path[path_len - slash] = 0;
+}
+
+int
+glob_match(char *p, char *end, char *name)
+{
+    /*
+     * function to match a name against one component of a pattern, between p and end. a * that
+     * did not work out is retried one character further, only the last * ever needs that
+     *
+     * returns:
+     *  1 if the whole name matches
+     */
+
+    char *star = NULL, *star_name = NULL, *next;
+    int matched;
+
+    while (*name != 0 || p < end) {
+        if (p < end && *p == '*') {
+            while (p < end && *p == '*') {
+                p++;
+            }
+            star = p;
+            star_name = name;
+            continue;
+        }
+        if (p < end && *name != 0) {
+            if (*p == '?') {
+                p++;
+                name++;
+                continue;
+            }
+            if (*p == '[' && (next = glob_bracket(p, end, (unsigned char)*name, &matched)) != NULL) {
+                if (matched) {
+                    p = next;
+                    name++;
+                    continue;
+                }
+            }
+            else {
+                next = *p == MARK_ESCAPE && p + 1 < end ? p + 1 : p;
+                if (*next == *name) {
+                    p = next + 1;
+                    name++;
+                    continue;
+                }
+            }
+        }
+        if (star == NULL || *star_name == 0) {
+            return 0;
+        }
+        p = star;
+        name = ++star_name;
+    }
+    return 1;
+}
+
+char *
+glob_bracket(char *p, char *end, int c, int *matched)
+{
+    /*
+     * helper function to match a character against the bracket expression at p, like [a-z],
+     * [!0-9] or [[:alpha:]_]
+     *
+     * returns:
+     *  pointer just past the closing ], NULL if there is none and the [ is just a character
+     */
+
+    static char *classes[] = {"alnum", "alpha", "blank", "cntrl", "digit", "graph", "lower", "print", "punct",
+        "space", "upper", "xdigit", NULL};
+    static int (*tests[])(int) = {isalnum, isalpha, isblank, iscntrl, isdigit, isgraph, islower, isprint, ispunct,
+        isspace, isupper, isxdigit};
+    char *q = p + 1, *first, *class_end;
+    int negate = 0, lo, hi;
+
+    *matched = 0;
+    if (q < end && (*q == '!' || *q == '^')) {
+        negate = 1;
+        q++;
+    }
+    for (first = q; q < end && (*q != ']' || q == first); ) {
+        if (*q == '[' && q + 1 < end && q[1] == ':') {
+            for (class_end = q + 2; class_end + 1 < end && !(class_end[0] == ':' && class_end[1] == ']'); class_end++);
+            if (class_end + 1 < end) {
+                for (int i = 0; classes[i] != NULL; i++) {
+                    if ((size_t)(class_end - q - 2) == strlen(classes[i]) && strncmp(q + 2, classes[i], class_end - q - 2) == 0) {
+                        *matched |= tests[i](c) != 0;
+                    }
+                }
+                q = class_end + 2;
+                continue;
+            }
+        }
+        if (*q == MARK_ESCAPE && q + 1 < end) {
+            q++;
+        }
+        lo = hi = (unsigned char)*q++;
+        if (q + 1 < end && *q == '-' && q[1] != ']') {
+            q++;
+            if (*q == MARK_ESCAPE && q + 1 < end) {
+                q++;
+            }
+            hi = (unsigned char)*q++;
+        }
+        *matched |= c >= lo && c <= hi;
+    }
+    if (q >= end) {
+        return NULL;
+    }
+    *matched ^= negate;
+    return q + 1;
+}
+
+int
+glob_meta(char *p, char *end)
+{
+    /*
+     * helper function to tell whether a pattern component has glob characters that are not
+     * marked as text
+     */
+
+    int matched;
+
+    for (; p < end; p++) {
+        if (*p == MARK_ESCAPE) {
+            p++;
+        }
+        else if (*p == '*' || *p == '?' || (*p == '[' && glob_bracket(p, end, 0, &matched) != NULL)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+struct dir_listing *
+read_dir(char *path)
+{
+    /*
+     * function to get the names in a directory for a glob, with getdents64 and its d_type so no
+     * entry needs a stat of its own. the last few directories stay cached for as long as their
+     * mtime says nothing was added, removed or renamed in them. timestamps are only as fine as the
+     * kernel's clock tick, so one read right after a change is not kept
+     *
+     * returns:
+     *  the listing, valid until the next read_dir. NULL if path is not a readable directory
+     */
+
+    static unsigned long clock;
+    struct dir_listing *listing = NULL, *victim = dir_cache;
+    struct dirent64 *dirent;
+    struct timespec now;
+    struct stat st;
+    char buf[GLOB_DENTS_SIZE];
+    size_t cap = 0, len;
+    ssize_t got;
+    int fd;
+
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+    for (int i = 0; i < DIR_CACHE_SLOTS && listing == NULL; i++) {
+        if (dir_cache[i].used > 0 && dir_cache[i].dev == st.st_dev && dir_cache[i].ino == st.st_ino) {
+            listing = &dir_cache[i];
+        }
+        else if (dir_cache[i].used < victim->used) {
+            victim = &dir_cache[i];
+        }
+    }
+    if (listing != NULL && listing->mtime.tv_sec == st.st_mtim.tv_sec && listing->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+            st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec + DIR_CACHE_RACY_NS < listing->read_ns) {
+        listing->used = ++clock;
+        return listing;
+    }
+    if (listing == NULL) {
+        listing = victim;
+    }
+
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    free(listing->entries);
+    listing->entries = NULL;
+    listing->size = 0;
+    listing->used = 0;
+    while ((got = getdents64(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + got; p += dirent->d_reclen) {
+            dirent = (struct dirent64 *)p;
+            if (dirent->d_name[0] == '.' && (dirent->d_name[1] == 0 || (dirent->d_name[1] == '.' && dirent->d_name[2] == 0))) {
+                continue;
+            }
+            len = strlen(dirent->d_name);
+            if (listing->size + len + 2 > cap) {
+                cap = cap == 0 ? 4096 : 2 * cap;
+                while (listing->size + len + 2 > cap) {
+                    cap *= 2;
+                }
+                if ((listing->entries = realloc(listing->entries, cap)) == NULL) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            listing->entries[listing->size] = dirent->d_type;
+            memcpy(listing->entries + listing->size + 1, dirent->d_name, len + 1);
+            listing->size += len + 2;
+        }
+    }
+    close(fd);
+    if (got < 0) {
+        free(listing->entries);
+        listing->entries = NULL;
+        listing->size = 0;
+        return NULL;
+    }
+
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->read_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    listing->used = ++clock;
+    return listing;
+}
+
+int
+compare_strings(const void *a, const void *b)
+{
+    /*
+     * helper function to order strings for qsort, byte by byte
+     */
+
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+void
+exp_free(struct expansion *e)
+{
+    /*
+     * helper function to release the buffers of an expansion, whatever was copied into the arena stays
+     */
+
+    free(e->buf);
+    free(e->fields);
+}
+
+void
+execute_list(struct arena *arena, struct node *list)
+{
+    /*
+     * function to run the commands of a list one after the other, until a break, continue or
+     * return wants out
+     *
+     * args:
+     *  struct arena *arena: arena of the current line, which expanded words are allocated from
+     *  struct node *list: the first command
+     */
+
+    for (; list != NULL && !unwinding(); list = list->next) {
+        execute_node(arena, list);
+    }
+}
+
+void
+execute_node(struct arena *arena, struct node *node)
+{
+    /*
+     * function to run one command of a list. the control flow is all decided right here in the
+     * shell, only the commands at the leaves of the tree ever get a process
+     *
+     * args:
+     *  struct arena *arena: arena of the current line, which expanded words are allocated from
+     *  struct node *node: the command
+     */
+
+    switch (node->type) {
+    case NODE_PIPELINE:
+        execute_pipeline(arena, node->pipeline);
+        if (node->pipeline->negate && !node->pipeline->background) {
+            last_status = !last_status;
+        }
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        execute_node(arena, node->cond);
+        if (!unwinding() && (last_status == 0) == (node->type == NODE_AND)) {
+            execute_node(arena, node->body);
+        }
+        break;
+    case NODE_IF:
+        execute_list(arena, node->cond);
+        if (unwinding()) {
+            break;
+        }
+        if (last_status == 0) {
+            execute_list(arena, node->body);
+        }
+        else if (node->orelse != NULL) {
+            execute_list(arena, node->orelse);
+        }
+        else {
+            // no branch was taken
+            last_status = 0;
+        }
+        break;
+    case NODE_WHILE:
+    case NODE_UNTIL:
+    case NODE_FOR:
+        execute_loop(arena, node);
+        break;
+    case NODE_FUNCTION:
+        define_function(node->name, node->function);
+        last_status = 0;
+        break;
+    default:
+        // { } and ( ), which is already in its own child when it gets here
+        execute_list(arena, node->body);
+        break;
+    }
+}
+
+void
+execute_loop(struct arena *arena, struct node *node)
+{
+    /*
+     * helper function to run a while, until or for loop. every round gives back what it took
+     * from the arena, so a long loop runs in the same memory as a short one
+     *
+     * args:
+     *  struct arena *arena: arena of the current line, which expanded words are allocated from
+     *  struct node *node: the loop
+     */
+
+    struct arena_mark mark;
+    struct command *words;
+    char **values = NULL;
+    int count = 0, status = 0;
+
+    if (node->type == NODE_FOR) {
+        // without in, the loop goes over the positional parameters as they are now
+        if (node->words == NULL) {
+            count = num_positional;
+            values = memcpy(arena_alloc(arena, (count + 1) * sizeof(char *)), positional + 1, (count + 1) * sizeof(char *));
+        }
+        else if ((words = expand_command(arena, node->words)) == NULL) {
+            last_status = 1;
+            return;
+        }
+        else {
+            count = words->argc;
+            values = words->argv;
+        }
+    }
+
+    loop_depth++;
+    arena_save(arena, &mark);
+    for (int i = 0; !returning && !interrupted; i++) {
+        if (node->type == NODE_FOR) {
+            if (i == count) {
+                break;
+            }
+            set_var(node->name, values[i], 0);
+        }
+        else {
+            execute_list(arena, node->cond);
+            if (!unwinding() && (last_status == 0) != (node->type == NODE_WHILE)) {
+                break;
+            }
+        }
+        if (!unwinding()) {
+            execute_list(arena, node->body);
+            status = last_status;
+        }
+        arena_rewind(arena, &mark);
+
+        if (breaking > 0) {
+            breaking--;
+            break;
+        }
+        // continue n leaves n - 1 loops and goes on with the next round of the last one
+        if (continuing > 0 && --continuing > 0) {
+            break;
+        }
+    }
+    arena_rewind(arena, &mark);
+    loop_depth--;
+
+    // the status of the last round of the body, 0 if it never ran
+    if (!returning && !interrupted) {
+        last_status = status;
+    }
+}
+
+void
+execute_pipeline(struct arena *arena, struct pipeline *pipeline)
+{
+    /*
+     * function to start every command of a parsed pipeline, connected through pipes, and wait for them
+     *
+     * args:
+     *  struct arena *arena: arena of the current line, which expanded words are allocated from
+     *  struct pipeline *pipeline: the parsed line
+     */
+
+    struct command *cmd;
+    struct process *proc;
+    struct job *job;
+    struct limits limits;
+    struct job timeout;
+    struct rusage before[2], after[2];
+    long long start_ns;
+    int fds[2], log_out[2] = {-1, -1}, log_err[2] = {-1, -1};
+    int read_fd, write_fd, next_read_fd, pin_start;
+
+    // the parsed pipeline is left as it is, so it could run again with other values
+    subst_status = -1;
+    if (pipeline->expand && (pipeline = expand_pipeline(arena, pipeline)) == NULL) {
+        last_status = 1;
+        set_pipestatus_single(last_status);
+        return;
+    }
+    pipeline = optimize_pipeline(arena, pipeline);
+
+    // a lone builtin runs right here, so `cd` and `exit` affect the shell and `true` costs no fork.
+    // so do functions and compound commands, whose own commands then decide for themselves. in
+    // the background they get a child like everything else
+    // limited commands always get a child, limits are not for the shell itself. neither are
+    // timeouts, a child can be killed when its time is up
+    if (pipeline->timeout != NULL && prepare_timeout(arena, pipeline->timeout, &timeout) < 0) {
+        last_status = 2;
+        set_pipestatus_single(last_status);
+        return;
+    }
+    if (pipeline->limits != NULL && prepare_limits(arena, pipeline->limits, &limits) < 0) {
+        last_status = 2;
+        set_pipestatus_single(last_status);
+        return;
+    }
+
+    cmd = pipeline->commands;
+    if (pipeline->num_commands == 1 && !pipeline->background && pipeline->limits == NULL && pipeline->timeout == NULL &&
+            runs_here(cmd)) {
+        pipestatus_kept = 0;
+        if (!pipeline->timed && trace_file == NULL) {
+            last_status = cmd->builtin != NULL || (cmd->body == NULL && cmd->function == NULL) ? run_builtin(cmd) : run_compound(arena, cmd);
+            if (!pipestatus_kept) {
+                set_pipestatus_single(last_status);
+            }
+            return;
+        }
+
+        // it runs in the shell, so the shell's own usage (and that of children the builtin
+        // reaped, for parallel) is what it cost
+        shell_usage(before);
+        start_ns = now_ns();
+        last_status = cmd->builtin != NULL || (cmd->body == NULL && cmd->function == NULL) ? run_builtin(cmd) : run_compound(arena, cmd);
+        start_ns = now_ns() - start_ns;
+        shell_usage(after);
+        if (!pipestatus_kept) {
+            set_pipestatus_single(last_status);
+        }
+        if (pipeline->timed) {
+            print_times(pipeline->timed, start_ns, usage_ns(after, 0) - usage_ns(before, 0),
+                    usage_ns(after, 1) - usage_ns(before, 1));
+        }
+        if (trace_file != NULL) {
+            trace_builtin(cmd, start_ns, before, after, last_status);
+        }
+        return;
+    }
+
+    // every stage gets a slot, even the ones that fail to start, so PIPESTATUS lines up with the stages
+    job = new_job(pipeline->num_commands);
+    if (pipeline->dropped != NULL) {
+        if ((job->dropped = malloc(pipeline->num_stages)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(job->dropped, pipeline->dropped, pipeline->num_stages);
+        job->num_stages = pipeline->num_stages;
+    }
+    job->background = pipeline->background;
+    job->command = format_pipeline(pipeline);
+    job->timed = pipeline->timed;
+    job->parse_ns = line_parse_ns;
+    line_parse_ns = 0;
+    proc = job->procs;
+    if (pipeline->limits != NULL) {
+        job->cgroup = limits.cgroup;
+        spawn_limits = &limits;
+    }
+    if (pipeline->timeout != NULL && timeout.deadline_ns > 0) {
+        job->deadline_ns = job->start_ns + timeout.deadline_ns;
+        job->kill_after_ns = timeout.kill_after_ns;
+        job->timeout_signal = timeout.timeout_signal;
+    }
+
+    // with set -o log, the job's output goes through pipes of the shell, which passes it on to
+    // the ring as well as to where it was going. not inside $(...), that output is not the job's
+    if (log_ring != NULL && current_capture == NULL) {
+        if (pipe2(log_out, O_CLOEXEC) < 0 || pipe2(log_err, O_CLOEXEC) < 0) {
+            perror("log: pipe");
+            if (log_out[0] >= 0) {
+                close(log_out[0]);
+                close(log_out[1]);
+                log_out[0] = log_out[1] = -1;
+            }
+        }
+        else {
+            fcntl(log_out[0], F_SETFL, O_NONBLOCK);
+            fcntl(log_err[0], F_SETFL, O_NONBLOCK);
+            job->log_fds[0] = log_out[0];
+            job->log_fds[1] = log_err[0];
+            spawn_stderr_fd = log_err[1];
+        }
+    }
+
+    // by default, these are the standard file descriptors. without job control, background
+    // jobs must not compete with the shell for the terminal, so they read from /dev/null. with
+    // it, they are stopped by SIGTTIN when they try
+    read_fd = 0;
+    if (pipeline->background && !job_control && (read_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+        perror("/dev/null");
+        read_fd = 0;
+    }
+
+    // anything a builtin left in the stdout buffer has to come out before the children write
+    fflush(stdout);
+
+    // with job control, the job's first stage leads a new process group the others join, and a
+    // foreground job gets the terminal
+    spawn_pgid = job_control ? 0 : -1;
+    spawn_foreground = !pipeline->background;
+
+    // with set -o pin, the stages go to neighbouring CPUs, so the data passed between them stays
+    // in the caches of one node
+    pin_start = pin_policy != PIN_OFF ? pin_reserve(pipeline->num_commands) : -1;
+
+    for (cmd = pipeline->commands; cmd != NULL; cmd = cmd->next) {
+        write_fd = cmd->next == NULL && log_out[1] >= 0 ? log_out[1] : 1;
+        next_read_fd = -1;
+
+        // if we need to pipe into the next command
+        if (cmd->next != NULL) {
+            // make the pipe. the stages we cannot start are left marked as failed
+            if (pipe(fds) < 0) {
+                perror("pipe");
+                break;
+            }
+
+            // the read end belongs to the next command, so the child we are about to start has to close it
+            next_read_fd = fds[0];
+            write_fd = fds[1];
+
+            // resizing can still fail when the user is over the kernel's pipe memory quota, the
+            // pipe then just keeps its default size
+            if (pipe_size_effective > 0) {
+                fcntl(write_fd, F_SETPIPE_SZ, (int)pipe_size_effective);
+            }
+        }
+
+        // start the child process, with fork or posix_spawn depending on spawn_mode.
+        // a command that is not on PATH is reported here without starting anything
+        proc->start_ns = now_ns();
+        if (cmd->argc > 0) {
+            snprintf(proc->name, sizeof(proc->name), "%s", cmd->argv[0]);
+        }
+        cmd->path = NULL;
+        cmd->function = cmd->argc > 0 ? find_function(cmd->argv[0]) : NULL;
+        cmd->builtin = cmd->argc > 0 && cmd->function == NULL ? find_builtin(cmd->argv) : NULL;
+        spawn_cpu = pin_start >= 0 ? pin_cpu(pin_start, proc - job->procs) : -1;
+        if (cmd->argc > 0 && cmd->builtin == NULL && cmd->function == NULL && (cmd->path = lookup_command_path(cmd)) == NULL) {
+            shell_error("%s: command not found", cmd->argv[0]);
+            proc->status = W_EXITCODE(127, 0);
+        }
+        else if ((proc->pid = spawn_command(cmd, read_fd, write_fd, next_read_fd)) > 0) {
+            proc->state = PROC_RUNNING;
+            proc->feeds_pipe = cmd->next != NULL && output_piped(cmd);
+            proc->cpu = spawn_cpu;
+            if (spawn_pgid == 0) {
+                spawn_pgid = job->pgid = proc->pid;
+            }
+        }
+        else {
+            proc->status = W_EXITCODE(126, 0);
+        }
+        proc->spawn_ns = now_ns() - proc->start_ns;
+        proc->exec_ns = last_exec_ns;
+        proc++;
+
+        // the pipe ends have been passed to the child, so the parent can close them
+        if (write_fd != 1 && close(write_fd) < 0) {
+            perror("close");
+        }
+        if (read_fd != 0 && close(read_fd) < 0) {
+            perror("close");
+        }
+        read_fd = next_read_fd;
+    }
+
+    // a pipe() failure leaves the read end of the last pipe open, and the last stage's log pipe
+    if (read_fd > 0) {
+        close(read_fd);
+    }
+    if (cmd != NULL && log_out[1] >= 0) {
+        close(log_out[1]);
+    }
+    spawn_pgid = spawn_cpu = -1;
+    spawn_limits = NULL;
+    if (spawn_stderr_fd >= 0) {
+        close(spawn_stderr_fd);
+        spawn_stderr_fd = -1;
+    }
+    if (pipeline->limits != NULL && limits.cgroup_fd >= 0) {
+        close(limits.cgroup_fd);
+    }
+    job->spawn_ns = now_ns() - job->start_ns;
+    if (job->deadline_ns > 0) {
+        arm_timer();
+    }
+
+    // the last stage may be gone already, before its job was even complete
+    if (job->procs[job->num_procs - 1].state == PROC_DONE) {
+        tear_down(job);
+    }
+
+    if (job->background) {
+        last_bg_pid = job->procs[job->num_procs - 1].pid;
+        if (current_input->interactive) {
+            fprintf(stderr, "[%d] %d\n", job->id, (int)last_bg_pid);
+        }
+        last_status = 0;
+        return;
+    }
+
+    // wait for our children to finish before we print another shell prompt.
+    // the status of the pipeline is the status of its last command
+    wait_for_job(job);
+    finish_foreground(job);
+}
+
+int
+runs_here(struct command *cmd)
+{
+    /*
+     * helper function to decide whether a lone foreground command can run in the shell process,
+     * looking up its function or builtin on the way. inside $(...) only builtins that leave the
+     * shell as it was can, anything else gets a child, like in a subshell. with job control a
+     * lone cat gets a child too, it may run for ever and the shell itself cannot be stopped
+     *
+     * returns:
+     *  1 if it runs here
+     */
+
+    cmd->function = cmd->argc > 0 ? find_function(cmd->argv[0]) : NULL;
+    cmd->builtin = cmd->argc > 0 && cmd->function == NULL ? find_builtin(cmd->argv) : NULL;
+    if (cmd->body != NULL || cmd->function != NULL) {
+        return current_capture == NULL && (cmd->body == NULL || cmd->body->type != NODE_SUBSHELL);
+    }
+    if (cmd->builtin != NULL && cmd->builtin->func == builtin_cat && job_control && current_capture == NULL) {
+        return 0;
+    }
+    return (cmd->argc == 0 || cmd->builtin != NULL) && (current_capture == NULL || (cmd->argc > 0 && !cmd->builtin->state));
+}
+
+int
+run_compound(struct arena *arena, struct command *cmd)
+{
+    /*
+     * function to run a compound command or a function call inside the shell process. like for
+     * builtins, its redirections are applied to the shell's own descriptors and undone afterwards
+     *
+     * args:
+     *  struct arena *arena: arena of the current line, which expanded words are allocated from
+     *  struct command *cmd: the command, with cmd->body or cmd->function set
+     *
+     * returns:
+     *  its status, 1 if a redirection failed
+     */
+
+    int saved_fds[SAVED_FDS];
+    char **saved;
+
+    // output buffered so far belongs to the old stdout
+    fflush(stdout);
+
+    for (int fd = 0; fd < SAVED_FDS; fd++) {
+        saved_fds[fd] = -1;
+    }
+    if (redirect_here(cmd->redirs, saved_fds) < 0) {
+        restore_fds(saved_fds);
+        return 1;
+    }
+
+    // assignments in front of a function call last as long as the call
+    if (cmd->function != NULL) {
+        saved = save_assigns(cmd->assigns);
+        last_status = call_function(arena, cmd);
+        restore_assigns(cmd->assigns, saved);
+    }
+    else {
+        execute_node(arena, cmd->body);
+    }
+
+    fflush(stdout);
+    restore_fds(saved_fds);
+    return last_status;
+}
+
+pid_t
+spawn_command(struct command *cmd, int read_fd, int write_fd, int unused_fd)
+{
+    /*
+     * helper function to start a single pipe-separated entry with stdin replaced by read_fd
+     * and stdout replaced by write_fd
+     *
+     * args:
+     *  struct command *cmd: the parsed entry
+     *  int read_fd: file descriptor reflecting where data could be read in from to this process (stdin or from a pipe)
+     *  int write_fd: file descriptor reflecting where data could be written to in this process (stdout or to a pipe)
+     *  int unused_fd: read end of the pipe this entry writes to, which the child must not keep open (or -1)
+     *
+     * returns:
+     *  pid of the child, or -1 if it could not be started
+     */
+
+    pid_t pid;
+
+    last_exec_ns = -1;
+
+    // builtins, functions, compound commands and entries with only redirections have nothing to
+    // exec, so they need a forked child. so do limited ones, posix_spawn can neither set resource
+    // limits nor start the child in a cgroup
+    if (spawn_mode == SPAWN_POSIX && cmd->argc > 0 && cmd->builtin == NULL && cmd->function == NULL && cmd->body == NULL &&
+            spawn_limits == NULL) {
+        pid = posix_spawn_command(cmd, read_fd, write_fd, unused_fd);
+    }
+    else {
+        pid = fork_command(cmd, read_fd, write_fd, unused_fd);
+    }
+
+    // the child does the same, so it is in its group whichever of the two gets there first. it
+    // may have exec'd already, then this fails and does not need to work
+    if (pid > 0 && spawn_pgid >= 0) {
+        setpgid(pid, spawn_pgid == 0 ? pid : spawn_pgid);
+        if (spawn_pgid == 0 && spawn_foreground) {
+            tcsetpgrp(tty_fd, pid);
+        }
+    }
+    return pid;
+}
+
+int
+output_piped(struct command *cmd)
+{
+    /*
+     * helper function to tell whether a pipeline entry still writes into the pipe to the next
+     * entry after its redirections, on stdout or any descriptor copied from it
+     */
+
+    int piped[SAVED_FDS] = {0, 1};
+    int source;
+
+    for (struct redir *redir = cmd->redirs; redir != NULL; redir = redir->next) {
+        if (redir->fd < 0 || redir->fd >= SAVED_FDS) {
+            continue;
+        }
+        if (redir->type == REDIR_DUP && (source = redir_source(redir->path)) >= 0) {
+            piped[redir->fd] = source < SAVED_FDS && piped[source];
+        }
+        else {
+            piped[redir->fd] = 0;
+        }
+    }
+    for (int fd = 0; fd < SAVED_FDS; fd++) {
+        if (piped[fd]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+pid_t
+fork_command(struct command *cmd, int read_fd, int write_fd, int unused_fd)
+{
+    /*
+     * helper function to start an entry by forking and doing the descriptor setup in the child.
+     * args and return value are the same as spawn_command
+     */
+
+    pid_t child_pid;
+    int exec_fds[2] = {-1, -1}, placed = -1;
+    long long start_ns = 0;
+    char c;
+
+    // while tracing, a close-on-exec pipe tells us when the child got to exec: the read sees end
+    // of file once the exec (or the child) is through. builtins never exec, so they are not timed
+    if (trace_file != NULL && cmd->argc > 0 && cmd->builtin == NULL && cmd->function == NULL && pipe2(exec_fds, O_CLOEXEC) == 0) {
+        start_ns = now_ns();
+    }
+
+    // fork into child process. a limited stage starts right inside the job's cgroup, so not even
+    // its first page is charged elsewhere. on failure the stage is just marked as failed in the job
+    child_pid = -1;
+    errno = ENOSYS;
+#ifdef CLONE_INTO_CGROUP
+    if (spawn_limits != NULL && spawn_limits->cgroup_fd >= 0) {
+        struct clone_args args;
+
+        memset(&args, 0, sizeof(args));
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = spawn_limits->cgroup_fd;
+        placed = (child_pid = syscall(SYS_clone3, &args, sizeof(args))) >= 0;
+    }
+#endif
+    // kernels before 5.7 do not know it, the child then moves itself before it execs
+    if (child_pid < 0 && (errno == ENOSYS || errno == E2BIG)) {
+        placed = -1;
+        child_pid = fork();
+    }
+    if (child_pid < 0) {
+        perror(placed < 0 ? "fork" : "clone3");
+        if (exec_fds[0] >= 0) {
+            close(exec_fds[0]);
+            close(exec_fds[1]);
+        }
+        return -1;
+    }
+
+    // if we are in the child
+    if (child_pid == 0) {
+        // the child's stdout already is the capture pipe, there is nothing for it to drain
+        current_capture = NULL;
+
+        // the group (and terminal) is taken care of here as well as in the shell, see
+        // spawn_command. job control belongs to the interactive shell, not to its children, and
+        // while SIGTTOU is still ignored tcsetpgrp works from a background group
+        if (spawn_pgid >= 0) {
+            setpgid(0, spawn_pgid);
+            if (spawn_pgid == 0 && spawn_foreground) {
+                tcsetpgrp(tty_fd, getpid());
+            }
+        }
+        if (spawn_limits != NULL && spawn_limits->cgroup_fd >= 0 && placed < 0) {
+            int procs_fd = openat(spawn_limits->cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+
+            if (procs_fd < 0 || write(procs_fd, "0\n", 2) != 2) {
+                perror("limit: cgroup.procs");
+                exit(126);
+            }
+            close(procs_fd);
+        }
+
+        job_control = 0;
+        spawn_pgid = -1;
+        interrupted = 0;
+
+        // the timeouts of the shell's jobs are the shell's to enforce. a subshell that starts
+        // one of its own makes a timer of its own
+        if (timer_fd >= 0) {
+            close(timer_fd);
+            timer_fd = -1;
+        }
+        // likewise their output, this child's own output already goes into its job's pipes
+        for (int id = 0; id < jobs_cap; id++) {
+            if (jobs[id] != NULL) {
+                jobs[id]->deadline_ns = 0;
+                for (int stream = 0; stream < 2; stream++) {
+                    if (jobs[id]->log_fds[stream] >= 0) {
+                        close(jobs[id]->log_fds[stream]);
+                        jobs[id]->log_fds[stream] = -1;
+                    }
+                }
+            }
+        }
+        if (log_ring != NULL) {
+            munmap(log_ring, LOG_HEADER_SIZE);
+            close(log_fd);
+            close(log_pipe[0]);
+            close(log_pipe[1]);
+            log_ring = NULL;
+            log_fd = log_pipe[0] = log_pipe[1] = -1;
+        }
+        if (spawn_cpu >= 0) {
+            pin_to(0, spawn_cpu);
+            spawn_cpu = -1;
+        }
+        for (int sig = 1; sig < NSIG; sig++) {
+            if (sigismember(&child_sigdefault, sig)) {
+                signal(sig, SIG_DFL);
+            }
+        }
+
+        // the exec'd program gets the signal state the shell itself started with. a builtin
+        // keeps SIGCHLD blocked, since it may start and reap children of its own (parallel), and
+        // so do functions and compound commands
+        if (cmd->builtin == NULL && cmd->function == NULL && cmd->body == NULL) {
+            sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+        }
+
+        if (unused_fd >= 0) {
+            close(unused_fd);
+        }
+        if (exec_fds[0] >= 0) {
+            close(exec_fds[0]);
+        }
+        process_args(cmd, read_fd, write_fd);
+    }
+
+    if (exec_fds[0] >= 0) {
+        close(exec_fds[1]);
+        while (read(exec_fds[0], &c, 1) < 0 && errno == EINTR);
+        close(exec_fds[0]);
+        last_exec_ns = now_ns() - start_ns;
+    }
+    return child_pid;
+}
+
+pid_t
+posix_spawn_command(struct command *cmd, int read_fd, int write_fd, int unused_fd)
+{
+    /*
+     * helper function to start an entry with posix_spawn. the dup2/open work that process_args
+     * does in a forked child is expressed as file actions instead, so the parent's page tables
+     * never have to be copied. args and return value are the same as spawn_command
+     */
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    struct redir *redir;
+    pid_t child_pid;
+    char **sh_argv, **envp;
+    int err, source;
+
+    if ((err = posix_spawn_file_actions_init(&actions)) != 0) {
+        fprintf(stderr, "posix_spawn_file_actions_init: %s\n", strerror(err));
+        return -1;
+    }
+
+    // SIGCHLD is blocked in the shell, the program must start with the mask the shell started
+    // with, and with default actions for the signals the shell ignores or catches
+    if ((err = posix_spawnattr_init(&attr)) != 0) {
+        fprintf(stderr, "posix_spawnattr_init: %s\n", strerror(err));
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+    posix_spawnattr_setsigmask(&attr, &child_sigmask);
+    posix_spawnattr_setsigdefault(&attr, &child_sigdefault);
+    if (spawn_pgid >= 0) {
+        posix_spawnattr_setpgroup(&attr, spawn_pgid);
+    }
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | (spawn_pgid >= 0 ? POSIX_SPAWN_SETPGROUP : 0));
+
+    // a foreground job's first stage takes the terminal itself, before it could read from it.
+    // all signals are blocked while the child is set up, so SIGTTOU does not get in the way
+    if (spawn_pgid == 0 && spawn_foreground) {
+        err = posix_spawn_file_actions_addtcsetpgrp_np(&actions, tty_fd);
+    }
+
+    // same order as process_args: pipes first, then file redirections on top of them
+    if (err == 0 && unused_fd >= 0) {
+        err = posix_spawn_file_actions_addclose(&actions, unused_fd);
+    }
+    if (err == 0 && spawn_stderr_fd >= 0) {
+        err = posix_spawn_file_actions_adddup2(&actions, spawn_stderr_fd, 2);
+    }
+    if (err == 0 && write_fd != 1) {
+        if ((err = posix_spawn_file_actions_adddup2(&actions, write_fd, 1)) == 0) {
+            err = posix_spawn_file_actions_addclose(&actions, write_fd);
+        }
+    }
+    if (err == 0 && read_fd != 0) {
+        if ((err = posix_spawn_file_actions_adddup2(&actions, read_fd, 0)) == 0) {
+            err = posix_spawn_file_actions_addclose(&actions, read_fd);
+        }
+    }
+    for (redir = cmd->redirs; err == 0 && redir != NULL; redir = redir->next) {
+        if (redir->type == REDIR_DUP && strcmp(redir->path, "-") == 0) {
+            err = posix_spawn_file_actions_addclose(&actions, redir->fd);
+        }
+        else if (redir->type == REDIR_DUP) {
+            err = (source = redir_source(redir->path)) < 0 ? EBADF :
+                posix_spawn_file_actions_adddup2(&actions, source, redir->fd);
+        }
+        else if (redir->type < REDIR_HEREDOC) {
+            err = posix_spawn_file_actions_addopen(&actions, redir->fd, redir->path, redir_flags(redir->type), 0644);
+        }
+        // here-documents are filled in by the shell, the child only inherits the result
+        else if ((redir->source = here_fd(redir)) < 0) {
+            err = errno;
+        }
+        else {
+            err = posix_spawn_file_actions_adddup2(&actions, redir->source, redir->fd);
+        }
+    }
+
+    // there is no spawn attribute for the affinity, but the child inherits the shell's. so the
+    // shell moves to the stage's CPU for as long as the spawn takes, and the program starts
+    // (and first touches its memory) right there
+    if (err == 0 && spawn_cpu >= 0) {
+        pin_to(0, spawn_cpu);
+    }
+
+    envp = command_envp(cmd);
+    if (err == 0) {
+        err = posix_spawn(&child_pid, cmd->path, &actions, &attr, cmd->argv, envp);
+
+        // the hashed file may have been removed since we looked it up, so search PATH once more
+        if (err == ENOENT && strchr(cmd->argv[0], '/') == NULL) {
+            path_table_forget(cmd->argv[0]);
+            if ((cmd->path = lookup_command_path(cmd)) != NULL) {
+                err = posix_spawn(&child_pid, cmd->path, &actions, &attr, cmd->argv, envp);
+            }
+        }
+        // like execvp, run files without a #! line with /bin/sh
+        if (err == ENOEXEC) {
+            sh_argv = sh_fallback_argv(cmd);
+            err = posix_spawn(&child_pid, sh_argv[0], &actions, &attr, sh_argv, envp);
+            free(sh_argv);
+        }
+    }
+    if (spawn_cpu >= 0) {
+        sched_setaffinity(0, sizeof(pin_allowed), &pin_allowed);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    for (redir = cmd->redirs; redir != NULL; redir = redir->next) {
+        if (redir->source >= 0) {
+            close(redir->source);
+            redir->source = -1;
+        }
+    }
+    if (envp != env_cache) {
+        free(envp);
+    }
+
+    if (err != 0) {
+        // failed file actions and failed exec both come back here, the child is already gone
+        fprintf(stderr, "%s: %s\n", cmd->argv[0], strerror(err));
+        return -1;
+    }
+    return child_pid;
+}
+
+void
+process_args(struct command *cmd, int read_fd, int write_fd)
+{
+    /*
+     * helperfunction called within child process to set up the descriptors of a single entry to
+     * our shell (what would be separated by pipes if there were any) and exec it.
+     *
+     * args:
+     *  struct command *cmd: the entry, already parsed by parse_line in the parent
+     *  int read_fd: file descriptor reflecting where data could be read in from to this process (stdin or from a pipe)
+     *  int write_fd: file descriptor reflecting where data could be written to in this process (stdout or to a pipe)
+     */
+
+    struct redir *redir;
+    struct rlimit limit;
+
+    // the resource limits of a limit prefix, for this process and whatever it starts
+    for (int i = 0; spawn_limits != NULL && i < spawn_limits->num_rlimits; i++) {
+        limit.rlim_cur = limit.rlim_max = spawn_limits->values[i];
+        if (setrlimit(spawn_limits->resources[i], &limit) < 0) {
+            shell_error("limit: %s: %s", spawn_limits->names[i], strerror(errno));
+            exit(126);
+        }
+    }
+    spawn_limits = NULL;
+
+    // stderr of a job whose output is logged
+    if (spawn_stderr_fd >= 0) {
+        if (dup2(spawn_stderr_fd, 2) < 0) {
+            perror("dup2");
+            exit(2);
+        }
+        close(spawn_stderr_fd);
+        spawn_stderr_fd = -1;
+    }
+
+    // replace stdout with our pipe (potentially)
+    // could also just be 1
+    if (write_fd != 1) {
+        if (dup2(write_fd, 1) < 0) {
+            perror("dup2");
+            exit(2);
+        }
+        if (close(write_fd) < 0) {
+            perror("close");
+            exit(1);
+        }
+    }
+
+    // replace stdin with our pipe (potentially)
+    // could also just be 0
+    if (read_fd != 0) {
+        if (dup2(read_fd, 0) < 0) {
+            perror("dup2");
+            exit(2);
+        }
+        if (close(read_fd) < 0) {
+            perror("close");
+            exit(1);
+        }
+    }
+
+    // redirections, applied left to right so 2>&1 sees what stdout is at that point
+    for (redir = cmd->redirs; redir != NULL; redir = redir->next) {
+        if (apply_redir(redir) < 0) {
+            exit(1);
+        }
+    }
+
+    // a function or compound command in a pipeline runs in this child, like a subshell
+    if (cmd->function != NULL || cmd->body != NULL) {
+        struct arena arena = {NULL, NULL};
+
+        for (struct assign *assign = cmd->assigns; assign != NULL; assign = assign->next) {
+            set_var(assign->name, assign->value, VAR_EXPORTED);
+        }
+        if (cmd->function != NULL) {
+            call_function(&arena, cmd);
+        }
+        else {
+            execute_node(&arena, cmd->body);
+        }
+        exit(last_status);
+    }
+
+    // nothing to run, the redirections were all we had to do
+    if (cmd->argc == 0) {
+        exit(0);
+    }
+
+    // a builtin in a pipeline runs in this child, exit flushes whatever it printed
+    if (cmd->builtin != NULL) {
+        for (struct assign *assign = cmd->assigns; assign != NULL; assign = assign->next) {
+            set_var(assign->name, assign->value, VAR_EXPORTED);
+        }
+        exit(cmd->builtin->func(cmd->argv));
+    }
+
+    // the parent already resolved the path, so there is only a single exec to try
+    execve(cmd->path, cmd->argv, command_envp(cmd));
+    if (errno == ENOEXEC) {
+        // like execvp, run files without a #! line with /bin/sh
+        char **sh_argv = sh_fallback_argv(cmd);
+        execve(sh_argv[0], sh_argv, command_envp(cmd));
+    }
+    perror(cmd->argv[0]);
+    exit(3);
+}
+
+int
+apply_redir(struct redir *redir)
+{
+    /*
+     * helper function to apply a single redirection to the current process. the descriptor it
+     * opens is moved onto the redirected one, nothing else is left open
+     *
+     * returns:
+     *  0 on success, -1 on failure (message is printed)
+     */
+
+    int fd;
+
+    if (redir->type == REDIR_DUP) {
+        if (strcmp(redir->path, "-") == 0) {
+            close(redir->fd);
+            return 0;
+        }
+        if ((fd = redir_source(redir->path)) < 0 || fcntl(fd, F_GETFD) < 0) {
+            shell_error("%s: bad file descriptor", redir->path);
+            return -1;
+        }
+        if (fd != redir->fd && dup2(fd, redir->fd) < 0) {
+            perror("dup2");
+            return -1;
+        }
+        return 0;
+    }
+
+    if ((fd = open_redir(redir)) < 0) {
+        shell_error("%s: %s", redir->type >= REDIR_HEREDOC ? "here-document" : redir->path, strerror(errno));
+        return -1;
+    }
+    // the redirected descriptor was closed, so open reused it. it must survive exec all the same
+    if (fd == redir->fd) {
+        return fcntl(fd, F_SETFD, 0);
+    }
+    if (dup2(fd, redir->fd) < 0) {
+        perror("dup2");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+int
+redir_source(char *word)
+{
+    /*
+     * helper function to parse the m of n>&m
+     *
+     * returns:
+     *  the descriptor, -1 if word is not a number
+     */
+
+    char *end;
+    long fd;
+
+    fd = strtol(word, &end, 10);
+    if (*word < '0' || *word > '9' || *end != 0 || fd > INT_MAX) {
+        return -1;
+    }
+    return fd;
+}
+
+int
+open_redir(struct redir *redir)
+{
+    /*
+     * helper function to open what a redirection reads from or writes to
+     *
+     * returns:
+     *  close-on-exec file descriptor, -1 on failure with errno set
+     */
+
+    if (redir->type >= REDIR_HEREDOC) {
+        return here_fd(redir);
+    }
+    return open(redir->path, redir_flags(redir->type) | O_CLOEXEC, 0644);
+}
+
+int
+here_fd(struct redir *redir)
+{
+    /*
+     * helper function to get a file descriptor to read a here-document or here-string from,
+     * without a temporary file. text that fits in a pipe atomically is written into one, so no
+     * helper has to stay around to feed it. anything bigger goes into a memfd, which behaves
+     * like a regular file but only ever lives in memory
+     *
+     * returns:
+     *  close-on-exec file descriptor positioned at the start of the text, -1 on failure
+     */
+
+    char *text = redir->type == REDIR_HERESTRING ? redir->path : redir->body;
+    size_t len = strlen(text), total = len + (redir->type == REDIR_HERESTRING);
+    struct iovec iov[2] = {{text, len}, {"\n", total - len}};
+    int fds[2], saved_errno;
+    ssize_t written;
+
+    if (total <= PIPE_BUF) {
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            return -1;
+        }
+        // the pipe is empty and the text fits, so this cannot block or write short
+        if (writev(fds[1], iov, 2) < 0) {
+            saved_errno = errno;
+            close(fds[0]);
+            close(fds[1]);
+            errno = saved_errno;
+            return -1;
+        }
+        close(fds[1]);
+        return fds[0];
+    }
+
+    if ((fds[0] = memfd_create("mysh-heredoc", MFD_CLOEXEC)) < 0) {
+        return -1;
+    }
+    while (iov[0].iov_len + iov[1].iov_len > 0) {
+        if ((written = writev(fds[0], iov, 2)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            saved_errno = errno;
+            close(fds[0]);
+            errno = saved_errno;
+            return -1;
+        }
+        for (int i = 0; i < 2 && written > 0; i++) {
+            size_t step = (size_t)written < iov[i].iov_len ? (size_t)written : iov[i].iov_len;
+            iov[i].iov_base = (char *)iov[i].iov_base + step;
+            iov[i].iov_len -= step;
+            written -= step;
+        }
+    }
+    lseek(fds[0], 0, SEEK_SET);
+    return fds[0];
+}
+
+int
+redir_flags(int type)
+{
+    /*
+     * helper function to get the open(2) flags for a redirection kind
+     */
+
+    switch (type) {
+    case REDIR_IN:
+        return O_RDONLY;
+    case REDIR_OUT:
+        return O_TRUNC | O_CREAT | O_WRONLY;
+    case REDIR_RDWR:
+        return O_CREAT | O_RDWR;
+    default:
+        return O_APPEND | O_CREAT | O_WRONLY;
+    }
+}
+
+void
+init_signals()
+{
+    /*
+     * helper function to block SIGCHLD and open the signalfd it is read from instead
+     */
+
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+
+    // an ignored SIGPIPE is inherited through exec, and would leave `yes | head` spinning on EPIPE
+    // forever. children always get it back as it should be
+    sigemptyset(&child_sigdefault);
+    sigaddset(&child_sigdefault, SIGPIPE);
+    shell_pgid = getpgrp();
+
+    if (sigprocmask(SIG_BLOCK, &sigchld_mask, &child_sigmask) < 0) {
+        perror("sigprocmask");
+        exit(1);
+    }
+    if ((sigchld_fd = signalfd(-1, &sigchld_mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        perror("signalfd");
+        exit(1);
+    }
+}
+
+int
+load_topology()
+{
+    /*
+     * helper function to list the CPUs the shell may run on for set -o pin, grouped by NUMA
+     * node in the order /sys/devices/system/node has them. without NUMA support in the kernel,
+     * they all make up one node
+     *
+     * returns:
+     *  0 on success, -1 if there is nothing to pin to (message is printed)
+     */
+
+    cpu_set_t nodes, node_cpus;
+    char path[64];
+    int numa;
+
+    if (sched_getaffinity(0, sizeof(pin_allowed), &pin_allowed) < 0) {
+        shell_error("pin: sched_getaffinity: %s", strerror(errno));
+        return -1;
+    }
+    if (!(numa = read_cpulist("/sys/devices/system/node/online", &nodes) == 0)) {
+        CPU_ZERO(&nodes);
+        CPU_SET(0, &nodes);
+    }
+    if ((pin_cpus = malloc(CPU_COUNT(&pin_allowed) * sizeof(int))) == NULL ||
+            (pin_nodes = malloc((CPU_COUNT(&nodes) + 1) * sizeof(int))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    num_pin_cpus = num_pin_nodes = 0;
+    for (int node = 0; node < CPU_SETSIZE; node++) {
+        if (!CPU_ISSET(node, &nodes)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (!numa || read_cpulist(path, &node_cpus) < 0) {
+            node_cpus = pin_allowed;
+        }
+
+        // nodes without any CPU we may use (memory-only ones, or outside our cpuset) are left out
+        pin_nodes[num_pin_nodes] = num_pin_cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &node_cpus) && CPU_ISSET(cpu, &pin_allowed)) {
+                pin_cpus[num_pin_cpus++] = cpu;
+                CPU_CLR(cpu, &pin_allowed);
+            }
+        }
+        if (pin_nodes[num_pin_nodes] < num_pin_cpus) {
+            num_pin_nodes++;
+        }
+    }
+    pin_nodes[num_pin_nodes] = num_pin_cpus;
+
+    // pin_allowed was used up on the way
+    sched_getaffinity(0, sizeof(pin_allowed), &pin_allowed);
+    if (num_pin_cpus == 0) {
+        shell_error("pin: no CPUs to pin to");
+        free(pin_cpus);
+        free(pin_nodes);
+        pin_cpus = pin_nodes = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int
+read_cpulist(char *path, cpu_set_t *set)
+{
+    /*
+     * helper function to read a list of CPUs (or nodes) in the kernel's format, like 0-3,8,10-11
+     *
+     * returns:
+     *  0 on success, -1 if the file could not be read
+     */
+
+    char buf[4096], *p, *end;
+    long first, last;
+
+    if (read_text(path, buf, sizeof(buf)) < 0) {
+        return -1;
+    }
+
+    CPU_ZERO(set);
+    for (p = buf; *p >= '0' && *p <= '9'; p = *end == ',' ? end + 1 : end) {
+        first = last = strtol(p, &end, 10);
+        if (*end == '-') {
+            last = strtol(end + 1, &end, 10);
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, set);
+        }
+    }
+    return 0;
+}
+
+int
+pin_node(int index)
+{
+    /*
+     * helper function to find the node an index in pin_cpus belongs to
+     */
+
+    int node = 0;
+
+    while (index >= pin_nodes[node + 1]) {
+        node++;
+    }
+    return node;
+}
+
+int
+pin_reserve(int count)
+{
+    /*
+     * function to pick the CPUs for a job of count stages under set -o pin: the next count
+     * CPUs after the last job's, moving on to the next node when they would not fit in this
+     * one. a job bigger than its node wraps around inside it
+     *
+     * returns:
+     *  index in pin_cpus of the first stage's CPU, for pin_cpu
+     */
+
+    int start = pin_cursor, node = pin_node(pin_cursor);
+
+    if (start + count > pin_nodes[node + 1] && count <= pin_nodes[node + 1] - pin_nodes[node]) {
+        start = pin_nodes[node + 1] % num_pin_cpus;
+        node = pin_node(start);
+    }
+    pin_cursor = start + count < pin_nodes[node + 1] ? start + count : pin_nodes[node + 1] % num_pin_cpus;
+    return start;
+}
+
+int
+pin_cpu(int start, int stage)
+{
+    /*
+     * helper function to get the CPU of one stage of a job placed by pin_reserve
+     */
+
+    int node = pin_node(start), first = pin_nodes[node], size = pin_nodes[node + 1] - first;
+
+    return pin_cpus[first + (start - first + stage) % size];
+}
+
+int
+pin_round_robin(int instance)
+{
+    /*
+     * helper function to get the CPU of a parallel instance under set -o pin=rr: instances go to
+     * the nodes in turn, so a fan-out uses the memory bandwidth of all of them, and to the CPUs
+     * of each node in order
+     */
+
+    int node = instance % num_pin_nodes, first = pin_nodes[node], size = pin_nodes[node + 1] - first;
+
+    return pin_cpus[first + (instance / num_pin_nodes) % size];
+}
+
+int
+pin_to(pid_t pid, int cpu)
+{
+    /*
+     * helper function to restrict a process (0 for the shell itself) to a single CPU
+     *
+     * returns:
+     *  what sched_setaffinity returned
+     */
+
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(pid, sizeof(set), &set);
+}
+
+int
+prepare_limits(struct arena *arena, struct command *words, struct limits *limits)
+{
+    /*
+     * function to work out the limits of a limit prefix right before its pipeline runs, and to
+     * make the job's cgroup when it needs one. the words are name=value:
+     *  mem=SIZE     memory.max of the job's cgroup, shared by all stages. without cgroup v2 it
+     *               becomes RLIMIT_AS of every stage instead
+     *  cpu=N        cpu.max of the job's cgroup, N CPUs worth of time (0.5, 2, ...)
+     *  pids=N       pids.max of the job's cgroup
+     *  as, stack, core, fsize=SIZE, files, nproc=N and time=SECONDS: the resource limit of that
+     *               name for every stage. any of them can be unlimited
+     *
+     * args:
+     *  struct arena *arena: arena of the current line, which expanded words are allocated from
+     *  struct command *words: the words, as the parser found them
+     *  struct limits *limits: filled in
+     *
+     * returns:
+     *  0 on success, -1 on an invalid limit or a cgroup that could not be made (message is printed)
+     */
+
+    static char *names[] = {"as", "stack", "core", "fsize", "files", "nproc", "time", NULL};
+    static int resources[] = {RLIMIT_AS, RLIMIT_STACK, RLIMIT_CORE, RLIMIT_FSIZE, RLIMIT_NOFILE, RLIMIT_NPROC, RLIMIT_CPU};
+    char name[16], *value, *end;
+    double cpus;
+    int i;
+
+    memset(limits, 0, sizeof(struct limits));
+    limits->memory_max = limits->cpu_quota = limits->pids_max = -1;
+    limits->cgroup_fd = -1;
+    if (words->expand && (words = expand_command(arena, words)) == NULL) {
+        return -1;
+    }
+
+    for (char **word = words->argv; *word != NULL; word++) {
+        // the words may belong to a function body, which runs again later
+        if ((value = strchr(*word, '=')) == NULL) {
+            shell_error("limit: %s: not name=value", *word);
+            return -1;
+        }
+        snprintf(name, sizeof(name), "%.*s", (int)(value++ - *word), *word);
+
+        if (strcmp(name, "mem") == 0) {
+            if ((limits->memory_max = limit_value(value, 1)) < 0) {
+                shell_error("limit: mem: %s: invalid size", value);
+                return -1;
+            }
+            continue;
+        }
+        if (strcmp(name, "cpu") == 0) {
+            cpus = strtod(value, &end);
+            if (*value == 0 || *end != 0 || !(cpus > 0) || cpus > 1e6) {
+                shell_error("limit: cpu: %s: invalid number of CPUs", value);
+                return -1;
+            }
+            limits->cpu_quota = cpus * CPU_PERIOD_US < 1000 ? 1000 : (long long)(cpus * CPU_PERIOD_US);
+            continue;
+        }
+        if (strcmp(name, "pids") == 0) {
+            if ((limits->pids_max = limit_value(value, 0)) < 0) {
+                shell_error("limit: pids: %s: invalid number", value);
+                return -1;
+            }
+            continue;
+        }
+
+        for (i = 0; names[i] != NULL && strcmp(names[i], name) != 0; i++);
+        if (names[i] == NULL) {
+            shell_error("limit: %s: unknown limit", name);
+            return -1;
+        }
+        if (limits->num_rlimits == LIMIT_MAX_RLIMITS) {
+            shell_error("limit: too many limits");
+            return -1;
+        }
+        limits->names[limits->num_rlimits] = names[i];
+        limits->resources[limits->num_rlimits] = resources[i];
+        if (strcmp(value, "unlimited") == 0) {
+            limits->values[limits->num_rlimits++] = RLIM_INFINITY;
+        }
+        else if ((limits->values[limits->num_rlimits++] = limit_value(value, i < 4)) == (rlim_t)-1) {
+            shell_error("limit: %s: %s: invalid value", name, value);
+            return -1;
+        }
+    }
+
+    if (limits->memory_max >= 0 || limits->cpu_quota >= 0 || limits->pids_max >= 0) {
+        return make_job_cgroup(limits);
+    }
+    return 0;
+}
+
+long long
+limit_value(char *value, int size)
+{
+    /*
+     * helper function to parse the value of a limit: a size like 512M when size is set, a plain
+     * number otherwise. max (as in cgroup files) stands for no limit
+     *
+     * returns:
+     *  the value, LLONG_MAX for max, -1 if it is invalid
+     */
+
+    char *end;
+    long long number;
+
+    if (strcmp(value, "max") == 0) {
+        return LLONG_MAX;
+    }
+    if (size) {
+        return parse_bytes(value);
+    }
+    errno = 0;
+    number = strtoll(value, &end, 10);
+    return *value == 0 || *end != 0 || errno != 0 || number < 0 ? -1 : number;
+}
+
+int
+make_job_cgroup(struct limits *limits)
+{
+    /*
+     * helper function to make a transient cgroup for a limited job and write its limits. the
+     * stages are started right inside it (see fork_command), and free_job removes it. when
+     * cgroup v2 cannot be used here, mem= falls back to RLIMIT_AS, the others are an error
+     *
+     * returns:
+     *  0 on success, -1 if the job cannot have the limits it asked for (message is printed)
+     */
+
+    static char *controllers[] = {"memory", "cpu", "pids"};
+    long long wanted[] = {limits->memory_max, limits->cpu_quota, limits->pids_max};
+    char subtree[256], path[2 * PATH_MAX + 64], value[64], missing[32] = "";
+
+    if (find_cgroup_root() == 0) {
+        snprintf(path, sizeof(path), "%s/cgroup.subtree_control", cgroup_root);
+    }
+    if (cgroup_root == NULL || read_text(path, subtree, sizeof(subtree)) < 0) {
+        strcpy(missing, "cgroup v2");
+    }
+    for (int i = 0; i < 3 && missing[0] == 0; i++) {
+        if (wanted[i] >= 0 && !has_controller(subtree, controllers[i])) {
+            snprintf(missing, sizeof(missing), "the %s controller", controllers[i]);
+        }
+    }
+
+    if (missing[0] != 0) {
+        if (limits->cpu_quota >= 0 || limits->pids_max >= 0 || limits->num_rlimits == LIMIT_MAX_RLIMITS) {
+            shell_error("limit: %s: needs %s, which is not available here", limits->cpu_quota >= 0 ? "cpu" :
+                    limits->pids_max >= 0 ? "pids" : "mem", missing);
+            return -1;
+        }
+        limits->names[limits->num_rlimits] = "mem";
+        limits->resources[limits->num_rlimits] = RLIMIT_AS;
+        limits->values[limits->num_rlimits++] = limits->memory_max == LLONG_MAX ? RLIM_INFINITY : limits->memory_max;
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s/mysh-%d.%lu", cgroup_root, (int)getpid(), ++cgroup_seq);
+    if (mkdir(path, 0755) < 0) {
+        shell_error("limit: %s: %s", path, strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < 3; i++) {
+        static char *files[] = {"memory.max", "cpu.max", "pids.max"};
+        char file[sizeof(path) + 16];
+
+        if (wanted[i] < 0) {
+            continue;
+        }
+        if (wanted[i] == LLONG_MAX) {
+            snprintf(value, sizeof(value), i == 1 ? "max %d" : "max", CPU_PERIOD_US);
+        }
+        else {
+            snprintf(value, sizeof(value), i == 1 ? "%lld %d" : "%lld", wanted[i], CPU_PERIOD_US);
+        }
+        snprintf(file, sizeof(file), "%s/%s", path, files[i]);
+        if (write_text(file, value) < 0) {
+            shell_error("limit: %s: %s", file, strerror(errno));
+            rmdir(path);
+            return -1;
+        }
+    }
+    if ((limits->cgroup_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || (limits->cgroup = strdup(path)) == NULL) {
+        shell_error("limit: %s: %s", path, strerror(errno));
+        if (limits->cgroup_fd >= 0) {
+            close(limits->cgroup_fd);
+        }
+        rmdir(path);
+        return -1;
+    }
+    return 0;
+}
+
+int
+find_cgroup_root()
+{
+    /*
+     * helper function to find, once, the cgroup v2 directory job cgroups are made in: the
+     * shell's own cgroup, with the memory, cpu and pids controllers handed down to its children
+     * as far as they are available. a cgroup with processes in it cannot hand them down, so when
+     * the shell is alone in its cgroup (as in a scope delegated to it) it moves into a leaf
+     * cgroup of its own first, which leave_cgroup takes down again at exit. otherwise the
+     * controllers stay as they are
+     *
+     * returns:
+     *  0 if cgroup_root is set, -1 if there is no usable cgroup v2 hierarchy
+     */
+
+    static char *controllers[] = {"memory", "cpu", "pids"};
+    char mount[PATH_MAX], own[PATH_MAX], path[2 * PATH_MAX], leaf[2 * PATH_MAX + 64], pid[32], buf[256];
+    char *line = NULL, *p;
+    size_t cap = 0;
+    FILE *file;
+    int moved = 0;
+
+    if (cgroup_state != 0) {
+        return cgroup_state > 0 ? 0 : -1;
+    }
+    cgroup_state = -1;
+
+    // where the cgroup2 file system is mounted: the fifth field of its line in mountinfo
+    mount[0] = own[0] = 0;
+    if ((file = fopen("/proc/self/mountinfo", "re")) != NULL) {
+        while (mount[0] == 0 && getline(&line, &cap, file) > 0) {
+            if (strstr(line, " - cgroup2 ") != NULL && sscanf(line, "%*s %*s %*s %*s %4095s", mount) != 1) {
+                mount[0] = 0;
+            }
+        }
+        fclose(file);
+    }
+    // and the shell's cgroup in it, from the 0:: line
+    if (mount[0] != 0 && (file = fopen("/proc/self/cgroup", "re")) != NULL) {
+        while (own[0] == 0 && getline(&line, &cap, file) > 0) {
+            if (strncmp(line, "0::", 3) == 0) {
+                snprintf(own, sizeof(own), "%s", line + 3);
+                own[strcspn(own, "\n")] = 0;
+            }
+        }
+        fclose(file);
+    }
+    free(line);
+    if (mount[0] == 0 || own[0] == 0) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s%s", mount, strcmp(own, "/") == 0 ? "" : own);
+    if (access(path, W_OK) < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        snprintf(leaf, sizeof(leaf), "%s/cgroup.controllers", path);
+        if (read_text(leaf, buf, sizeof(buf)) < 0 || !has_controller(buf, controllers[i])) {
+            continue;
+        }
+        snprintf(leaf, sizeof(leaf), "%s/cgroup.subtree_control", path);
+        if (read_text(leaf, buf, sizeof(buf)) >= 0 && has_controller(buf, controllers[i])) {
+            continue;
+        }
+        snprintf(buf, sizeof(buf), "+%s", controllers[i]);
+        if (write_text(leaf, buf) == 0) {
+            snprintf(cgroup_enabled + strlen(cgroup_enabled), sizeof(cgroup_enabled) - strlen(cgroup_enabled),
+                    "%s-%s", cgroup_enabled[0] != 0 ? " " : "", controllers[i]);
+            continue;
+        }
+        if (errno != EBUSY || moved) {
+            continue;
+        }
+
+        // busy: the shell itself is in the way, if it is alone
+        moved = -1;
+        snprintf(leaf, sizeof(leaf), "%s/mysh-%d.shell", path, (int)getpid());
+        snprintf(pid, sizeof(pid), "%d", (int)getpid());
+        if (mkdir(leaf, 0755) < 0) {
+            continue;
+        }
+        strcat(leaf, "/cgroup.procs");
+        if (write_text(leaf, pid) < 0) {
+            leaf[strlen(leaf) - strlen("/cgroup.procs")] = 0;
+            rmdir(leaf);
+            continue;
+        }
+        snprintf(leaf, sizeof(leaf), "%s/cgroup.subtree_control", path);
+        if (write_text(leaf, buf) == 0) {
+            snprintf(cgroup_enabled + strlen(cgroup_enabled), sizeof(cgroup_enabled) - strlen(cgroup_enabled),
+                    "%s-%s", cgroup_enabled[0] != 0 ? " " : "", controllers[i]);
+            snprintf(leaf, sizeof(leaf), "%s/mysh-%d.shell", path, (int)getpid());
+            if ((cgroup_leaf = strdup(leaf)) == NULL) {
+                perror("strdup");
+                exit(1);
+            }
+            atexit(leave_cgroup);
+            moved = 1;
+            continue;
+        }
+
+        // others are in there as well, go back to where the shell was
+        snprintf(leaf, sizeof(leaf), "%s/cgroup.procs", path);
+        write_text(leaf, pid);
+        snprintf(leaf, sizeof(leaf), "%s/mysh-%d.shell", path, (int)getpid());
+        rmdir(leaf);
+    }
+
+    if ((p = strdup(path)) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    cgroup_root = p;
+    cgroup_state = 1;
+    return 0;
+}
+
+void
+leave_cgroup()
+{
+    /*
+     * helper function run at exit, so the leaf cgroup find_cgroup_root moved the shell into
+     * does not outlive it: the controllers it turned on are turned off again, since a cgroup
+     * handing them down cannot have processes, the shell goes back to its own cgroup and the
+     * leaf is removed. while a background job with limits still runs in a cgroup of its own,
+     * the controllers cannot be turned off and the empty leaf is left behind
+     */
+
+    char path[PATH_MAX + 32], pid[32];
+
+    // children that exit through here are not the shell
+    if (cgroup_leaf == NULL || getpid() != shell_pid) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/cgroup.subtree_control", cgroup_root);
+    if (write_text(path, cgroup_enabled) < 0) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/cgroup.procs", cgroup_root);
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    if (write_text(path, pid) == 0) {
+        rmdir(cgroup_leaf);
+    }
+}
+
+int
+has_controller(char *list, char *name)
+{
+    /*
+     * helper function to look for a controller in a space-separated list like cgroup.controllers
+     */
+
+    size_t len = strlen(name);
+
+    for (char *p = list; (p = strstr(p, name)) != NULL; p += len) {
+        if ((p == list || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\n' || p[len] == 0)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+ssize_t
+read_text(char *path, char *buf, size_t size)
+{
+    /*
+     * helper function to read a small file like the ones in /sys and /proc into buf, with a 0
+     * at the end
+     *
+     * returns:
+     *  the length, -1 if the file could not be read
+     */
+
+    ssize_t len;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    while ((len = read(fd, buf, size - 1)) < 0 && errno == EINTR);
+    close(fd);
+    if (len < 0) {
+        return -1;
+    }
+    buf[len] = 0;
+    return len;
+}
+
+int
+write_text(char *path, char *text)
+{
+    /*
+     * helper function to write a value into a file of the cgroup file system, in one write
+     *
+     * returns:
+     *  0 on success, -1 with errno set otherwise
+     */
+
+    size_t len = strlen(text);
+    ssize_t written;
+    int fd, saved_errno;
+
+    if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    written = write(fd, text, len);
+    saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return written == (ssize_t)len ? 0 : -1;
+}
+
+void
+init_job_control()
+{
+    /*
+     * helper function to turn on job control, for an interactive shell on a terminal. the shell
+     * waits until it is in the foreground, moves into a process group of its own and takes the
+     * terminal. from then on Ctrl-C, Ctrl-\\ and Ctrl-Z go to the foreground job's group only,
+     * and the shell ignores them itself (a Ctrl-C it gets while running a builtin stops the line)
+     */
+
+    static int ignored[] = {SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU};
+    struct sigaction action;
+
+    if (!isatty(0) || (tty_fd = fcntl(0, F_DUPFD_CLOEXEC, SAVED_FDS)) < 0) {
+        return;
+    }
+
+    // started in the background: stop until someone brings us to the foreground
+    while (tcgetpgrp(tty_fd) != getpgrp()) {
+        kill(-getpgrp(), SIGTTIN);
+    }
+
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = SIG_IGN;
+    for (int i = 0; i < (int)(sizeof(ignored) / sizeof(ignored[0])); i++) {
+        sigaction(ignored[i], &action, NULL);
+        sigaddset(&child_sigdefault, ignored[i]);
+    }
+
+    // without SA_RESTART, so a builtin blocked in a read gets EINTR and can give up
+    action.sa_handler = on_sigint;
+    sigaction(SIGINT, &action, NULL);
+    sigaddset(&child_sigdefault, SIGINT);
+
+    if (getpgrp() != getpid() && setpgid(0, 0) < 0) {
+        perror("setpgid");
+    }
+    shell_pgid = getpgrp();
+    if (tcsetpgrp(tty_fd, shell_pgid) < 0) {
+        perror("tcsetpgrp");
+    }
+    tcgetattr(tty_fd, &shell_tmodes);
+    job_control = 1;
+}
+
+void
+on_sigint(int sig)
+{
+    /*
+     * signal handler for SIGINT while job control is on. it only raises a flag, which makes the
+     * lists and loops being run give up, and moves past the ^C the terminal echoed
+     */
+
+    interrupted = 1;
+    write(2, "\n", 1);
+}
+
+int
+unwinding()
+{
+    /*
+     * helper function, true while a break, continue, return or Ctrl-C is on its way out and no
+     * further commands may start
+     */
+
+    return breaking || continuing || returning || interrupted;
+}
+
+int
+wait_events(int fd, int timeout_ms)
+{
+    /*
+     * function at the heart of the shell's waiting: sleeps until a child changes state or fd
+     * becomes readable, and reaps whatever children are done
+     *
+     * args:
+     *  int fd: descriptor to wait for as well, or -1 to only wait for children
+     *  int timeout_ms: how long to wait at most, -1 for as long as it takes
+     *
+     * returns:
+     *  1 if fd is readable, 0 otherwise
+     */
+
+    static struct pollfd *fds;
+    static int fds_cap;
+    struct job *job;
+    int num_fds = 3;
+
+    // the log pipes of every job are passed on as they fill up, whoever is being waited for
+    if (fds_cap < 3 + 2 * jobs_cap) {
+        fds_cap = 3 + 2 * jobs_cap;
+        if ((fds = realloc(fds, fds_cap * sizeof(struct pollfd))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    fds[0] = (struct pollfd){sigchld_fd, POLLIN, 0};
+    fds[1] = (struct pollfd){timer_fd, POLLIN, 0};
+    fds[2] = (struct pollfd){fd, POLLIN, 0};
+    for (int id = 0; id < jobs_cap; id++) {
+        for (int stream = 0; jobs[id] != NULL && stream < 2; stream++) {
+            if (jobs[id]->log_fds[stream] >= 0) {
+                fds[num_fds++] = (struct pollfd){jobs[id]->log_fds[stream], POLLIN, 0};
+            }
+        }
+    }
+
+    // a negative fd is skipped by poll
+    while (poll(fds, num_fds, timeout_ms) < 0) {
+        // a Ctrl-C the shell caught lets whoever waits decide whether to go on
+        if (errno == EINTR && interrupted) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            perror("poll");
+            return fd >= 0;
+        }
+    }
+    // same order as above, the job table has not changed since
+    num_fds = 3;
+    for (int id = 0; id < jobs_cap; id++) {
+        for (int stream = 0; (job = jobs[id]) != NULL && stream < 2; stream++) {
+            if (job->log_fds[stream] >= 0 && fds[num_fds++].revents != 0) {
+                pump_log(job, stream);
+            }
+        }
+    }
+    if (fds[0].revents != 0) {
+        reap_children();
+    }
+    if (fds[1].revents != 0) {
+        expire_timeouts();
+    }
+    return fd >= 0 && fds[2].revents != 0;
+}
+
+void
+reap_children()
+{
+    /*
+     * helper function to drain the signalfd and collect every child that changed state, with
+     * wait4 so the child's resource usage comes along for free. signals
+     * are merged, so one SIGCHLD can stand for many children and waitpid is asked until it has
+     * nothing left. a child that changes state after that raises a new SIGCHLD
+     */
+
+    struct signalfd_siginfo info[8];
+    struct rusage rusage;
+    int status;
+    pid_t pid;
+
+    while (read(sigchld_fd, info, sizeof(info)) > 0);
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &rusage)) > 0) {
+        record_status(pid, status, &rusage);
+    }
+}
+
+int
+prepare_timeout(struct arena *arena, struct command *words, struct job *job)
+{
+    /*
+     * function to work out the words of a timeout prefix right before its pipeline runs:
+     * [-s SIGNAL] [-k DURATION] DURATION, where durations are seconds with an optional s, m, h
+     * or d, fractions allowed. a duration of 0 means no timeout, -k 0 never sends SIGKILL. the
+     * options can be written the other ways timeout(1) takes too: -sSIGNAL, --signal=SIGNAL,
+     * --signal SIGNAL, and the same for -k and --kill-after
+     *
+     * args:
+     *  struct arena *arena: arena of the current line, which expanded words are allocated from
+     *  struct command *words: the words, as the parser found them
+     *  struct job *job: gets deadline_ns (relative), kill_after_ns and timeout_signal
+     *
+     * returns:
+     *  0 on success, -1 if a word is invalid (message is printed)
+     */
+
+    char **word, *value, option;
+
+    job->deadline_ns = 0;
+    job->kill_after_ns = TIMEOUT_KILL_MS * 1000000LL;
+    job->timeout_signal = SIGTERM;
+    if (words->expand && (words = expand_command(arena, words)) == NULL) {
+        return -1;
+    }
+
+    for (word = words->argv; *word != NULL && (*word)[0] == '-' && (*word)[1] != 0; word++) {
+        if (strcmp(*word, "--") == 0) {
+            word++;
+            break;
+        }
+        if ((option = timeout_option(*word, &value)) == 0) {
+            shell_error("timeout: %s: invalid option, expected -s SIGNAL or -k DURATION", *word);
+            return -1;
+        }
+        if (value == NULL && (value = *++word) == NULL) {
+            shell_error("timeout: -%c: option requires an argument", option);
+            return -1;
+        }
+        if (option == 's' && (job->timeout_signal = parse_signal(value)) < 0) {
+            shell_error("timeout: %s: invalid signal", value);
+            return -1;
+        }
+        if (option == 'k' && (job->kill_after_ns = parse_duration(value)) < 0) {
+            shell_error("timeout: %s: invalid duration", value);
+            return -1;
+        }
+    }
+
+    if (*word == NULL || word[1] != NULL || (job->deadline_ns = parse_duration(*word)) < 0) {
+        shell_error("timeout: %s: invalid duration", *word != NULL ? *word : "");
+        return -1;
+    }
+    return 0;
+}
+
+int
+timeout_option(char *word, char **value)
+{
+    /*
+     * helper function to recognize an option of timeout, in any of the ways timeout(1) takes it
+     *
+     * args:
+     *  char *word: the option
+     *  char **value: set to its argument when that is part of the word, NULL if it is the next one
+     *
+     * returns:
+     *  's' for the signal, 'k' for the kill delay, 0 for anything else
+     */
+
+    static char *long_names[] = {"--signal", "--kill-after"};
+    size_t len;
+
+    *value = NULL;
+    for (int i = 0; i < 2; i++) {
+        len = strlen(long_names[i]);
+        if (strncmp(word, long_names[i], len) == 0 && (word[len] == 0 || word[len] == '=')) {
+            *value = word[len] == '=' ? word + len + 1 : NULL;
+            return i == 0 ? 's' : 'k';
+        }
+    }
+    if (word[0] == '-' && (word[1] == 's' || word[1] == 'k')) {
+        *value = word[2] != 0 ? word + 2 : NULL;
+        return word[1];
+    }
+    return 0;
+}
+
+long long
+parse_duration(char *str)
+{
+    /*
+     * helper function to parse a duration like 10, 1.5s, 2m, 1h or 1d
+     *
+     * returns:
+     *  the duration in nanoseconds, or -1 if str is not a valid duration
+     */
+
+    double seconds;
+    char *end;
+
+    errno = 0;
+    seconds = strtod(str, &end);
+    if (end == str || errno != 0 || !(seconds >= 0)) {
+        return -1;
+    }
+    switch (*end) {
+    case 'd':
+        seconds *= 24;
+        // fallthrough
+    case 'h':
+        seconds *= 60;
+        // fallthrough
+    case 'm':
+        seconds *= 60;
+        // fallthrough
+    case 's':
+        end++;
+        break;
+    }
+    if (*end != 0 || seconds > LLONG_MAX / 1e9) {
+        return -1;
+    }
+    return seconds * 1e9;
+}
+
+int
+parse_signal(char *str)
+{
+    /*
+     * helper function to parse a signal given as number or name, with or without SIG in front
+     *
+     * returns:
+     *  the signal number, or -1 if there is no such signal
+     */
+
+    const char *name;
+    char *end;
+    long sig;
+
+    sig = strtol(str, &end, 10);
+    if (*str != 0 && *end == 0) {
+        return sig > 0 && sig < NSIG ? sig : -1;
+    }
+    if (strncasecmp(str, "SIG", 3) == 0) {
+        str += 3;
+    }
+    for (sig = 1; sig < NSIG; sig++) {
+        if ((name = sigabbrev_np(sig)) != NULL && strcasecmp(name, str) == 0) {
+            return sig;
+        }
+    }
+    return -1;
+}
+
+void
+arm_timer()
+{
+    /*
+     * function to set the timer to the earliest deadline of any job, or to stop it when there is
+     * none. a shell has few jobs at a time, so they are simply looked through each time one is
+     * started or expires
+     */
+
+    struct itimerspec spec;
+    long long next = 0;
+
+    for (int id = 0; id < jobs_cap; id++) {
+        if (jobs[id] != NULL && jobs[id]->deadline_ns > 0 && (next == 0 || jobs[id]->deadline_ns < next)) {
+            next = jobs[id]->deadline_ns;
+        }
+    }
+    if (timer_fd < 0) {
+        if (next == 0) {
+            return;
+        }
+        if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+            perror("timerfd_create");
+            return;
+        }
+    }
+
+    // now_ns is CLOCK_MONOTONIC as well, so the deadline is an absolute time for the timer.
+    // all zeroes disarm it
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = next / 1000000000;
+    spec.it_value.tv_nsec = next % 1000000000;
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        perror("timerfd_settime");
+    }
+}
+
+void
+expire_timeouts()
+{
+    /*
+     * function to act on the deadlines that have passed when the timer fires: a job that ran out
+     * of time gets its signal, and SIGKILL if it is still around kill_after_ns later
+     */
+
+    unsigned long long expirations;
+    long long now = now_ns();
+    struct job *job;
+
+    while (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno == EINTR);
+    for (int id = 0; id < jobs_cap; id++) {
+        if ((job = jobs[id]) == NULL || job->deadline_ns == 0 || job->deadline_ns > now) {
+            continue;
+        }
+        if (job_done(job) && !job_stopped(job)) {
+            job->deadline_ns = 0;
+            continue;
+        }
+        if (!job->timed_out) {
+            signal_job(job, job->timeout_signal);
+            job->timed_out = 1;
+            job->deadline_ns = job->kill_after_ns > 0 ? now + job->kill_after_ns : 0;
+        }
+        else {
+            signal_job(job, SIGKILL);
+            job->deadline_ns = 0;
+        }
+    }
+    arm_timer();
+}
+
+void
+signal_job(struct job *job, int sig)
+{
+    /*
+     * helper function to send a signal to every process of a job: to its process group when it
+     * has one, so whatever the stages started gets it as well. stopped stages are continued, so
+     * they can act on it
+     */
+
+    if (job->pgid != shell_pgid) {
+        killpg(job->pgid, sig);
+    }
+    else {
+        for (int i = 0; i < job->num_procs; i++) {
+            if (job->procs[i].state != PROC_DONE) {
+                kill(job->procs[i].pid, sig);
+            }
+        }
+    }
+    if (sig != SIGKILL && sig != SIGCONT) {
+        continue_job(job);
+    }
+}
+
+struct job *
+new_job(int num_procs)
+{
+    /*
+     * function to add a job to the job table, with every stage marked as not started
+     *
+     * args:
+     *  int num_procs: number of pipeline stages
+     *
+     * returns:
+     *  the job, which takes the lowest free job number
+     */
+
+    struct job *job;
+    int id;
+
+    if ((job = malloc(sizeof(struct job) + num_procs * sizeof(struct process))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    job->pgid = shell_pgid;
+    job->background = 0;
+    job->seq = ++job_seq;
+    job->command = NULL;
+    job->cgroup = NULL;
+    job->timed = TIME_NONE;
+    job->start_ns = now_ns();
+    job->parse_ns = job->spawn_ns = job->teardown_ns = 0;
+    job->deadline_ns = job->kill_after_ns = 0;
+    job->timeout_signal = SIGTERM;
+    job->timed_out = 0;
+    job->log_fds[0] = job->log_fds[1] = -1;
+    job->dropped = NULL;
+    job->num_stages = num_procs;
+    job->num_procs = num_procs;
+    memset(job->procs, 0, num_procs * sizeof(struct process));
+    for (int i = 0; i < num_procs; i++) {
+        job->procs[i].pid = -1;
+        job->procs[i].exec_ns = -1;
+        job->procs[i].cpu = -1;
+        job->procs[i].status = W_EXITCODE(1, 0);
+        job->procs[i].state = PROC_DONE;
+    }
+
+    for (id = 0; id < jobs_cap && jobs[id] != NULL; id++);
+    if (id == jobs_cap) {
+        jobs_cap = jobs_cap == 0 ? JOBS_INITIAL_SLOTS : 2 * jobs_cap;
+        if ((jobs = realloc(jobs, jobs_cap * sizeof(struct job *))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(jobs + id, 0, (jobs_cap - id) * sizeof(struct job *));
+    }
+    jobs[id] = job;
+    job->id = id + 1;
+    return job;
+}
+
+void
+free_job(struct job *job)
+{
+    /*
+     * helper function to drop a job from the job table. every job ends here, so this is also
+     * where time and tracing report it
+     */
+
+    long long end_ns = job->start_ns, user_ns = 0, sys_ns = 0;
+
+    close_log(job);
+    if (job->timed) {
+        for (int i = 0; i < job->num_procs; i++) {
+            end_ns = job->procs[i].end_ns > end_ns ? job->procs[i].end_ns : end_ns;
+            user_ns += timeval_ns(&job->procs[i].rusage.ru_utime);
+            sys_ns += timeval_ns(&job->procs[i].rusage.ru_stime);
+        }
+        print_times(job->timed, end_ns - job->start_ns, user_ns, sys_ns);
+    }
+    if (trace_file != NULL) {
+        trace_job(job);
+    }
+
+    // a descendant that outlived the job keeps its cgroup busy, then it is left behind
+    if (job->cgroup != NULL) {
+        rmdir(job->cgroup);
+        free(job->cgroup);
+    }
+
+    jobs[job->id - 1] = NULL;
+    free(job->command);
+    free(job->dropped);
+    free(job);
+}
+
+int
+job_done(struct job *job)
+{
+    /*
+     * helper function, true once none of the job's processes is running any more
+     */
+
+    for (int i = 0; i < job->num_procs; i++) {
+        if (job->procs[i].state == PROC_RUNNING) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int
+job_stopped(struct job *job)
+{
+    /*
+     * helper function, true if the job is not running but some of its processes are only stopped
+     */
+
+    if (!job_done(job)) {
+        return 0;
+    }
+    for (int i = 0; i < job->num_procs; i++) {
+        if (job->procs[i].state == PROC_STOPPED) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void
+wait_for_job(struct job *job)
+{
+    /*
+     * function to sleep until no process of job is running any more. other jobs keep being
+     * recorded while we wait
+     *
+     * args:
+     *  struct job *job: the job to wait for
+     */
+
+    int timeout_ms;
+
+    // inside $(...) the children's output is read meanwhile, so they never block on a full pipe.
+    // a background job waited for by wait can be given up on with Ctrl-C
+    while (!job_done(job) && !(job->background && interrupted)) {
+        timeout_ms = -1;
+
+        // a stage that is still there a while after the SIGPIPE of tear_down is terminated
+        if (job->teardown_ns > 0) {
+            timeout_ms = TEARDOWN_GRACE_MS - (now_ns() - job->teardown_ns) / 1000000;
+            if (timeout_ms <= 0) {
+                for (int i = job->num_procs - 2; i >= 0 && job->procs[i].feeds_pipe; i--) {
+                    if (job->procs[i].state != PROC_DONE) {
+                        kill(job->procs[i].pid, SIGTERM);
+                    }
+                }
+                job->teardown_ns = -1;
+                timeout_ms = -1;
+            }
+        }
+        if (wait_events(current_capture != NULL ? current_capture->fd : -1, timeout_ms)) {
+            capture_read(current_capture);
+        }
+    }
+}
+
+void
+tear_down(struct job *job)
+{
+    /*
+     * helper function to stop the stages that only fed the last stage of a job, once it is gone.
+     * they would get SIGPIPE on their next write anyway, this way they also get it while they
+     * are busy with something else. one that ignores it is terminated by wait_for_job later
+     */
+
+    for (int i = job->num_procs - 2; i >= 0 && job->procs[i].feeds_pipe; i--) {
+        if (job->procs[i].state != PROC_DONE) {
+            kill(job->procs[i].pid, SIGPIPE);
+            job->teardown_ns = now_ns();
+        }
+    }
+}
+
+void
+continue_job(struct job *job)
+{
+    /*
+     * helper function to send SIGCONT to the stopped processes of a job, to its whole process
+     * group when it has one of its own
+     */
+
+    int stopped = 0;
+
+    for (int i = 0; i < job->num_procs; i++) {
+        if (job->procs[i].state == PROC_STOPPED) {
+            if (job->pgid == shell_pgid) {
+                kill(job->procs[i].pid, SIGCONT);
+            }
+            job->procs[i].state = PROC_RUNNING;
+            stopped = 1;
+        }
+    }
+    if (stopped && job->pgid != shell_pgid) {
+        killpg(job->pgid, SIGCONT);
+    }
+}
+
+void
+finish_foreground(struct job *job)
+{
+    /*
+     * helper function to set $? and PIPESTATUS from a job that was waited for in the foreground.
+     * a job that got stopped instead of finishing stays in the table as a background job
+     *
+     * args:
+     *  struct job *job: the job
+     */
+
+    int signaled = 0;
+
+    // the job's last output comes before anything the shell says about it
+    if (!job_stopped(job)) {
+        close_log(job);
+    }
+
+    for (int i = 0; i < job->num_procs; i++) {
+        if (job->procs[i].state == PROC_DONE && WIFSIGNALED(job->procs[i].status)) {
+            signaled = 1;
+
+            // Ctrl-C stops whatever the line was going to run after the job, as in other shells.
+            // a SIGINT from its timeout is not the user's
+            if (WTERMSIG(job->procs[i].status) == SIGINT && !job->timed_out) {
+                interrupted = 1;
+            }
+        }
+    }
+
+    // the terminal goes back to the shell. a job that stopped or was killed may have left it in
+    // whatever mode it needed
+    if (job_control && job->pgid != shell_pgid) {
+        tcsetpgrp(tty_fd, shell_pgid);
+        if (job_stopped(job) || signaled) {
+            tcsetattr(tty_fd, TCSADRAIN, &shell_tmodes);
+        }
+        if (interrupted && !job_stopped(job)) {
+            fputc('\n', stderr);
+        }
+    }
+
+    if (job_stopped(job)) {
+        job->background = 1;
+        job->seq = ++job_seq;
+        fputc('\n', stderr);
+        print_job(job, 0);
+        last_status = 128 + SIGTSTP;
+        set_pipestatus_single(last_status);
+        return;
+    }
+
+    // PIPESTATUS still has what every stage died of
+    set_pipestatus(job);
+    last_status = job->timed_out ? TIMEOUT_STATUS : pipestatus[pipestatus_len - 1];
+    if (!job->timed_out) {
+        report_signal(job);
+    }
+    free_job(job);
+}
+
+void
+record_status(pid_t pid, int status, struct rusage *rusage)
+{
+    /*
+     * helper function to store the wait status (and resource usage, once it is done) of a child
+     * that changed state in its job
+     */
+
+    struct job *job;
+    struct process *proc;
+
+    for (int id = 0; id < jobs_cap; id++) {
+        if ((job = jobs[id]) == NULL) {
+            continue;
+        }
+        for (int i = 0; i < job->num_procs; i++) {
+            proc = &job->procs[i];
+            if (proc->pid != pid) {
+                continue;
+            }
+            if (WIFSTOPPED(status)) {
+                proc->state = PROC_STOPPED;
+            }
+            else if (WIFCONTINUED(status)) {
+                proc->state = PROC_RUNNING;
+            }
+            else {
+                proc->status = status;
+                proc->state = PROC_DONE;
+                proc->rusage = *rusage;
+                proc->end_ns = now_ns();
+
+                // nobody reads what the stages before the last one write any more
+                if (i == job->num_procs - 1) {
+                    tear_down(job);
+                }
+            }
+            return;
+        }
+    }
+}
+
+int
+notify_jobs(int verbose)
+{
+    /*
+     * function to remove finished background jobs from the table, remembering the status of
+     * their last process for `wait pid`
+     *
+     * args:
+     *  int verbose: print a Done line for each of them, as interactive shells do
+     *
+     * returns:
+     *  the number of jobs removed
+     */
+
+    struct job *job;
+    int count = 0;
+
+    for (int id = 0; id < jobs_cap; id++) {
+        if ((job = jobs[id]) == NULL || !job->background || !job_done(job) || job_stopped(job)) {
+            continue;
+        }
+        if (verbose) {
+            print_job(job, 0);
+        }
+        forget_job(job);
+        count++;
+    }
+    return count;
+}
+
+void
+forget_job(struct job *job)
+{
+    /*
+     * helper function to remove a finished background job from the table, remembering the
+     * status of its last process for `wait pid`
+     */
+
+    struct finished_proc *done = &finished[finished_next];
+
+    finished_next = (finished_next + 1) % FINISHED_SLOTS;
+    done->pid = job->procs[job->num_procs - 1].pid;
+    done->status = exit_status(job->procs[job->num_procs - 1].status);
+    free_job(job);
+}
+
+void
+print_job(struct job *job, int show_pids)
+{
+    /*
+     * helper function to print a job the way bash's jobs does, marking the current job with +
+     * and the previous one with -
+     *
+     * args:
+     *  struct job *job: the job
+     *  int show_pids: also print the pid of every process (jobs -l)
+     */
+
+    unsigned long newest = 0, second = 0;
+    char state[32], mark = ' ';
+    int status = job->procs[job->num_procs - 1].status;
+
+    for (int id = 0; id < jobs_cap; id++) {
+        if (jobs[id] != NULL && jobs[id]->seq > newest) {
+            second = newest;
+            newest = jobs[id]->seq;
+        }
+        else if (jobs[id] != NULL && jobs[id]->seq > second) {
+            second = jobs[id]->seq;
+        }
+    }
+    if (job->seq == newest) {
+        mark = '+';
+    }
+    else if (job->seq == second) {
+        mark = '-';
+    }
+
+    if (job_stopped(job)) {
+        strcpy(state, "Stopped");
+    }
+    else if (!job_done(job)) {
+        strcpy(state, "Running");
+    }
+    else if (WIFSIGNALED(status)) {
+        snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(status)));
+    }
+    else if (WEXITSTATUS(status) != 0) {
+        snprintf(state, sizeof(state), "Exit %d", WEXITSTATUS(status));
+    }
+    else {
+        strcpy(state, "Done");
+    }
+
+    printf("[%d]%c  ", job->id, mark);
+    if (show_pids) {
+        printf("%d ", (int)job->procs[0].pid);
+    }
+    printf("%-22s  %s%s\n", state, job->command, job_done(job) ? "" : " &");
+    if (show_pids) {
+        for (int i = 1; i < job->num_procs; i++) {
+            printf("      %d\n", (int)job->procs[i].pid);
+        }
+    }
+    fflush(stdout);
+}
+
+char *
+format_pipeline(struct pipeline *pipeline)
+{
+    /*
+     * helper function to rebuild the text of a pipeline from its parsed form, for jobs listings
+     *
+     * returns:
+     *  malloc'd string
+     */
+
+    static char *redir_ops[] = {"<", ">", ">>", "<>", ">&", "<<", "<<", "<<<"};
+
+    // compound commands are only hinted at
+    static char *compound_text[] = {"", "", "", "if ...; fi", "while ...; done", "until ...; done", "for ...; done",
+        "{ ...; }", "( ... )", "() { ...; }"};
+    struct command *cmd;
+    struct redir *redir;
+    char *text;
+    size_t len = 1, used = 0;
+
+    for (cmd = pipeline->commands; cmd != NULL; cmd = cmd->next) {
+        if (cmd->body != NULL) {
+            len += strlen(compound_text[cmd->body->type]) + (cmd->body->name != NULL ? strlen(cmd->body->name) : 0) + 1;
+        }
+        for (int i = 0; i < cmd->argc; i++) {
+            len += strlen(cmd->argv[i]) + 1;
+        }
+        for (redir = cmd->redirs; redir != NULL; redir = redir->next) {
+            len += strlen(redir->path) + 8;
+        }
+        len += 3;
+    }
+    if ((text = malloc(len)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    text[0] = 0;
+    for (cmd = pipeline->commands; cmd != NULL; cmd = cmd->next) {
+        if (cmd->body != NULL) {
+            used += sprintf(text + used, "%s%s%s", used > 0 ? " " : "", cmd->body->type == NODE_FUNCTION ? cmd->body->name : "",
+                    compound_text[cmd->body->type]);
+        }
+        for (int i = 0; i < cmd->argc; i++) {
+            used += sprintf(text + used, "%s%s", used > 0 && text[used - 1] != ' ' ? " " : "", cmd->argv[i]);
+        }
+        for (redir = cmd->redirs; redir != NULL; redir = redir->next) {
+            // the descriptor is only shown where it is not the operator's default
+            used += sprintf(text + used, used > 0 ? " " : "");
+            if (redir->fd != (redir->type == REDIR_OUT || redir->type == REDIR_APPEND || redir->type == REDIR_DUP)) {
+                used += sprintf(text + used, "%d", redir->fd);
+            }
+            used += sprintf(text + used, "%s%s%s", redir->type == REDIR_DUP && redir->fd == 0 ? "<&" : redir_ops[redir->type],
+                    redir->type == REDIR_DUP ? "" : " ", redir->path);
+        }
+        if (cmd->next != NULL) {
+            used += sprintf(text + used, " |");
+        }
+    }
+    return text;
+}
+
+struct job *
+find_job(char *spec, char *builtin_name)
+{
+    /*
+     * helper function to find the job a job spec refers to: %n, %% or %+ (the current job), %-
+     * (the previous one) or %string (the job whose command starts with string). no spec means
+     * the current job
+     *
+     * args:
+     *  char *spec: the job spec, or NULL
+     *  char *builtin_name: used in error messages
+     *
+     * returns:
+     *  the job, or NULL if there is no such job (message is printed)
+     */
+
+    struct job *best = NULL, *second = NULL, *job;
+    char *end;
+    long id;
+
+    if (spec != NULL && spec[0] == '%' && spec[1] >= '0' && spec[1] <= '9') {
+        id = strtol(spec + 1, &end, 10);
+        if (*end == 0 && id > 0 && id <= jobs_cap && jobs[id - 1] != NULL) {
+            return jobs[id - 1];
+        }
+        shell_error("%s: %s: no such job", builtin_name, spec);
+        return NULL;
+    }
+
+    for (int i = 0; i < jobs_cap; i++) {
+        if ((job = jobs[i]) == NULL) {
+            continue;
+        }
+        if (spec != NULL && spec[0] == '%' && strchr("%+-", spec[1]) == NULL && spec[1] != 0) {
+            if (strncmp(job->command, spec + 1, strlen(spec + 1)) == 0 && (best == NULL || job->seq > best->seq)) {
+                best = job;
+            }
+            continue;
+        }
+        if (best == NULL || job->seq > best->seq) {
+            second = best;
+            best = job;
+        }
+        else if (second == NULL || job->seq > second->seq) {
+            second = job;
+        }
+    }
+
+    if (spec != NULL && strcmp(spec, "%-") == 0) {
+        best = second;
+    }
+    else if (spec != NULL && spec[0] != '%') {
+        shell_error("%s: %s: no such job", builtin_name, spec);
+        return NULL;
+    }
+    if (best == NULL) {
+        shell_error("%s: %s: no such job", builtin_name, spec != NULL ? spec : "current");
+    }
+    return best;
+}
+
+int
+exit_status(int wait_status)
+{
+    /*
+     * helper function turning a wait status into a shell status: the exit code, or 128 plus the
+     * signal number for a process that was killed
+     */
+
+    if (WIFSIGNALED(wait_status)) {
+        return 128 + WTERMSIG(wait_status);
+    }
+    return WEXITSTATUS(wait_status);
+}
+
+void
+set_pipestatus(struct job *job)
+{
+    /*
+     * helper function to fill PIPESTATUS from a finished job. cat stages optimize_pipeline left
+     * out count as having succeeded
+     */
+
+    if (job->num_stages > pipestatus_cap) {
+        pipestatus_cap = job->num_stages;
+        if ((pipestatus = realloc(pipestatus, pipestatus_cap * sizeof(int))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    for (int i = 0, proc = 0; i < job->num_stages; i++) {
+        pipestatus[i] = job->dropped != NULL && job->dropped[i] ? 0 : exit_status(job->procs[proc++].status);
+    }
+    pipestatus_len = job->num_stages;
+}
+
+void
+set_pipestatus_single(int status)
+{
+    /*
+     * helper function to set PIPESTATUS after something that did not need a job, like a builtin
+     */
+
+    if (pipestatus_cap == 0) {
+        pipestatus_cap = 1;
+        if ((pipestatus = malloc(sizeof(int))) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    pipestatus[0] = status;
+    pipestatus_len = 1;
+}
+
+void
+report_signal(struct job *job)
+{
+    /*
+     * helper function to tell the user when the last stage of a job was killed by a signal, except
+     * for the ones that are an expected way to stop (SIGINT, SIGPIPE)
+     */
+
+    int status = job->procs[job->num_procs - 1].status;
+
+    if (WIFSIGNALED(status) && WTERMSIG(status) != SIGINT && WTERMSIG(status) != SIGPIPE) {
+        fprintf(stderr, "%s%s\n", strsignal(WTERMSIG(status)), WCOREDUMP(status) ? " (core dumped)" : "");
+    }
+}
+
+long long
+now_ns()
+{
+    /*
+     * helper function returning the monotonic clock in nanoseconds
+     */
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long long
+timeval_ns(struct timeval *tv)
+{
+    return tv->tv_sec * 1000000000LL + tv->tv_usec * 1000LL;
+}
+
+void
+shell_usage(struct rusage usage[2])
+{
+    /*
+     * helper function to get the resource usage of the shell itself and of its reaped children
+     */
+
+    getrusage(RUSAGE_SELF, &usage[0]);
+    getrusage(RUSAGE_CHILDREN, &usage[1]);
+}
+
+long long
+usage_ns(struct rusage usage[2], int sys)
+{
+    /*
+     * helper function to add up the user (or with sys set, system) time of a shell_usage result
+     */
+
+    if (sys) {
+        return timeval_ns(&usage[0].ru_stime) + timeval_ns(&usage[1].ru_stime);
+    }
+    return timeval_ns(&usage[0].ru_utime) + timeval_ns(&usage[1].ru_utime);
+}
+
+void
+print_times(int format, long long real_ns, long long user_ns, long long sys_ns)
+{
+    /*
+     * helper function to print the report of time to stderr, in bash's format or with -p in
+     * the POSIX one
+     */
+
+    char *names[] = {"real", "user", "sys"};
+    long long times[] = {real_ns, user_ns, sys_ns};
+    long long ms;
+
+    if (format == TIME_POSIX) {
+        for (int i = 0; i < 3; i++) {
+            fprintf(stderr, "%s %lld.%02lld\n", names[i], times[i] / 1000000000, times[i] / 10000000 % 100);
+        }
+        return;
+    }
+
+    fputc('\n', stderr);
+    for (int i = 0; i < 3; i++) {
+        ms = times[i] / 1000000;
+        fprintf(stderr, "%s\t%lldm%lld.%03llds\n", names[i], ms / 60000, ms / 1000 % 60, ms % 1000);
+    }
+}
+
+void
+trace_job(struct job *job)
+{
+    /*
+     * function to append the trace records of a finished job: one JSON line per stage that was
+     * started, then one for the whole pipeline. times are in microseconds, wall time runs from
+     * the spawn to the reap
+     */
+
+    struct process *proc;
+    struct timespec now;
+    long long end_ns = job->start_ns, user_ns = 0, sys_ns = 0, mono_ns = now_ns();
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    for (int i = 0; i < job->num_procs; i++) {
+        proc = &job->procs[i];
+        user_ns += timeval_ns(&proc->rusage.ru_utime);
+        sys_ns += timeval_ns(&proc->rusage.ru_stime);
+        end_ns = proc->end_ns > end_ns ? proc->end_ns : end_ns;
+        if (proc->pid < 0) {
+            continue;
+        }
+
+        fprintf(trace_file, "{\"type\":\"stage\",\"job\":%d,\"stage\":%d,\"pid\":%d,\"cmd\":",
+                job->id, i, (int)proc->pid);
+        trace_string(proc->name);
+        if (proc->cpu >= 0) {
+            fprintf(trace_file, ",\"cpu\":%d", proc->cpu);
+        }
+        fprintf(trace_file, ",\"spawn_us\":%lld,\"exec_us\":", proc->spawn_ns / 1000);
+        if (proc->exec_ns < 0) {
+            fprintf(trace_file, "null");
+        }
+        else {
+            fprintf(trace_file, "%lld", proc->exec_ns / 1000);
+        }
+        fprintf(trace_file, ",\"wall_us\":%lld,\"user_us\":%lld,\"sys_us\":%lld,\"maxrss_kb\":%ld,"
+                "\"nvcsw\":%ld,\"nivcsw\":%ld,\"status\":%d}\n",
+                (proc->end_ns - proc->start_ns) / 1000, timeval_ns(&proc->rusage.ru_utime) / 1000,
+                timeval_ns(&proc->rusage.ru_stime) / 1000, proc->rusage.ru_maxrss,
+                proc->rusage.ru_nvcsw, proc->rusage.ru_nivcsw, exit_status(proc->status));
+    }
+
+    fprintf(trace_file, "{\"type\":\"pipeline\",\"job\":%d,\"ts_us\":%lld,\"cmd\":", job->id,
+            (now.tv_sec * 1000000000LL + now.tv_nsec - (mono_ns - job->start_ns)) / 1000);
+    trace_string(job->command != NULL ? job->command : "");
+    fprintf(trace_file, ",\"stages\":%d,\"background\":%s,\"parse_us\":%lld,\"spawn_us\":%lld,"
+            "\"wall_us\":%lld,\"user_us\":%lld,\"sys_us\":%lld,\"status\":%d}\n",
+            job->num_procs, job->background ? "true" : "false", job->parse_ns / 1000, job->spawn_ns / 1000,
+            (end_ns - job->start_ns) / 1000, user_ns / 1000, sys_ns / 1000,
+            exit_status(job->procs[job->num_procs - 1].status));
+
+    // children forked later must not inherit buffered records
+    fflush(trace_file);
+}
+
+void
+trace_builtin(struct command *cmd, long long wall_ns, struct rusage before[2], struct rusage after[2], int status)
+{
+    /*
+     * function to append the trace record of a builtin that ran inside the shell
+     *
+     * args:
+     *  struct command *cmd: the builtin
+     *  long long wall_ns: how long it ran
+     *  struct rusage before[2], after[2]: shell_usage before and after it ran
+     *  int status: its exit status
+     */
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    fprintf(trace_file, "{\"type\":\"builtin\",\"ts_us\":%lld,\"cmd\":",
+            (now.tv_sec * 1000000000LL + now.tv_nsec - wall_ns) / 1000);
+    trace_string(cmd->argc > 0 ? cmd->argv[0] : "");
+    fprintf(trace_file, ",\"parse_us\":%lld,\"wall_us\":%lld,\"user_us\":%lld,\"sys_us\":%lld,"
+            "\"nvcsw\":%ld,\"nivcsw\":%ld,\"status\":%d}\n",
+            line_parse_ns / 1000, wall_ns / 1000, (usage_ns(after, 0) - usage_ns(before, 0)) / 1000,
+            (usage_ns(after, 1) - usage_ns(before, 1)) / 1000,
+            after[0].ru_nvcsw - before[0].ru_nvcsw, after[0].ru_nivcsw - before[0].ru_nivcsw, status);
+    line_parse_ns = 0;
+    fflush(trace_file);
+}
+
+void
+trace_string(char *str)
+{
+    /*
+     * helper function to write str to the trace as a JSON string
+     */
+
+    fputc('"', trace_file);
+    for (; *str != 0; str++) {
+        if (*str == '"' || *str == '\\') {
+            fprintf(trace_file, "\\%c", *str);
+        }
+        else if ((unsigned char)*str < 0x20) {
+            fprintf(trace_file, "\\u%04x", (unsigned char)*str);
+        }
+        else {
+            fputc(*str, trace_file);
+        }
+    }
+    fputc('"', trace_file);
+}
+
+char **
+sh_fallback_argv(struct command *cmd)
+{
+    /*
+     * helper function to build the argv for running cmd->path as a /bin/sh script
+     *
+     * returns:
+     *  malloc'd, NULL terminated argv
+     */
+
+    char **sh_argv;
+
+    if ((sh_argv = malloc((cmd->argc + 2) * sizeof(char *))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    sh_argv[0] = "/bin/sh";
+    sh_argv[1] = cmd->path;
+    memcpy(sh_argv + 2, cmd->argv + 1, cmd->argc * sizeof(char *));
+    return sh_argv;
+}
+
+unsigned long
+hash_string(char *str)
+{
+    /*
+     * helper function computing the FNV-1a hash of a string
+     */
+
+    unsigned long hash = 14695981039346656037UL;
+
+    while (*str) {
+        hash = (hash ^ (unsigned char)*str++) * 1099511628211UL;
+    }
+    return hash;
+}
+
+struct path_entry *
+path_table_find(char *name)
+{
+    /*
+     * helper function to find the slot name lives in, or the empty slot it would be inserted at
+     *
+     * returns:
+     *  pointer to the slot, never NULL since the table is never allowed to fill up
+     */
+
+    size_t mask = path_table.num_slots - 1;
+    size_t i = hash_string(name) & mask;
+
+    while (path_table.slots[i].name != NULL && strcmp(path_table.slots[i].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &path_table.slots[i];
+}
+
+char *
+lookup_command(char *name)
+{
+    /*
+     * function to resolve a command name to the file that should be executed, searching PATH only
+     * the first time a name is seen. the whole table is dropped whenever PATH changes
+     *
+     * args:
+     *  char *name: argv[0] of the command
+     *
+     * returns:
+     *  path to execute (owned by the table, or name itself when it contains a slash), NULL if not found
+     */
+
+    struct path_entry *entry, *old_slots;
+    size_t old_num_slots;
+    char *path, *path_var = get_var("PATH");
+
+    // names with a slash are never looked up in PATH
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    if (path_var == NULL) {
+        path_var = DEFAULT_PATH;
+    }
+    if (path_table.path_var != NULL && strcmp(path_table.path_var, path_var) != 0) {
+        path_table_clear();
+    }
+
+    if (path_table.slots != NULL) {
+        entry = path_table_find(name);
+        if (entry->name != NULL) {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    if ((path = search_path(name, X_OK)) == NULL) {
+        return NULL;
+    }
+
+    // keep the table at most half full so probe sequences stay short
+    if (path_table.slots == NULL || 2 * (path_table.count + 1) > path_table.num_slots) {
+        old_slots = path_table.slots;
+        old_num_slots = path_table.num_slots;
+
+        path_table.num_slots = old_slots == NULL ? PATH_TABLE_INITIAL_SLOTS : 2 * old_num_slots;
+        if ((path_table.slots = calloc(path_table.num_slots, sizeof(struct path_entry))) == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < old_num_slots; i++) {
+            if (old_slots[i].name != NULL) {
+                *path_table_find(old_slots[i].name) = old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+    if (path_table.path_var == NULL && (path_table.path_var = strdup(path_var)) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+
+    entry = path_table_find(name);
+    if ((entry->name = strdup(name)) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    entry->path = path;
+    entry->hits = 1;
+    path_table.count++;
+    return path;
+}
+
+char *
+lookup_command_path(struct command *cmd)
+{
+    /*
+     * function to resolve argv[0] of a command about to be started. a PATH=... in front of the
+     * command is what it is looked up in, the way execvp in the child would see it. that search
+     * goes straight to the directories and is not hashed, the table only ever holds the
+     * shell's own PATH
+     *
+     * returns:
+     *  path to execute, NULL if not found. one found through an assignment is only valid until
+     *  the next call
+     */
+
+    static char *found;        // the last path found through a PATH assignment
+    struct assign *assign;
+    char *path_var = NULL;
+
+    for (assign = cmd->assigns; assign != NULL; assign = assign->next) {
+        if (strcmp(assign->name, "PATH") == 0) {
+            path_var = assign->value;
+        }
+    }
+    if (path_var == NULL || strchr(cmd->argv[0], '/') != NULL) {
+        return lookup_command(cmd->argv[0]);
+    }
+    free(found);
+    found = search_dirs(path_var, cmd->argv[0], X_OK);
+    return found;
+}
+
+char *
+search_path(char *name, int mode)
+{
+    /*
+     * helper function to walk the PATH directories looking for a regular file we can access with
+     * mode: X_OK for commands, R_OK for files to run with .
+     *
+     * returns:
+     *  malloc'd path of the first match, or NULL if there is none
+     */
+
+    char *path_var = get_var("PATH");
+
+    return search_dirs(path_var != NULL ? path_var : DEFAULT_PATH, name, mode);
+}
+
+char *
+search_dirs(char *path_var, char *name, int mode)
+{
+    /*
+     * helper function to look for name in the directories of a PATH value, see search_path
+     *
+     * returns:
+     *  malloc'd path of the first match, or NULL if there is none
+     */
+
+    char *dir, *end, *path;
+    size_t dir_len, name_len = strlen(name);
+    struct stat st;
+
+    for (dir = path_var; ; dir = end + 1) {
+        end = strchrnul(dir, ':');
+        dir_len = end - dir;
+
+        // an empty PATH entry means the current directory
+        if ((path = malloc(dir_len + name_len + 3)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        if (dir_len == 0) {
+            sprintf(path, "./%s", name);
+        }
+        else {
+            sprintf(path, "%.*s/%s", (int)dir_len, dir, name);
+        }
+
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, mode) == 0) {
+            return path;
+        }
+        free(path);
+
+        if (*end == 0) {
+            return NULL;
+        }
+    }
+}
+
+void
+path_table_forget(char *name)
+{
+    /*
+     * helper function to drop a single name from the table. entries after it in the same probe
+     * sequence are shifted back so that lookups never stop at the hole
+     */
+
+    struct path_entry *entry;
+    size_t mask, hole, i, home;
+
+    if (path_table.slots == NULL || (entry = path_table_find(name))->name == NULL) {
+        return;
+    }
+
+    free(entry->name);
+    free(entry->path);
+    entry->name = NULL;
+    path_table.count--;
+
+    mask = path_table.num_slots - 1;
+    hole = entry - path_table.slots;
+    for (i = (hole + 1) & mask; path_table.slots[i].name != NULL; i = (i + 1) & mask) {
+        home = hash_string(path_table.slots[i].name) & mask;
+        // move the entry into the hole unless its home slot lies cyclically in (hole, i]
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            path_table.slots[hole] = path_table.slots[i];
+            path_table.slots[i].name = NULL;
+            hole = i;
+        }
+    }
+}
+
+void
+path_table_clear()
+{
+    /*
+     * helper function to forget every remembered command, used by hash -r and when PATH changes
+     */
+
+    for (size_t i = 0; i < path_table.num_slots; i++) {
+        if (path_table.slots[i].name != NULL) {
+            free(path_table.slots[i].name);
+            free(path_table.slots[i].path);
+            path_table.slots[i].name = NULL;
+        }
+    }
+    path_table.count = 0;
+    free(path_table.path_var);
+    path_table.path_var = NULL;
+}
+
+void
+init_vars(char *argv0)
+{
+    /*
+     * function to fill the variable table from the environment the shell was started with.
+     * everything in it stays exported
+     */
+
+    char *eq;
+
+    vars.num_slots = VAR_TABLE_INITIAL_SLOTS;
+    if ((vars.slots = calloc(vars.num_slots, sizeof(struct var))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (char **env = environ; *env != NULL; env++) {
+        if ((eq = strchr(*env, '=')) != NULL && valid_name(*env, eq)) {
+            *eq = 0;
+            set_var(*env, eq + 1, VAR_EXPORTED);
+            *eq = '=';
+        }
+    }
+
+    shell_pid = getpid();
+    // $0 until a script or -c says otherwise
+    positional = default_positional;
+    default_positional[0] = argv0;
+    num_positional = 0;
+}
+
+unsigned long
+hash_bytes(char *str, size_t len)
+{
+    /*
+     * helper function computing the FNV-1a hash of len bytes, for names that are not terminated
+     */
+
+    unsigned long hash = 14695981039346656037UL;
+
+    while (len-- > 0) {
+        hash = (hash ^ (unsigned char)*str++) * 1099511628211UL;
+    }
+    return hash;
+}
+
+struct var *
+var_find(char *name, size_t len)
+{
+    /*
+     * helper function to find the slot a variable lives in, or the empty slot it would be inserted at
+     *
+     * returns:
+     *  pointer to the slot, never NULL since the table is never allowed to fill up
+     */
+
+    size_t mask = vars.num_slots - 1;
+    size_t i = hash_bytes(name, len) & mask;
+
+    while (vars.slots[i].name != NULL &&
+            (vars.slots[i].name_len != len || memcmp(vars.slots[i].name, name, len) != 0)) {
+        i = (i + 1) & mask;
+    }
+    return &vars.slots[i];
+}
+
+char *
+get_var(char *name)
+{
+    /*
+     * function to look up the value of a shell variable
+     *
+     * returns:
+     *  the value, owned by the table and valid until the variable changes. NULL if it is unset
+     */
+
+    return get_var_len(name, strlen(name));
+}
+
+char *
+get_var_len(char *name, size_t len)
+{
+    /*
+     * helper function for get_var, with a name that does not have to be terminated
+     */
+
+    struct var *var = var_find(name, len);
+
+    return var->name == NULL || var->pair == NULL ? NULL : var->pair + len + 1;
+}
+
+void
+set_var(char *name, char *value, int flags)
+{
+    /*
+     * function to set a shell variable
+     *
+     * args:
+     *  char *name: a valid name
+     *  char *value: the new value, NULL to only change the flags
+     *  int flags: VAR_ flags to add, a variable that is exported stays exported
+     */
+
+    struct var *var, *old_slots;
+    size_t old_num_slots, len = strlen(name), value_len;
+
+    var = var_find(name, len);
+    if (var->name == NULL) {
+        // keep the table at most half full so probe sequences stay short
+        if (2 * (vars.count + 1) > vars.num_slots) {
+            old_slots = vars.slots;
+            old_num_slots = vars.num_slots;
+            vars.num_slots *= 2;
+            if ((vars.slots = calloc(vars.num_slots, sizeof(struct var))) == NULL) {
+                perror("calloc");
+                exit(1);
+            }
+            for (size_t i = 0; i < old_num_slots; i++) {
+                if (old_slots[i].name != NULL) {
+                    *var_find(old_slots[i].name, old_slots[i].name_len) = old_slots[i];
+                }
+            }
+            free(old_slots);
+            var = var_find(name, len);
+        }
+        if ((var->name = strdup(name)) == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+        var->name_len = len;
+        var->pair = NULL;
+        var->flags = 0;
+        vars.count++;
+    }
+
+    if (value != NULL) {
+        // value may point into the old pair (x=$x), so build the new one before freeing it
+        value_len = strlen(value);
+        char *pair = malloc(len + value_len + 2);
+        if (pair == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(pair, name, len);
+        pair[len] = '=';
+        memcpy(pair + len + 1, value, value_len + 1);
+        free(var->pair);
+        var->pair = pair;
+    }
+    if ((var->flags | flags) & VAR_EXPORTED) {
+        env_dirty = 1;
+    }
+    var->flags |= flags;
+}
+
+void
+unset_var(char *name)
+{
+    /*
+     * function to remove a shell variable. entries after it in the same probe sequence are
+     * shifted back so that lookups never stop at the hole, like in path_table_forget
+     */
+
+    struct var *var = var_find(name, strlen(name));
+    size_t mask, hole, i, home;
+
+    if (var->name == NULL) {
+        return;
+    }
+    if (var->flags & VAR_EXPORTED) {
+        env_dirty = 1;
+    }
+    free(var->name);
+    free(var->pair);
+    var->name = NULL;
+    vars.count--;
+
+    mask = vars.num_slots - 1;
+    hole = var - vars.slots;
+    for (i = (hole + 1) & mask; vars.slots[i].name != NULL; i = (i + 1) & mask) {
+        home = hash_bytes(vars.slots[i].name, vars.slots[i].name_len) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            vars.slots[hole] = vars.slots[i];
+            vars.slots[i].name = NULL;
+            hole = i;
+        }
+    }
+}
+
+char **
+get_envp()
+{
+    /*
+     * function to get the environment for children: the exported variables that have a value.
+     * the array only points at the pairs in the table, and is rebuilt only after an exported
+     * variable changed, so starting a command normally costs nothing here
+     *
+     * returns:
+     *  NULL-terminated array, owned by the cache
+     */
+
+    size_t n = 0;
+
+    if (!env_dirty) {
+        return env_cache;
+    }
+    free(env_cache);
+    if ((env_cache = malloc((vars.count + 1) * sizeof(char *))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < vars.num_slots; i++) {
+        if (vars.slots[i].name != NULL && vars.slots[i].pair != NULL && (vars.slots[i].flags & VAR_EXPORTED)) {
+            env_cache[n++] = vars.slots[i].pair;
+        }
+    }
+    env_cache[n] = NULL;
+    env_dirty = 0;
+    return env_cache;
+}
+
+char **
+command_envp(struct command *cmd)
+{
+    /*
+     * function to get the environment for one command, which is the cached one unless NAME=value
+     * assignments come before it. then a copy is made, in a single block, with the assigned
+     * variables replacing exported ones of the same name
+     *
+     * returns:
+     *  NULL-terminated array, which the caller frees if it is not env_cache
+     */
+
+    struct assign *assign, *later;
+    char **envp = get_envp(), **out, *str, *eq;
+    size_t num_env, num_assigns = 0, size;
+
+    if (cmd->assigns == NULL) {
+        return envp;
+    }
+
+    for (num_env = 0; envp[num_env] != NULL; num_env++);
+    size = 0;
+    for (assign = cmd->assigns; assign != NULL; assign = assign->next) {
+        num_assigns++;
+        size += strlen(assign->name) + strlen(assign->value) + 2;
+    }
+    if ((out = malloc((num_env + num_assigns + 1) * sizeof(char *) + size)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    str = (char *)(out + num_env + num_assigns + 1);
+
+    size = 0;
+    for (size_t i = 0; i < num_env; i++) {
+        eq = strchr(envp[i], '=');
+        for (assign = cmd->assigns; assign != NULL; assign = assign->next) {
+            if (strlen(assign->name) == (size_t)(eq - envp[i]) && memcmp(assign->name, envp[i], eq - envp[i]) == 0) {
+                break;
+            }
+        }
+        if (assign == NULL) {
+            out[size++] = envp[i];
+        }
+    }
+    for (assign = cmd->assigns; assign != NULL; assign = assign->next) {
+        // with A=1 A=2, the last one wins
+        for (later = assign->next; later != NULL; later = later->next) {
+            if (strcmp(later->name, assign->name) == 0) {
+                break;
+            }
+        }
+        if (later == NULL) {
+            out[size++] = str;
+            str += sprintf(str, "%s=%s", assign->name, assign->value) + 1;
+        }
+    }
+    out[size] = NULL;
+    return out;
+}
+
+int
+compare_vars(const void *a, const void *b)
+{
+    /*
+     * helper function to order variables by name for qsort
+     */
+
+    return strcmp((*(struct var **)a)->name, (*(struct var **)b)->name);
+}
+
+struct builtin *
+find_builtin(char **argv)
+{
+    /*
+     * helper function to look a command up in the builtin table
+     *
+     * args:
+     *  char **argv: the command's arguments, argv[0] is the name
+     *
+     * returns:
+     *  the builtin, or NULL if the command has to be run as an external program
+     */
+
+    struct builtin *builtin;
+
+    builtin = bsearch(argv[0], builtins, sizeof(builtins) / sizeof(builtins[0]), sizeof(struct builtin), compare_builtin);
+    if (builtin != NULL && builtin->handles != NULL && !builtin->handles(argv)) {
+        return NULL;
+    }
+    return builtin;
+}
+
+int
+compare_builtin(const void *name, const void *builtin)
+{
+    return strcmp(name, ((struct builtin *)builtin)->name);
+}
+
+int
+run_builtin(struct command *cmd)
+{
+    /*
+     * function to run a builtin (or an entry with only redirections) inside the shell process.
+     * redirections are applied to the shell's own descriptors and undone afterwards
+     *
+     * args:
+     *  struct command *cmd: the entry, with cmd->builtin set unless cmd->argc is 0
+     *
+     * returns:
+     *  exit status of the builtin, 1 if a redirection failed
+     */
+
+    int saved_fds[SAVED_FDS];
+    int status;
+    struct assign *assign;
+    char **saved = NULL;
+
+    // output buffered so far belongs to the old stdout
+    fflush(stdout);
+
+    for (int fd = 0; fd < SAVED_FDS; fd++) {
+        saved_fds[fd] = -1;
+    }
+
+    // inside $(...) nothing reads the capture pipe while the builtin runs, so its output goes
+    // into a memfd instead. what the children wrote before it comes first
+    if (current_capture != NULL) {
+        capture_read(current_capture);
+        if (current_capture->memfd < 0 && (current_capture->memfd = memfd_create("mysh-capture", MFD_CLOEXEC)) < 0) {
+            perror("memfd_create");
+            return 1;
+        }
+        if ((saved_fds[1] = fcntl(1, F_DUPFD_CLOEXEC, SAVED_FDS)) < 0) {
+            saved_fds[1] = -2;
+        }
+        dup2(current_capture->memfd, 1);
+    }
+
+    if (redirect_here(cmd->redirs, saved_fds) < 0) {
+        restore_fds(saved_fds);
+        if (current_capture != NULL) {
+            capture_memfd(current_capture);
+        }
+        return 1;
+    }
+
+    // assignments on their own set shell variables. in front of a builtin they only last as
+    // long as the builtin runs
+    if (cmd->argc == 0) {
+        for (assign = cmd->assigns; assign != NULL; assign = assign->next) {
+            set_var(assign->name, assign->value, 0);
+        }
+    }
+    else {
+        saved = save_assigns(cmd->assigns);
+    }
+
+    // without a command, the status is that of the last $(...) in the assignments, if any
+    status = cmd->argc == 0 ? (subst_status >= 0 ? subst_status : 0) : cmd->builtin->func(cmd->argv);
+
+    if (cmd->argc > 0) {
+        restore_assigns(cmd->assigns, saved);
+    }
+
+    fflush(stdout);
+    restore_fds(saved_fds);
+    if (current_capture != NULL) {
+        capture_memfd(current_capture);
+    }
+    return status;
+}
+
+char **
+save_assigns(struct assign *assigns)
+{
+    /*
+     * helper function to make the assignments in front of a builtin or a function call, which
+     * only last as long as it runs
+     *
+     * returns:
+     *  malloc'd copies of the old values (NULL where a variable was unset), for restore_assigns
+     */
+
+    struct assign *assign;
+    char **saved = NULL, *value;
+    int num_saved = 0;
+
+    for (assign = assigns; assign != NULL; assign = assign->next) {
+        if ((saved = realloc(saved, (num_saved + 1) * sizeof(char *))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        value = get_var(assign->name);
+        if (value != NULL && (value = strdup(value)) == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+        saved[num_saved++] = value;
+        set_var(assign->name, assign->value, 0);
+    }
+    return saved;
+}
+
+void
+restore_assigns(struct assign *assigns, char **saved)
+{
+    /*
+     * helper function to put back the values save_assigns replaced. they go back last first, so
+     * a name assigned twice ends up with the value from before both
+     */
+
+    struct assign *assign;
+    int num_saved = 0, i;
+
+    for (assign = assigns; assign != NULL; assign = assign->next) {
+        num_saved++;
+    }
+    while (num_saved-- > 0) {
+        for (assign = assigns, i = 0; i < num_saved; assign = assign->next, i++);
+        if (saved[num_saved] != NULL) {
+            set_var(assign->name, saved[num_saved], 0);
+            free(saved[num_saved]);
+        }
+        else {
+            unset_var(assign->name);
+        }
+    }
+    free(saved);
+}
+
+struct function *
+find_function(char *name)
+{
+    /*
+     * helper function to look a command up in the function table
+     *
+     * returns:
+     *  the function, NULL if there is none by that name
+     */
+
+    struct function *function;
+
+    if (num_functions == 0) {
+        return NULL;
+    }
+    function = functions[hash_string(name) & (FUNCTION_BUCKETS - 1)];
+    while (function != NULL && strcmp(function->name, name) != 0) {
+        function = function->next;
+    }
+    return function;
+}
+
+void
+define_function(char *name, struct command *body)
+{
+    /*
+     * function to define a shell function, replacing one of the same name. the body is copied
+     * out of the tree it was parsed into, which is usually gone once its line has run
+     *
+     * args:
+     *  char *name: the function's name
+     *  struct command *body: the compound command it runs, with its redirections
+     */
+
+    struct function *function, **bucket = &functions[hash_string(name) & (FUNCTION_BUCKETS - 1)];
+    size_t len = strlen(name) + 1;
+
+    remove_function(name);
+    if ((function = calloc(1, sizeof(struct function))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    function->name = memcpy(arena_alloc(&function->arena, len), name, len);
+    function->body = copy_command(&function->arena, body);
+    function->next = *bucket;
+    *bucket = function;
+    num_functions++;
+}
+
+int
+remove_function(char *name)
+{
+    /*
+     * helper function to take a function out of the table, for unset -f and redefinitions. a
+     * function that is still running is only freed once its last call returns
+     *
+     * returns:
+     *  1 if there was such a function, 0 otherwise
+     */
+
+    struct function *function, **link = &functions[hash_string(name) & (FUNCTION_BUCKETS - 1)];
+
+    while ((function = *link) != NULL && strcmp(function->name, name) != 0) {
+        link = &function->next;
+    }
+    if (function == NULL) {
+        return 0;
+    }
+    *link = function->next;
+    num_functions--;
+    function->stale = 1;
+    release_function(function);
+    return 1;
+}
+
+void
+release_function(struct function *function)
+{
+    /*
+     * helper function to free a function that was removed, once nothing runs it any more
+     */
+
+    if (function->stale && function->users == 0) {
+        arena_free(&function->arena);
+        free(function);
+    }
+}
+
+int
+call_function(struct arena *arena, struct command *cmd)
+{
+    /*
+     * function to run a shell function in the current process, with the command's arguments
+     * as the positional parameters meanwhile ($0 stays what it was). loops around the call
+     * cannot be left with break from inside it
+     *
+     * args:
+     *  struct arena *arena: arena of the current line, which expanded words are allocated from
+     *  struct command *cmd: the call, with cmd->function set
+     *
+     * returns:
+     *  the status of the last command it ran, or the one given to return
+     */
+
+    struct function *function = cmd->function;
+    struct command *body = function->body;
+    char **saved_positional = positional;
+    int saved_num_positional = num_positional, saved_loop_depth = loop_depth;
+
+    if (function_depth == FUNCTION_MAX_DEPTH) {
+        shell_error("%s: maximum function nesting level exceeded (%d)", cmd->argv[0], FUNCTION_MAX_DEPTH);
+        return last_status = 1;
+    }
+
+    positional = arena_alloc(arena, (cmd->argc + 1) * sizeof(char *));
+    positional[0] = saved_positional[0];
+    memcpy(positional + 1, cmd->argv + 1, cmd->argc * sizeof(char *));
+    num_positional = cmd->argc - 1;
+
+    function->users++;
+    function_depth++;
+    loop_depth = 0;
+    if (body->expand && (body = expand_command(arena, body)) == NULL) {
+        last_status = 1;
+    }
+    else {
+        run_compound(arena, body);
+    }
+    loop_depth = saved_loop_depth;
+    function_depth--;
+    returning = 0;
+    function->users--;
+    release_function(function);
+
+    positional = saved_positional;
+    num_positional = saved_num_positional;
+    return last_status;
+}
+
+struct command *
+copy_command(struct arena *arena, struct command *cmd)
+{
+    /*
+     * helper function to copy a parsed command (and the commands after it in its pipeline), with
+     * everything it points to, into another arena
+     *
+     * returns:
+     *  the copy, NULL for a NULL cmd
+     */
+
+    struct command *copy;
+    struct redir *redir, **redir_tail;
+    struct assign *assign, **assign_tail;
+
+    if (cmd == NULL) {
+        return NULL;
+    }
+    copy = arena_alloc(arena, sizeof(struct command));
+    *copy = *cmd;
+    copy->next = copy_command(arena, cmd->next);
+    copy->path = NULL;
+    copy->builtin = NULL;
+    copy->function = NULL;
+
+    copy->argv = arena_alloc(arena, (cmd->argc + 1) * sizeof(char *));
+    for (int i = 0; i < cmd->argc; i++) {
+        copy->argv[i] = copy_string(arena, cmd->argv[i]);
+    }
+    copy->argv[cmd->argc] = NULL;
+
+    for (redir = cmd->redirs, redir_tail = &copy->redirs; redir != NULL; redir = redir->next) {
+        *redir_tail = arena_alloc(arena, sizeof(struct redir));
+        **redir_tail = *redir;
+        (*redir_tail)->path = copy_string(arena, redir->path);
+        (*redir_tail)->body = copy_string(arena, redir->body);
+        (*redir_tail)->next_heredoc = NULL;
+        redir_tail = &(*redir_tail)->next;
+    }
+    *redir_tail = NULL;
+
+    for (assign = cmd->assigns, assign_tail = &copy->assigns; assign != NULL; assign = assign->next) {
+        *assign_tail = arena_alloc(arena, sizeof(struct assign));
+        (*assign_tail)->name = copy_string(arena, assign->name);
+        (*assign_tail)->value = copy_string(arena, assign->value);
+        assign_tail = &(*assign_tail)->next;
+    }
+    *assign_tail = NULL;
+
+    copy->body = copy_node(arena, cmd->body);
+    return copy;
+}
+
+struct node *
+copy_node(struct arena *arena, struct node *node)
+{
+    /*
+     * helper function to copy a command tree (and the commands after it in its list) into
+     * another arena, for copy_command
+     *
+     * returns:
+     *  the copy, NULL for a NULL node
+     */
+
+    struct node *copy;
+
+    if (node == NULL) {
+        return NULL;
+    }
+    copy = arena_alloc(arena, sizeof(struct node));
+    *copy = *node;
+    copy->next = copy_node(arena, node->next);
+    if (node->pipeline != NULL) {
+        copy->pipeline = arena_alloc(arena, sizeof(struct pipeline));
+        *copy->pipeline = *node->pipeline;
+        copy->pipeline->commands = copy_command(arena, node->pipeline->commands);
+        copy->pipeline->limits = copy_command(arena, node->pipeline->limits);
+        copy->pipeline->timeout = copy_command(arena, node->pipeline->timeout);
+    }
+    copy->cond = copy_node(arena, node->cond);
+    copy->body = copy_node(arena, node->body);
+    copy->orelse = copy_node(arena, node->orelse);
+    copy->name = copy_string(arena, node->name);
+    copy->words = copy_command(arena, node->words);
+    copy->function = copy_command(arena, node->function);
+    return copy;
+}
+
+char *
+copy_string(struct arena *arena, char *str)
+{
+    size_t len;
+
+    if (str == NULL) {
+        return NULL;
+    }
+    len = strlen(str) + 1;
+    return memcpy(arena_alloc(arena, len), str, len);
+}
+
+int
+redirect_here(struct redir *redirs, int saved_fds[SAVED_FDS])
+{
+    /*
+     * helper function to apply redirections to the shell itself, remembering the original
+     * descriptors in saved_fds so restore_fds can put them back. a slot is -1 while its
+     * descriptor is untouched, and -2 if it was not open to begin with
+     *
+     * returns:
+     *  0 on success, -1 if a redirection failed (message is printed)
+     */
+
+    struct redir *redir;
+    int target;
+
+    for (redir = redirs; redir != NULL; redir = redir->next) {
+        target = redir->fd;
+
+        // keep the original out of the way of the builtin and of any children it might start
+        if (saved_fds[target] == -1 && (saved_fds[target] = fcntl(target, F_DUPFD_CLOEXEC, SAVED_FDS)) < 0) {
+            if (errno != EBADF) {
+                perror("fcntl");
+                return -1;
+            }
+            saved_fds[target] = -2;
+        }
+        if (apply_redir(redir) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void
+restore_fds(int saved_fds[SAVED_FDS])
+{
+    /*
+     * helper function to undo redirect_here
+     */
+
+    for (int fd = 0; fd < SAVED_FDS; fd++) {
+        if (saved_fds[fd] >= 0) {
+            dup2(saved_fds[fd], fd);
+            close(saved_fds[fd]);
+        }
+        else if (saved_fds[fd] == -2) {
+            close(fd);
+        }
+    }
+}
+
+int
+builtin_colon(char **argv)
+{
+    /*
+     * the : and true builtins, which do nothing successfully
+     */
+
+    return 0;
+}
+
+int
+builtin_false(char **argv)
+{
+    return 1;
+}
+
+int
+builtin_exit(char **argv)
+{
+    /*
+     * the exit builtin. exits with the given status, or with the status of the last command
+     */
+
+    char *end;
+    long status = last_status;
+
+    if (argv[1] != NULL) {
+        status = strtol(argv[1], &end, 10);
+        if (*argv[1] == 0 || *end != 0) {
+            shell_error("exit: %s: numeric argument required", argv[1]);
+            status = 2;
+        }
+    }
+    exit(status & 0xff);
+}
+
+int
+builtin_cd(char **argv)
+{
+    /*
+     * the cd builtin. changes to the given directory, $HOME without one, or $OLDPWD for `cd -`,
+     * and keeps PWD and OLDPWD up to date
+     */
+
+    char *dir = argv[1], *old_pwd = get_var("PWD");
+    char cwd[PATH_MAX];
+    int print = 0;
+
+    if (dir == NULL && (dir = get_var("HOME")) == NULL) {
+        shell_error("cd: HOME not set");
+        return 1;
+    }
+    if (strcmp(dir, "-") == 0) {
+        if ((dir = get_var("OLDPWD")) == NULL) {
+            shell_error("cd: OLDPWD not set");
+            return 1;
+        }
+        print = 1;
+    }
+
+    if (chdir(dir) < 0) {
+        shell_error("cd: %s: %s", dir, strerror(errno));
+        return 1;
+    }
+
+    // set_var copies, so old_pwd can be read before PWD is overwritten
+    if (old_pwd != NULL) {
+        set_var("OLDPWD", old_pwd, VAR_EXPORTED);
+    }
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        set_var("PWD", cwd, VAR_EXPORTED);
+        if (print) {
+            printf("%s\n", cwd);
+        }
+    }
+    return 0;
+}
+
+int
+builtin_pwd(char **argv)
+{
+    char cwd[PATH_MAX];
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        shell_error("pwd: %s", strerror(errno));
+        return 1;
+    }
+    printf("%s\n", cwd);
+    return 0;
+}
+
+int
+builtin_export(char **argv)
+{
+    /*
+     * the export builtin. NAME=value sets a variable and puts it in the environment of every
+     * command started from now on, a bare NAME exports the variable as it is. no arguments
+     * (or -p) lists the exported variables, sorted by name
+     */
+
+    struct var **list;
+    char *eq;
+    int status = 0, n = 0;
+
+    if (argv[1] == NULL || (strcmp(argv[1], "-p") == 0 && argv[2] == NULL)) {
+        if ((list = malloc((vars.count + 1) * sizeof(struct var *))) == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        for (size_t i = 0; i < vars.num_slots; i++) {
+            if (vars.slots[i].name != NULL && (vars.slots[i].flags & VAR_EXPORTED)) {
+                list[n++] = &vars.slots[i];
+            }
+        }
+        qsort(list, n, sizeof(struct var *), compare_vars);
+        for (int i = 0; i < n; i++) {
+            if (list[i]->pair == NULL) {
+                printf("export %s\n", list[i]->name);
+            }
+            else {
+                printf("export %s=\"%s\"\n", list[i]->name, list[i]->pair + list[i]->name_len + 1);
+            }
+        }
+        free(list);
+        return 0;
+    }
+
+    for (argv++; *argv != NULL; argv++) {
+        eq = strchr(*argv, '=');
+        if (!valid_name(*argv, eq)) {
+            shell_error("export: `%s': not a valid identifier", *argv);
+            status = 1;
+            continue;
+        }
+        if (eq != NULL) {
+            *eq = 0;
+            set_var(*argv, eq + 1, VAR_EXPORTED);
+            *eq = '=';
+        }
+        else {
+            set_var(*argv, NULL, VAR_EXPORTED);
+        }
+    }
+    return status;
+}
+
+int
+builtin_source(char **argv)
+{
+    /*
+     * the . and source builtins. runs the commands of a file in the shell itself, with any
+     * further arguments as the positional parameters meanwhile. a name without a slash is looked
+     * up in PATH, then in the current directory. the parsed file is cached, so sourcing it again
+     * skips straight to running it, unless the file changed in between
+     */
+
+    struct input input, *saved_input = current_input;
+    struct arena arena = {NULL, NULL};
+    struct parse_entry *entry;
+    struct parsed_line *line;
+    struct stat st;
+    char *path, **saved_positional = positional;
+    int saved_num_positional = num_positional, status = 0;
+
+    if (argv[1] == NULL) {
+        shell_error("%s: filename argument required", argv[0]);
+        return 2;
+    }
+    if (source_depth == SOURCE_MAX_DEPTH) {
+        shell_error("%s: %s: nested too deeply", argv[0], argv[1]);
+        return 1;
+    }
+    path = strchr(argv[1], '/') != NULL ? NULL : search_path(argv[1], R_OK);
+    if (stat(path != NULL ? path : argv[1], &st) < 0) {
+        shell_error("%s: %s: %s", argv[0], argv[1], strerror(errno));
+        free(path);
+        return 1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        shell_error("%s: %s: not a regular file", argv[0], argv[1]);
+        free(path);
+        return 1;
+    }
+
+    // the same path may name another file by now, or the file may have been edited
+    entry = parse_cache_find(path != NULL ? path : argv[1], 1);
+    if (entry != NULL && (entry->st.st_dev != st.st_dev || entry->st.st_ino != st.st_ino ||
+            entry->st.st_size != st.st_size || entry->st.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+            entry->st.st_mtim.tv_nsec != st.st_mtim.tv_nsec)) {
+        parse_cache_drop(entry);
+        entry = NULL;
+    }
+    if (entry == NULL && (entry = parse_file(path != NULL ? path : argv[1], &st)) == NULL) {
+        free(path);
+        return 1;
+    }
+    free(path);
+
+    if (argv[2] != NULL) {
+        positional = argv + 1;
+        for (num_positional = 0; argv[num_positional + 2] != NULL; num_positional++);
+    }
+
+    // error messages name the file and the line being run
+    memset(&input, 0, sizeof(input));
+    input.fd = -1;
+    input.name = entry->key;
+    current_input = &input;
+    entry->users++;
+    source_depth++;
+    for (line = entry->lines; line != NULL && !unwinding(); line = line->next) {
+        input.line_number = line->line_number;
+        if (line->list == NULL) {
+            status = last_status = 2;
+            continue;
+        }
+        execute_list(&arena, line->list);
+        status = last_status;
+        arena_reset(&arena);
+    }
+
+    // return only leaves the file
+    returning = 0;
+    source_depth--;
+    entry->users--;
+    parse_cache_release(entry);
+    arena_free(&arena);
+
+    current_input = saved_input;
+    positional = saved_positional;
+    num_positional = saved_num_positional;
+    return status;
+}
+
+int
+builtin_break(char **argv)
+{
+    /*
+     * the break and continue builtins. leave the innermost n loops (1 by default), continue goes
+     * on with the next round of the last of them
+     */
+
+    long count = 1;
+    char *end;
+
+    if (argv[1] != NULL) {
+        count = strtol(argv[1], &end, 10);
+        if (*argv[1] == 0 || *end != 0 || count < 1) {
+            shell_error("%s: %s: loop count out of range", argv[0], argv[1]);
+            return 1;
+        }
+    }
+    if (loop_depth == 0) {
+        shell_error("%s: only meaningful in a `for', `while', or `until' loop", argv[0]);
+        return 0;
+    }
+    if (count > loop_depth) {
+        count = loop_depth;
+    }
+    if (strcmp(argv[0], "break") == 0) {
+        breaking = count;
+    }
+    else {
+        continuing = count;
+    }
+    return 0;
+}
+
+int
+builtin_return(char **argv)
+{
+    /*
+     * the return builtin. leaves the function (or the file run with .) being run, with the given
+     * status or that of the last command
+     */
+
+    char *end;
+    long status = last_status;
+
+    if (function_depth == 0 && source_depth == 0) {
+        shell_error("return: can only `return' from a function or sourced script");
+        return 1;
+    }
+    if (argv[1] != NULL) {
+        status = strtol(argv[1], &end, 10);
+        if (*argv[1] == 0 || *end != 0) {
+            shell_error("return: %s: numeric argument required", argv[1]);
+            status = 2;
+        }
+    }
+    returning = 1;
+    return status & 0xff;
+}
+
+int
+builtin_unset(char **argv)
+{
+    /*
+     * the unset builtin. removes each named variable, exported or not, or with -f each named
+     * function
+     */
+
+    int status = 0, function = 0;
+
+    if (argv[1] != NULL && (strcmp(argv[1], "-v") == 0 || strcmp(argv[1], "-f") == 0)) {
+        function = argv[1][1] == 'f';
+        argv++;
+    }
+    for (argv++; *argv != NULL; argv++) {
+        if (function) {
+            remove_function(*argv);
+            continue;
+        }
+        if (!valid_name(*argv, NULL)) {
+            shell_error("unset: `%s': not a valid identifier", *argv);
+            status = 1;
+            continue;
+        }
+        unset_var(*argv);
+    }
+    return status;
+}
+
+int
+builtin_set(char **argv)
+{
+    /*
+     * the set builtin, for shell options. set -o (or +o) alone lists them, set -o name=value
+     * changes one and set +o name puts it back to its default
+     */
+
+    char *value, *eq;
+    int status = 0;
+
+    if (argv[1] == NULL || ((strcmp(argv[1], "-o") == 0 || strcmp(argv[1], "+o") == 0) && argv[2] == NULL)) {
+        printf("spawn\t%s\n", spawn_mode == SPAWN_FORK ? "fork" : "posix_spawn");
+        if (pipe_size == 0) {
+            printf("pipebuf\tdefault\n");
+        }
+        else {
+            printf("pipebuf\t%ld (effective %ld)\n", pipe_size, pipe_size_effective);
+        }
+        printf("trace\t%s\n", trace_path != NULL ? trace_path : "off");
+        if (pin_policy == PIN_OFF) {
+            printf("pin\toff\n");
+        }
+        else {
+            printf("pin\t%s (%d CPUs on %d nodes)\n", pin_policy == PIN_COMPACT ? "compact" : "rr", num_pin_cpus, num_pin_nodes);
+        }
+        printf("log\t%s\n", log_path != NULL ? log_path : "off");
+        return 0;
+    }
+
+    for (argv++; *argv != NULL; argv++) {
+        if (strcmp(*argv, "-o") != 0 && strcmp(*argv, "+o") != 0) {
+            shell_error("set: %s: invalid option", *argv);
+            return 2;
+        }
+        if (argv[1] == NULL) {
+            shell_error("set: %s: option name required", *argv);
+            return 2;
+        }
+        if ((*argv)[0] == '+') {
+            value = NULL;
+        }
+        else if ((eq = strchr(argv[1], '=')) != NULL) {
+            *eq = 0;
+            value = eq + 1;
+        }
+        else {
+            shell_error("set: -o %s: value required, use -o %s=value", argv[1], argv[1]);
+            return 2;
+        }
+        argv++;
+        if (set_option(*argv, value) < 0) {
+            status = 1;
+        }
+    }
+    return status;
+}
+
+int
+valid_name(char *name, char *end)
+{
+    /*
+     * helper function to check that name (up to end, or the whole string if end is NULL) is a
+     * valid variable name
+     */
+
+    char *p;
+
+    if (end == NULL) {
+        end = name + strlen(name);
+    }
+    if (name == end || (*name >= '0' && *name <= '9')) {
+        return 0;
+    }
+    for (p = name; p < end; p++) {
+        if (!(*p == '_' || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9'))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int
+builtin_echo(char **argv)
+{
+    /*
+     * the echo builtin, with bash's -n (no newline), -e (interpret escapes) and -E options
+     */
+
+    int newline = 1, escapes = 0;
+    char *opt;
+
+    // options are only options if every letter is one we know
+    for (argv++; *argv != NULL && (*argv)[0] == '-' && (*argv)[1] != 0; argv++) {
+        for (opt = *argv + 1; *opt == 'n' || *opt == 'e' || *opt == 'E'; opt++);
+        if (*opt != 0) {
+            break;
+        }
+        for (opt = *argv + 1; *opt != 0; opt++) {
+            if (*opt == 'n') {
+                newline = 0;
+            }
+            else {
+                escapes = *opt == 'e';
+            }
+        }
+    }
+
+    for (; *argv != NULL; argv++) {
+        if (escapes) {
+            // \c ends all output
+            if (print_escape(*argv, 1) < 0) {
+                return 0;
+            }
+        }
+        else {
+            fputs(*argv, stdout);
+        }
+        if (argv[1] != NULL) {
+            putchar(' ');
+        }
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    return 0;
+}
+
+int
+print_escape(char *str, int in_b)
+{
+    /*
+     * helper function to print a string with backslash escapes interpreted, as done by echo -e,
+     * printf formats and printf's %b
+     *
+     * args:
+     *  char *str: the string
+     *  int in_b: nonzero for echo -e and %b, where octal escapes are written \0NNN and \c stops output
+     *
+     * returns:
+     *  0 normally, -1 if a \c asked for output to stop
+     */
+
+    int value, digits;
+
+    for (; *str != 0; str++) {
+        if (*str != '\\' || str[1] == 0) {
+            putchar(*str);
+            continue;
+        }
+        switch (*++str) {
+        case 'a': putchar('\a'); break;
+        case 'b': putchar('\b'); break;
+        case 'e': putchar('\033'); break;
+        case 'f': putchar('\f'); break;
+        case 'n': putchar('\n'); break;
+        case 'r': putchar('\r'); break;
+        case 't': putchar('\t'); break;
+        case 'v': putchar('\v'); break;
+        case '\\': putchar('\\'); break;
+        case 'c':
+            if (in_b) {
+                return -1;
+            }
+            printf("\\c");
+            break;
+        case 'x':
+            value = digits = 0;
+            while (digits < 2 && strchr("0123456789abcdefABCDEF", str[1]) != NULL && str[1] != 0) {
+                str++;
+                value = value * 16 + (*str <= '9' ? *str - '0' : (*str | 0x20) - 'a' + 10);
+                digits++;
+            }
+            if (digits == 0) {
+                printf("\\x");
+            }
+            else {
+                putchar(value);
+            }
+            break;
+        default:
+            if (*str >= '0' && *str <= '7') {
+                // printf formats take \NNN, echo -e and %b take \0NNN
+                if (in_b && *str == '0') {
+                    str++;
+                }
+                value = digits = 0;
+                while (digits < 3 && *str >= '0' && *str <= '7') {
+                    value = value * 8 + *str++ - '0';
+                    digits++;
+                }
+                str--;
+                putchar(value);
+            }
+            else {
+                putchar('\\');
+                putchar(*str);
+            }
+        }
+    }
+    return 0;
+}
+
+int
+builtin_printf(char **argv)
+{
+    /*
+     * the printf builtin. the format is reused until every argument has been consumed
+     */
+
+    char **args;
+    int status = 0, result;
+
+    if (argv[1] == NULL) {
+        shell_error("printf: usage: printf format [arguments]");
+        return 2;
+    }
+
+    args = argv + 2;
+    do {
+        char **before = args;
+        if ((result = print_format(argv[1], &args)) < 0) {
+            return status;
+        }
+        if (result == 2) {
+            return 1;
+        }
+        status |= result;
+        // a format without conversions would otherwise loop forever
+        if (args == before) {
+            break;
+        }
+    } while (*args != NULL);
+    return status;
+}
+
+int
+print_format(char *fmt, char ***args)
+{
+    /*
+     * helper function to print a printf format once, taking arguments from *args
+     *
+     * returns:
+     *  0 on success, 1 if an argument was not a valid number, 2 on an invalid directive (the
+     *  format is not used again then), -1 if %b hit a \c
+     */
+
+    char spec[64], *start, *arg;
+    long long number;
+    double real;
+    int status = 0, len;
+
+    for (; *fmt != 0; fmt++) {
+        if (*fmt == '\\') {
+            // interpret a single escape sequence from the format
+            char escape[5] = {0};
+            int n = 1;
+            escape[0] = *fmt;
+            while (n < 4 && fmt[n] != 0 && (n == 1 || (fmt[1] >= '0' && fmt[1] <= '7' && fmt[n] >= '0' && fmt[n] <= '7'))) {
+                escape[n] = fmt[n];
+                n++;
+            }
+            if (fmt[1] == 'x') {
+                for (n = 2; n < 4 && fmt[n] != 0 && strchr("0123456789abcdefABCDEF", fmt[n]) != NULL; n++) {
+                    escape[n] = fmt[n];
+                }
+            }
+            print_escape(escape, 0);
+            fmt += n - 1;
+            continue;
+        }
+        if (*fmt != '%') {
+            putchar(*fmt);
+            continue;
+        }
+        if (fmt[1] == '%') {
+            putchar('%');
+            fmt++;
+            continue;
+        }
+
+        // copy flags, width and precision into spec so printf(3) can do the formatting
+        start = fmt++;
+        fmt += strspn(fmt, "-+ #0");
+        fmt += strspn(fmt, "0123456789");
+        if (*fmt == '.') {
+            fmt++;
+            fmt += strspn(fmt, "0123456789");
+        }
+        len = fmt - start;
+        if (*fmt == 0 || len > (int)sizeof(spec) - 4) {
+            shell_error("printf: %s: invalid format", start);
+            return 2;
+        }
+        memcpy(spec, start, len);
+
+        arg = **args != NULL ? *(*args)++ : NULL;
+        switch (*fmt) {
+        case 's':
+            strcpy(spec + len, "s");
+            printf(spec, arg != NULL ? arg : "");
+            break;
+        case 'b':
+            if (arg != NULL && print_escape(arg, 1) < 0) {
+                return -1;
+            }
+            break;
+        case 'c':
+            strcpy(spec + len, "c");
+            printf(spec, arg != NULL && *arg != 0 ? *arg : 0);
+            break;
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            if (arg != NULL && printf_number(arg, &number) < 0) {
+                status = 1;
+            }
+            if (arg == NULL) {
+                number = 0;
+            }
+            spec[len] = 'l';
+            spec[len + 1] = 'l';
+            spec[len + 2] = *fmt;
+            spec[len + 3] = 0;
+            printf(spec, number);
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            if (arg != NULL && printf_real(arg, &real) < 0) {
+                status = 1;
+            }
+            if (arg == NULL) {
+                real = 0;
+            }
+            spec[len] = *fmt;
+            spec[len + 1] = 0;
+            printf(spec, real);
+            break;
+        default:
+            shell_error("printf: %%%c: invalid directive", *fmt);
+            return 2;
+        }
+    }
+    return status;
+}
+
+int
+printf_number(char *arg, long long *result)
+{
+    /*
+     * helper function converting a printf argument to a number. like other shells, an argument
+     * starting with a quote is the character code of the next character
+     *
+     * returns:
+     *  0 on success, -1 if arg is not a number (message is printed, *result holds what was parsed)
+     */
+
+    char *end;
+
+    if (*arg == '\'' || *arg == '"') {
+        *result = (unsigned char)arg[1];
+        return 0;
+    }
+    errno = 0;
+    *result = strtoll(arg, &end, 0);
+    if (*arg == 0 || *end != 0 || errno != 0) {
+        shell_error("printf: %s: invalid number", arg);
+        return -1;
+    }
+    return 0;
+}
+
+int
+printf_real(char *arg, double *result)
+{
+    /*
+     * helper function converting a printf argument for %f and the like, see printf_number
+     *
+     * returns:
+     *  0 on success, -1 if arg is not a number (message is printed, *result holds what was parsed)
+     */
+
+    char *end;
+
+    if (*arg == '\'' || *arg == '"') {
+        *result = (unsigned char)arg[1];
+        return 0;
+    }
+    errno = 0;
+    *result = strtod(arg, &end);
+    if (*arg == 0 || *end != 0 || errno != 0) {
+        shell_error("printf: %s: invalid number", arg);
+        return -1;
+    }
+    return 0;
+}
+
+int
+builtin_test(char **argv)
+{
+    /*
+     * the test builtin. expressions are parsed by recursive descent, with -o binding looser
+     * than -a, which binds looser than !
+     *
+     * returns:
+     *  0 if the expression is true, 1 if it is false, 2 on a malformed expression
+     */
+
+    int argc, pos = 0, result;
+
+    for (argc = 0; argv[argc + 1] != NULL; argc++);
+    if (argc == 0) {
+        return 1;
+    }
+
+    result = test_or(argv + 1, argc, &pos);
+    if (result == 2) {
+        return 2;
+    }
+    if (pos != argc) {
+        shell_error("test: %s: unexpected argument", argv[pos + 1]);
+        return 2;
+    }
+    return !result;
+}
+
+int
+builtin_bracket(char **argv)
+{
+    /*
+     * the [ builtin, which is test with a mandatory closing ]
+     */
+
+    int argc, status;
+
+    for (argc = 0; argv[argc] != NULL; argc++);
+    if (strcmp(argv[argc - 1], "]") != 0) {
+        shell_error("[: missing `]'");
+        return 2;
+    }
+    argv[argc - 1] = NULL;
+    status = builtin_test(argv);
+    argv[argc - 1] = "]";
+    return status;
+}
+
+int
+test_or(char **argv, int argc, int *pos)
+{
+    /*
+     * helpers for builtin_test. each level parses argv from *pos onwards and returns 1 for
+     * true, 0 for false and 2 for a syntax error
+     */
+
+    int result = test_and(argv, argc, pos), right;
+
+    while (result != 2 && *pos < argc && strcmp(argv[*pos], "-o") == 0) {
+        (*pos)++;
+        if ((right = test_and(argv, argc, pos)) == 2) {
+            return 2;
+        }
+        result = result || right;
+    }
+    return result;
+}
+
+int
+test_and(char **argv, int argc, int *pos)
+{
+    int result = test_not(argv, argc, pos), right;
+
+    while (result != 2 && *pos < argc && strcmp(argv[*pos], "-a") == 0) {
+        (*pos)++;
+        if ((right = test_not(argv, argc, pos)) == 2) {
+            return 2;
+        }
+        result = result && right;
+    }
+    return result;
+}
+
+int
+test_not(char **argv, int argc, int *pos)
+{
+    int result;
+
+    // a lone ! is just a non-empty string
+    if (*pos + 1 < argc && strcmp(argv[*pos], "!") == 0) {
+        (*pos)++;
+        if ((result = test_not(argv, argc, pos)) == 2) {
+            return 2;
+        }
+        return !result;
+    }
+    return test_primary(argv, argc, pos);
+}
+
+int
+test_primary(char **argv, int argc, int *pos)
+{
+    static char *binary_ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+        "-nt", "-ot", "-ef", NULL};
+    char *arg;
+    int result;
+
+    if (*pos >= argc) {
+        shell_error("test: argument expected");
+        return 2;
+    }
+
+    // a binary operator in second position wins over everything else, so `test ( = (` works
+    if (*pos + 2 < argc) {
+        for (int i = 0; binary_ops[i] != NULL; i++) {
+            if (strcmp(argv[*pos + 1], binary_ops[i]) == 0) {
+                result = test_binary(argv[*pos], argv[*pos + 1], argv[*pos + 2]);
+                *pos += 3;
+                return result;
+            }
+        }
+    }
+
+    arg = argv[*pos];
+    if (strcmp(arg, "(") == 0 && *pos + 1 < argc) {
+        (*pos)++;
+        result = test_or(argv, argc, pos);
+        if (result == 2) {
+            return 2;
+        }
+        if (*pos >= argc || strcmp(argv[*pos], ")") != 0) {
+            shell_error("test: `)' expected");
+            return 2;
+        }
+        (*pos)++;
+        return result;
+    }
+
+    if (arg[0] == '-' && arg[1] != 0 && arg[2] == 0 && *pos + 1 < argc && strchr("bcdefghkLnprsStuwxzOG", arg[1]) != NULL) {
+        *pos += 2;
+        return test_unary(arg, argv[*pos - 1]);
+    }
+
+    // anything else is true when it is not empty
+    (*pos)++;
+    return arg[0] != 0;
+}
+
+int
+test_unary(char *op, char *arg)
+{
+    struct stat st;
+    long long fd;
+
+    switch (op[1]) {
+    case 'z':
+        return arg[0] == 0;
+    case 'n':
+        return arg[0] != 0;
+    case 't':
+        return test_integer(arg, &fd) == 0 && isatty(fd);
+    case 'r':
+        return access(arg, R_OK) == 0;
+    case 'w':
+        return access(arg, W_OK) == 0;
+    case 'x':
+        return access(arg, X_OK) == 0;
+    case 'h':
+    case 'L':
+        return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+
+    if (stat(arg, &st) < 0) {
+        return 0;
+    }
+    switch (op[1]) {
+    case 'b':
+        return S_ISBLK(st.st_mode);
+    case 'c':
+        return S_ISCHR(st.st_mode);
+    case 'd':
+        return S_ISDIR(st.st_mode);
+    case 'f':
+        return S_ISREG(st.st_mode);
+    case 'g':
+        return (st.st_mode & S_ISGID) != 0;
+    case 'k':
+        return (st.st_mode & S_ISVTX) != 0;
+    case 'p':
+        return S_ISFIFO(st.st_mode);
+    case 's':
+        return st.st_size > 0;
+    case 'S':
+        return S_ISSOCK(st.st_mode);
+    case 'u':
+        return (st.st_mode & S_ISUID) != 0;
+    case 'O':
+        return st.st_uid == geteuid();
+    case 'G':
+        return st.st_gid == getegid();
+    default:
+        // -e
+        return 1;
+    }
+}
+
+int
+test_binary(char *left, char *op, char *right)
+{
+    struct stat left_st, right_st;
+    long long a, b;
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(left, right) == 0;
+    }
+    if (strcmp(op, "!=") == 0) {
+        return strcmp(left, right) != 0;
+    }
+    if (strcmp(op, "<") == 0) {
+        return strcmp(left, right) < 0;
+    }
+    if (strcmp(op, ">") == 0) {
+        return strcmp(left, right) > 0;
+    }
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        int left_ok = stat(left, &left_st) == 0, right_ok = stat(right, &right_st) == 0;
+
+        if (op[1] == 'e') {
+            return left_ok && right_ok && left_st.st_dev == right_st.st_dev && left_st.st_ino == right_st.st_ino;
+        }
+        // a file that does not exist is older than one that does
+        if (op[1] == 'o') {
+            struct stat tmp_st = left_st;
+            int tmp_ok = left_ok;
+            left_st = right_st;
+            left_ok = right_ok;
+            right_st = tmp_st;
+            right_ok = tmp_ok;
+        }
+        if (!left_ok) {
+            return 0;
+        }
+        if (!right_ok) {
+            return 1;
+        }
+        return left_st.st_mtim.tv_sec > right_st.st_mtim.tv_sec ||
+            (left_st.st_mtim.tv_sec == right_st.st_mtim.tv_sec && left_st.st_mtim.tv_nsec > right_st.st_mtim.tv_nsec);
+    }
+
+    if (test_integer(left, &a) < 0 || test_integer(right, &b) < 0) {
+        return 2;
+    }
+    switch (op[1] << 8 | op[2]) {
+    case 'e' << 8 | 'q':
+        return a == b;
+    case 'n' << 8 | 'e':
+        return a != b;
+    case 'l' << 8 | 't':
+        return a < b;
+    case 'l' << 8 | 'e':
+        return a <= b;
+    case 'g' << 8 | 't':
+        return a > b;
+    default:
+        return a >= b;
+    }
+}
+
+int
+test_integer(char *str, long long *result)
+{
+    /*
+     * helper function to parse an integer operand of test, surrounding blanks are allowed
+     *
+     * returns:
+     *  0 on success, -1 if str is not an integer (message is printed)
+     */
+
+    char *end;
+
+    errno = 0;
+    *result = strtoll(str, &end, 10);
+    while (*end == ' ' || *end == '\t') {
+        end++;
+    }
+    if (*str == 0 || *end != 0 || errno != 0) {
+        shell_error("test: %s: integer expression expected", str);
+        return -1;
+    }
+    return 0;
+}
+
+int
+builtin_history(char **argv)
+{
+    /*
+     * the history builtin. prints the history with line numbers, only the last n entries with
+     * an argument
+     */
+
+    unsigned long first;
+    char *end;
+    long count;
+
+    load_history();
+    first = history_first();
+    if (argv[1] != NULL) {
+        if ((count = strtol(argv[1], &end, 10)) < 0 || *end != 0 || end == argv[1]) {
+            shell_error("history: %s: numeric argument required", argv[1]);
+            return 2;
+        }
+        if ((unsigned long)count < history.count - first) {
+            first = history.count - count;
+        }
+    }
+    for (unsigned long seq = first; seq < history.count; seq++) {
+        printf("%5lu  %s\n", seq + 1, history_get(seq));
+    }
+    return 0;
+}
 
 int
-main(int argc, char *argv[])
+builtin_jobs(char **argv)
 {
-    char input_buf[MAX_INPUT_LEN];
-    char counting_buf[MAX_INPUT_LEN];
-    int fds[2];
-    int num_pipes, pipe_index, read_fd, write_fd, prev_read_fd; 
-    pid_t child_pid;
+    /*
+     * the jobs builtin. lists the jobs in the table, -l adds pids and -p prints only the pids
+     * of the process group leaders. finished jobs are reported once and then removed
+     */
 
-    print_prompt();
+    int show_pids = 0, only_pids = 0;
+    struct job *job;
 
-    while(fgets(input_buf, MAX_INPUT_LEN, stdin) != NULL) {
-        // duplicate input into buffer which we can use to count the number of pipes
-        strcpy(counting_buf, input_buf);
-        // count number of pipes in our input
-        num_pipes = count_pipes(counting_buf);
+    for (argv++; *argv != NULL; argv++) {
+        if (strcmp(*argv, "-l") == 0) {
+            show_pids = 1;
+        }
+        else if (strcmp(*argv, "-p") == 0) {
+            only_pids = 1;
+        }
+        else {
+            shell_error("jobs: %s: invalid option", *argv);
+            return 2;
+        }
+    }
 
-        // by default, these are the standard file descriptors
-        write_fd = 1;
-        read_fd = 0;
+    for (int id = 0; id < jobs_cap; id++) {
+        if ((job = jobs[id]) == NULL || !job->background) {
+            continue;
+        }
+        if (only_pids) {
+            printf("%d\n", (int)job->procs[0].pid);
+        }
+        else {
+            print_job(job, show_pids);
+        }
+    }
+
+    // what was just listed as done does not need another notice
+    notify_jobs(0);
+    return 0;
+}
+
+int
+builtin_wait(char **argv)
+{
+    /*
+     * the wait builtin. without arguments waits for every background job, otherwise for each
+     * pid or job spec given
+     *
+     * returns:
+     *  the status of the last job or pid waited for, 127 if it is not a child of this shell
+     */
 
-        // iterate through the pipes of our input, even if there are 0
-        char *token = strtok(input_buf, "|");
+    struct job *job;
+    char *end;
+    pid_t pid;
+    int status = 0, i, found;
 
-        // store each input separated by the pipes
-        pipe_index = 0;
+    if (argv[1] == NULL) {
+        for (int id = 0; id < jobs_cap && !interrupted; id++) {
+            if ((job = jobs[id]) != NULL && job->background) {
+                wait_for_job(job);
+            }
+        }
+        notify_jobs(current_input->interactive);
+        return interrupted ? 128 + SIGINT : 0;
+    }
 
-        // iterate through the input string
-        while(token != NULL) {
-            // if user types exit, exit with code EXIT_SUCCESS (0)
-            if (strcmp(token, "exit\n") == 0) {
-                exit(EXIT_SUCCESS);
+    for (argv++; *argv != NULL; argv++) {
+        job = NULL;
+        if ((*argv)[0] == '%') {
+            if ((job = find_job(*argv, "wait")) == NULL) {
+                status = 127;
+                continue;
             }
-            // if user doesn't type anything
-            if (strcmp(token, "\n") == 0) {
-                break;
+            wait_for_job(job);
+            status = interrupted ? 128 + SIGINT : job->timed_out ? TIMEOUT_STATUS : exit_status(job->procs[job->num_procs - 1].status);
+            // its status has been asked for, so like a reported job it leaves the table
+            if (job_done(job) && !job_stopped(job)) {
+                forget_job(job);
             }
+            continue;
+        }
 
-            // update previous read_fd from previous pipe
-            // handles case even when there are no pipes
-            prev_read_fd = read_fd;
+        pid = strtol(*argv, &end, 10);
+        if (**argv == 0 || *end != 0 || pid <= 0) {
+            shell_error("wait: `%s': not a pid or valid job spec", *argv);
+            status = 2;
+            continue;
+        }
 
-            // if we need to pipe
-            if (pipe_index < num_pipes) {
-                // make the pipe
-                if (pipe(fds) < 0) {
-                    perror("pipe");
+        // a pid of a job that is still in the table
+        found = 0;
+        for (int id = 0; id < jobs_cap && !found; id++) {
+            if ((job = jobs[id]) == NULL) {
+                continue;
+            }
+            for (i = 0; i < job->num_procs; i++) {
+                if (job->procs[i].pid == pid) {
+                    while (job->procs[i].state == PROC_RUNNING && !interrupted) {
+                        wait_events(-1, -1);
+                    }
+                    status = interrupted ? 128 + SIGINT : exit_status(job->procs[i].status);
+                    found = 1;
+                    if (job_done(job) && !job_stopped(job)) {
+                        forget_job(job);
+                    }
                     break;
                 }
+            }
+        }
+        // or of one that already finished and was removed
+        for (i = 0; i < FINISHED_SLOTS && !found; i++) {
+            if (finished[i].pid == pid) {
+                status = finished[i].status;
+                found = 1;
+            }
+        }
+        if (!found) {
+            shell_error("wait: pid %d is not a child of this shell", (int)pid);
+            status = 127;
+        }
+    }
+
+    return status;
+}
+
+int
+builtin_fg(char **argv)
+{
+    /*
+     * the fg builtin. continues the job if it was stopped and waits for it like any foreground job
+     */
+
+    struct job *job;
+
+    if ((job = find_job(argv[1], "fg")) == NULL) {
+        return 1;
+    }
+
+    printf("%s\n", job->command);
+    fflush(stdout);
+    job->background = 0;
+    if (job_control && job->pgid != shell_pgid) {
+        tcsetpgrp(tty_fd, job->pgid);
+    }
+    continue_job(job);
+
+    wait_for_job(job);
+    finish_foreground(job);
+    return last_status;
+}
+
+int
+builtin_bg(char **argv)
+{
+    /*
+     * the bg builtin. continues a stopped job in the background
+     */
+
+    struct job *job;
+
+    if ((job = find_job(argv[1], "bg")) == NULL) {
+        return 1;
+    }
 
-                // store pipe file desciptors
-                read_fd = fds[0];
-                write_fd = fds[1];
+    continue_job(job);
+    job->background = 1;
+    // like &, the job is now the one $! refers to
+    last_bg_pid = job->procs[job->num_procs - 1].pid;
+    printf("[%d] %s &\n", job->id, job->command);
+    return 0;
+}
+
+int
+builtin_parallel(char **argv)
+{
+    /*
+     * the parallel builtin: parallel [-j N] [-k] [-u] [--tag] command [arg...] ::: value...
+     * runs command once per value, with {} in its arguments replaced by the value (or the value
+     * appended when there is no {}), at most N instances at a time. N defaults to the number of
+     * online CPUs. each instance's output is printed in one piece when it finishes, in input
+     * order with -k, with every line prefixed by the value and a tab with --tag, or not collected
+     * at all with -u
+     *
+     * returns:
+     *  the number of instances that failed (at most 101, like GNU parallel), 255 on a usage error
+     */
+
+    struct parallel_task *tasks;
+    struct pollfd *fds;
+    struct command cmd;
+    struct job *job;
+    char **template, **values, *end;
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int keep_order = 0, ungrouped = 0, tag = 0;
+    int num_values, next = 0, running, num_fds, flushed = 0, failed = 0;
+    int pipe_fds[2], null_fd;
+
+    for (argv++; *argv != NULL && (*argv)[0] == '-'; argv++) {
+        if (strncmp(*argv, "-j", 2) == 0) {
+            end = (*argv)[2] != 0 ? *argv + 2 : *++argv;
+            if (end == NULL || (max_jobs = strtol(end, &end, 10)) <= 0 || *end != 0) {
+                shell_error("parallel: -j needs a positive number");
+                return 255;
             }
+        }
+        else if (strcmp(*argv, "-k") == 0) {
+            keep_order = 1;
+        }
+        else if (strcmp(*argv, "-u") == 0) {
+            ungrouped = 1;
+        }
+        else if (strcmp(*argv, "--tag") == 0) {
+            tag = 1;
+        }
+        else {
+            shell_error("parallel: %s: invalid option", *argv);
+            return 255;
+        }
+    }
+    if (max_jobs <= 0) {
+        max_jobs = 1;
+    }
 
-            // fork into child process
-            if ((child_pid = fork()) < 0) {
-                perror("fork");
-                exit(1);
+    // the command template runs up to :::, the values follow it
+    template = argv;
+    for (values = argv; *values != NULL && strcmp(*values, ":::") != 0; values++);
+    if (values == template || *values == NULL) {
+        shell_error("parallel: usage: parallel [-j N] [-k] [-u] [--tag] command [arg...] ::: value...");
+        return 255;
+    }
+    *values++ = NULL;
+    for (num_values = 0; values[num_values] != NULL; num_values++);
+    if (num_values == 0) {
+        return 0;
+    }
+    if (ungrouped) {
+        keep_order = tag = 0;
+    }
+
+    if ((tasks = calloc(num_values, sizeof(struct parallel_task))) == NULL ||
+            (fds = malloc((num_values + 1) * sizeof(struct pollfd))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if ((null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+        perror("/dev/null");
+        null_fd = 0;
+    }
+
+    // the instances share one job, so their exits are recorded like pipeline stages
+    fflush(stdout);
+    job = new_job(num_values);
+    if ((job->command = strdup("parallel")) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+
+    while (1) {
+        running = 0;
+        for (int i = 0; i < next; i++) {
+            running += job->procs[i].state == PROC_RUNNING;
+        }
+
+        // keep the pool full. after a Ctrl-C, the instances still running are only waited for
+        while (next < num_values && running < max_jobs && !interrupted) {
+            struct parallel_task *task = &tasks[next];
+            struct process *proc = &job->procs[next];
+
+            task->value = values[next];
+            task->fd = -1;
+            proc->start_ns = now_ns();
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.argv = parallel_argv(template, task->value);
+            for (cmd.argc = 0; cmd.argv[cmd.argc] != NULL; cmd.argc++);
+            cmd.function = find_function(cmd.argv[0]);
+            cmd.builtin = cmd.function == NULL ? find_builtin(cmd.argv) : NULL;
+            snprintf(proc->name, sizeof(proc->name), "%s", cmd.argv[0]);
+
+            // independent instances: one CPU after the other, or spread over the nodes with rr
+            spawn_cpu = pin_policy == PIN_ROUND_ROBIN ? pin_round_robin(next) :
+                pin_policy == PIN_COMPACT ? pin_cpu(pin_reserve(1), 0) : -1;
+
+            pipe_fds[0] = pipe_fds[1] = -1;
+            if (!ungrouped && pipe2(pipe_fds, O_CLOEXEC) < 0) {
+                perror("pipe");
             }
-            
-            // if we are in the child
-            if (child_pid == 0) {
-                // if we are in the first argument
-                if (pipe_index == 0) {
-                    // there can be no preceding pipe so read fd is stdin (and could be input from file)
-                    read_fd = 0;
-                    process_args(token, read_fd, write_fd);
-                }
-                else {
-                    if (pipe_index == num_pipes) {
-                        write_fd = 1;
-                    }
-                    process_args(token, prev_read_fd, write_fd);
-                }
+            else if (cmd.builtin == NULL && cmd.function == NULL && (cmd.path = lookup_command(cmd.argv[0])) == NULL) {
+                shell_error("%s: command not found", cmd.argv[0]);
+                proc->status = W_EXITCODE(127, 0);
+            }
+            else if ((proc->pid = spawn_command(&cmd, null_fd, ungrouped ? 1 : pipe_fds[1], pipe_fds[0])) > 0) {
+                proc->state = PROC_RUNNING;
+                proc->cpu = spawn_cpu;
+                running++;
             }
-            // if we are in the parent
             else {
-                // check to see if we have opened any pipes 
-                if (num_pipes > 0) {
-                    if (pipe_index < num_pipes) {
-                        // if we have, we can close the write pipe because it has been passsed to child
-                        if (close(write_fd) < 0) {
-                            perror("close");
-                            break;
-                        }
-                    }
-                    // if we are anywhere but the first argument, close the preceding pipe because
-                    // it has been passed to child
-                    if (pipe_index != 0) {
-                        if (close(prev_read_fd) < 0) {
-                            perror("close");
-                            break;
-                        }
-                    }
+                proc->status = W_EXITCODE(126, 0);
+            }
+            spawn_cpu = -1;
+            proc->spawn_ns = now_ns() - proc->start_ns;
+            proc->exec_ns = last_exec_ns;
+
+            // the parent only keeps the read end of an instance that actually started
+            if (pipe_fds[1] >= 0) {
+                close(pipe_fds[1]);
+            }
+            if (proc->state == PROC_RUNNING) {
+                task->fd = pipe_fds[0];
+            }
+            else if (pipe_fds[0] >= 0) {
+                close(pipe_fds[0]);
+            }
+            free(cmd.argv);
+            next++;
+        }
+
+        // print whatever is complete: everything finished when grouping, a prefix of the input with -k
+        for (int i = keep_order ? flushed : 0; i < next && !ungrouped; i++) {
+            if (tasks[i].fd >= 0 || job->procs[i].state == PROC_RUNNING) {
+                if (keep_order) {
+                    break;
                 }
-                // get the next token and increase our pipe index
-                token = strtok(NULL, "|");
-                pipe_index++;
+                continue;
+            }
+            if (tasks[i].buf != NULL || (keep_order && i == flushed)) {
+                parallel_flush(&tasks[i], tag);
+            }
+            if (keep_order) {
+                flushed = i + 1;
             }
         }
 
-        // wait for children to finish before we print another shell prompt 
-        for (int i = 0; i < num_pipes + 1; i++) {
-            wait(NULL);
+        fds[0].fd = sigchld_fd;
+        fds[0].events = POLLIN;
+        num_fds = 1;
+        for (int i = 0; i < next; i++) {
+            if (tasks[i].fd >= 0) {
+                fds[num_fds].fd = tasks[i].fd;
+                fds[num_fds].events = POLLIN;
+                num_fds++;
+            }
+        }
+        if (num_fds == 1 && running == 0 && (next == num_values || interrupted)) {
+            break;
+        }
+
+        // sleep until some instance writes, closes its output or exits
+        if (poll(fds, num_fds, -1) < 0) {
+            if (errno != EINTR) {
+                perror("poll");
+                break;
+            }
+            continue;
+        }
+        if (fds[0].revents != 0) {
+            reap_children();
+        }
+        for (int i = 0, j = 1; i < next; i++) {
+            if (tasks[i].fd >= 0 && fds[j++].revents != 0) {
+                parallel_read(&tasks[i]);
+            }
         }
-        print_prompt();
     }
-    return 0;
+
+    for (int i = 0; i < num_values; i++) {
+        if (tasks[i].fd >= 0) {
+            close(tasks[i].fd);
+        }
+        if (exit_status(job->procs[i].status) != 0) {
+            failed++;
+        }
+        free(tasks[i].buf);
+    }
+    set_pipestatus(job);
+    pipestatus_kept = 1;
+    free_job(job);
+
+    if (null_fd > 0) {
+        close(null_fd);
+    }
+    free(tasks);
+    free(fds);
+    return failed > 101 ? 101 : failed;
 }
 
-void
-print_prompt()
+char **
+parallel_argv(char **template, char *value)
 {
-    printf("$ ");
+    /*
+     * helper function to build the arguments of one parallel instance
+     *
+     * args:
+     *  char **template: the command as given, NULL terminated
+     *  char *value: the value this instance runs with
+     *
+     * returns:
+     *  malloc'd argv. the strings that contained {} are allocated in the same block, so a single
+     *  free releases everything
+     */
+
+    size_t count = 0, extra = 0, value_len = strlen(value);
+    int replaced = 0;
+    char **argv, *text, *src, *dst;
+
+    for (char **arg = template; *arg != NULL; arg++, count++) {
+        for (src = *arg; (src = strstr(src, "{}")) != NULL; src += 2) {
+            extra += value_len;
+            replaced = 1;
+        }
+        extra += strlen(*arg) + 1;
+    }
+
+    if ((argv = malloc((count + 2) * sizeof(char *) + extra)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    text = (char *)(argv + count + 2);
+
+    count = 0;
+    for (char **arg = template; *arg != NULL; arg++) {
+        if (strstr(*arg, "{}") == NULL) {
+            argv[count++] = *arg;
+            continue;
+        }
+        argv[count++] = dst = text;
+        for (src = *arg; *src != 0;) {
+            if (src[0] == '{' && src[1] == '}') {
+                memcpy(dst, value, value_len);
+                dst += value_len;
+                src += 2;
+            }
+            else {
+                *dst++ = *src++;
+            }
+        }
+        *dst++ = 0;
+        text = dst;
+    }
+    if (!replaced) {
+        argv[count++] = value;
+    }
+    argv[count] = NULL;
+    return argv;
 }
 
 int
-count_pipes(char *input_buf) 
+parallel_read(struct parallel_task *task)
 {
     /*
-     * helper function to count the number of pipes in a given command typed into the shell
+     * helper function to append what is available on an instance's output pipe to its buffer
      *
-     * args: 
-     *  char *input_buf: pointer to buffer storing the entire string user typed into shell
-     * 
      * returns:
-     *  integer number of pipes in command supplied to shell
+     *  bytes read, 0 once the pipe hit end of file (task->fd is then closed and set to -1)
      */
 
-    int pipe_count = 0;
-    char *token = strtok(input_buf, " ");
+    ssize_t got;
+
+    if (task->cap - task->len < PARALLEL_READ_SIZE) {
+        task->cap = task->cap == 0 ? PARALLEL_READ_SIZE : 2 * task->cap;
+        if ((task->buf = realloc(task->buf, task->cap)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
 
-    // iterate through input string. every time
-    // we see a pipe increase our pipe count by 1
-    while(token != NULL) {
-        if (strcmp(token, "|") == 0) {
-            pipe_count += 1;
+    while ((got = read(task->fd, task->buf + task->len, task->cap - task->len)) < 0 && errno == EINTR);
+    if (got <= 0) {
+        if (got < 0) {
+            perror("read");
         }
-        token = strtok(NULL, " ");
+        close(task->fd);
+        task->fd = -1;
+        return 0;
     }
-    return pipe_count;
+    task->len += got;
+    return got;
 }
 
 void
-process_args(char *arg_str, int read_fd, int write_fd) 
+parallel_flush(struct parallel_task *task, int tag)
 {
-    /* 
-     * helperfunction called within child process to process a single entry to our shell 
-     * (what would be separated by pipes if there were any).
+    /*
+     * helper function to print an instance's output and drop the buffer
      *
      * args:
-     *  char *arg_str: pointer to buffer storing a single pipe-separated user entry to our shell
-     *  int read_fd: file descriptor reflecting where data could be read in from to this process (stdin or from a pipe) 
-     *  int write_fd: file descriptor reflecting where data could be written to in this process (stdout or to a pipe)
+     *  struct parallel_task *task: the instance
+     *  int tag: start every line with the instance's value and a tab
      */
 
-    char *opt_args_buf[MAX_ARGS];
-    char *program_name, *input_file, *output_file;
-    int fd, args_buf_index;
+    char *line = task->buf, *end = task->buf + task->len, *newline;
 
-    // initialize the index of our argument buffer
-    args_buf_index = 0;
-
-    // replace stdout with our pipe (potentially)
-    // could also just be 1
-    if (write_fd != 1) {
-        if (dup2(write_fd, 1) < 0) {
-            perror("dup2");
-            exit(2);
+    while (line < end) {
+        if ((newline = memchr(line, '\n', end - line)) == NULL) {
+            newline = end - 1;
         }
-        if (close(write_fd) < 0) {
-            perror("close");
-            exit(1);
+        if (tag) {
+            printf("%s\t", task->value);
         }
+        fwrite(line, 1, newline + 1 - line, stdout);
+        line = newline + 1;
     }
+    fflush(stdout);
 
-    // replace stdin with our pipe (potentially)
-    // could also just be 0
-    if (read_fd != 0) {
-        if (dup2(read_fd, 0) < 0) {
-            perror("dup2");
-            exit(2);
+    free(task->buf);
+    task->buf = NULL;
+    task->len = task->cap = 0;
+}
+
+int
+builtin_cat(char **argv)
+{
+    /*
+     * the cat builtin, for cat without options. files (or stdin, for no files or -) are copied
+     * to stdout with copy_fd
+     */
+
+    int fd, status = 0;
+
+    if (argv[1] == NULL) {
+        return copy_fd(0, 1) < 0;
+    }
+
+    for (argv++; *argv != NULL; argv++) {
+        if (strcmp(*argv, "-") == 0) {
+            fd = 0;
         }
-        if (close(read_fd) < 0) {
-            perror("close");
-            exit(1);
+        else if ((fd = open(*argv, O_RDONLY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "cat: %s: %s\n", *argv, strerror(errno));
+            status = 1;
+            continue;
+        }
+        if (copy_fd(fd, 1) < 0) {
+            status = 1;
+        }
+        if (fd != 0) {
+            close(fd);
         }
     }
+    return status;
+}
 
-    char *token = strtok(arg_str, " ");
-
-    // program to be called will always be first token, so save it
-    program_name = token;
+int
+cat_handles(char **argv)
+{
+    /*
+     * helper function so options like cat -n still go to the real cat
+     */
 
-    // iterate through our argument, either adding to our args_buf array
-    // or handling various redirection cases <, >, or >>
-    while(token != NULL) {
-        if (strcmp(token, "exit\n") == 0) {
-            exit(EXIT_SUCCESS);
+    for (argv++; *argv != NULL; argv++) {
+        if ((*argv)[0] == '-' && (*argv)[1] != 0) {
+            return 0;
         }
+    }
+    return 1;
+}
 
-        // input redirection
-        if (strcmp(token, "<") == 0) {
-            input_file = strtok(NULL, " ");
-            // remove trailing newline character, if there is one
-            input_file[strcspn(input_file, "\n")] = 0;
+int
+copy_fd(int in_fd, int out_fd)
+{
+    /*
+     * function to copy everything from in_fd to out_fd, letting the kernel move the data whenever
+     * it can: copy_file_range between regular files, sendfile out of a regular file, splice when
+     * either side is a pipe, and a plain read/write loop when none of those apply. every loop
+     * gives up once a Ctrl-C came in, a read from the terminal or /dev/zero would never end
+     *
+     * args:
+     *  int in_fd: descriptor to read until end of file
+     *  int out_fd: descriptor to write to
+     *
+     * returns:
+     *  0 on success, -1 on an error (message is printed) or when interrupted
+     */
 
-            if ((fd = open(input_file, O_RDONLY)) < 0) {
-                perror("open");
-                exit(1);
-            }
+    struct stat in_st, out_st;
+    char *buf;
+    ssize_t bytes, written, done;
+    int in_reg, out_reg, in_pipe, out_pipe;
 
-            if (dup2(fd, 0) < 0) {
-                perror("dup2");
-                exit(2);
-            }
+    if (fstat(in_fd, &in_st) < 0 || fstat(out_fd, &out_st) < 0) {
+        perror("cat: fstat");
+        return -1;
+    }
+    in_reg = S_ISREG(in_st.st_mode);
+    // copy_file_range refuses to append, so appending to a file starts with sendfile
+    out_reg = S_ISREG(out_st.st_mode) && (fcntl(out_fd, F_GETFL) & O_APPEND) == 0;
+    in_pipe = S_ISFIFO(in_st.st_mode);
+    out_pipe = S_ISFIFO(out_st.st_mode);
 
-            // make sure that final entry in args buf is NULL
-            opt_args_buf[args_buf_index] = NULL;
+    // each fast path falls through to the next one when the kernel refuses this combination
+    // of descriptors before anything was copied
+    if (in_reg && out_reg) {
+        while ((bytes = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, 0)) > 0 || (bytes < 0 && errno == EINTR)) {
+            if (interrupted) {
+                return -1;
+            }
         }
-
-        // output redirection
-        else if (strcmp(token, ">") == 0) {
-            output_file = strtok(NULL, " ");
-            // remove trailing newline character, if there is one
-            output_file[strcspn(output_file, "\n")] = 0;
-
-            if ((fd = open(output_file, O_TRUNC | O_CREAT | O_WRONLY, 0644)) < 0) {
-                perror("open");
-                exit(1);
+        if (bytes == 0) {
+            return 0;
+        }
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+            perror("cat: copy_file_range");
+            return -1;
+        }
+    }
+    if (in_reg) {
+        while ((bytes = sendfile(out_fd, in_fd, NULL, COPY_CHUNK_SIZE)) > 0 || (bytes < 0 && errno == EINTR)) {
+            if (interrupted) {
+                return -1;
             }
-
-            if (dup2(fd, 1) < 0) {
-                perror("dup2");
-                exit(2);
+        }
+        if (bytes == 0) {
+            return 0;
+        }
+        if (errno != EINVAL && errno != ENOSYS) {
+            perror("cat: sendfile");
+            return -1;
+        }
+    }
+    if (in_pipe || out_pipe) {
+        while ((bytes = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, SPLICE_F_MOVE)) > 0 || (bytes < 0 && errno == EINTR)) {
+            if (interrupted) {
+                return -1;
             }
+        }
+        if (bytes == 0) {
+            return 0;
+        }
+        if (errno != EINVAL && errno != ENOSYS) {
+            perror("cat: splice");
+            return -1;
+        }
+    }
 
-            // make sure that final entry in args buf is NULL
-            opt_args_buf[args_buf_index] = NULL;
+    if ((buf = malloc(READ_CHUNK_SIZE)) == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    while (!interrupted && (bytes = read(in_fd, buf, READ_CHUNK_SIZE)) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("cat: read");
+            free(buf);
+            return -1;
+        }
+        for (done = 0; done < bytes && !interrupted; done += written) {
+            if ((written = write(out_fd, buf + done, bytes - done)) < 0) {
+                if (errno == EINTR) {
+                    written = 0;
+                    continue;
+                }
+                perror("cat: write");
+                free(buf);
+                return -1;
+            }
         }
+    }
+    free(buf);
+    return interrupted ? -1 : 0;
+}
+
+int
+builtin_hash(char **argv)
+{
+    /*
+     * the hash builtin. with no arguments lists the remembered commands, with -r forgets all of
+     * them, and with names looks each of them up and remembers it
+     *
+     * args:
+     *  char **argv: NULL terminated arguments, argv[0] is "hash"
+     *
+     * returns:
+     *  0 on success, 1 if a name could not be found or an option is unknown
+     */
 
-        // output redirection with appending
-        else if (strcmp(token, ">>") == 0) {
-            output_file = strtok(NULL, " ");
-            // remove trailing newline character, if there is one
-            output_file[strcspn(output_file, "\n")] = 0;
+    int status = 0;
 
-            if ((fd = open(output_file, O_APPEND | O_CREAT | O_WRONLY, 0644)) < 0) {
-                perror("open");
-                exit(1);
+    if (argv[1] == NULL) {
+        if (path_table.count == 0) {
+            printf("hash: hash table empty\n");
+            return 0;
+        }
+        printf("hits\tcommand\n");
+        for (size_t i = 0; i < path_table.num_slots; i++) {
+            if (path_table.slots[i].name != NULL) {
+                printf("%4u\t%s\n", path_table.slots[i].hits, path_table.slots[i].path);
             }
+        }
+        return 0;
+    }
 
-            if (dup2(fd, 1) < 0) {
-                perror("dup2");
-                exit(2);
-            }
+    if (strcmp(argv[1], "-r") == 0) {
+        path_table_clear();
+        return 0;
+    }
+    if (argv[1][0] == '-') {
+        shell_error("hash: %s: invalid option", argv[1]);
+        return 1;
+    }
 
-            // make sure that final entry in args buf is NULL
-            opt_args_buf[args_buf_index] = NULL;
+    for (argv++; *argv != NULL; argv++) {
+        // an explicit hash re-reads PATH even for names that are already remembered
+        path_table_forget(*argv);
+        if (strchr(*argv, '/') != NULL) {
+            continue;
+        }
+        if (lookup_command(*argv) == NULL) {
+            shell_error("hash: %s: not found", *argv);
+            status = 1;
         }
         else {
-            opt_args_buf[args_buf_index] = token;
-            // remove trailing newline character, if there is one
-            opt_args_buf[args_buf_index][strcspn(opt_args_buf[args_buf_index], "\n")] = 0;
-
-            args_buf_index++;
+            // mirror bash, which does not count the lookup itself as a hit
+            path_table_find(*argv)->hits = 0;
         }
-        token = strtok(NULL, " ");
     }
-    // remove trailing newline character, if there is one
-    program_name[strcspn(program_name, "\n")] = 0;
-
-    // make sure that final entry in args buf is NULL
-    opt_args_buf[args_buf_index] = NULL;
-    if (execvp(program_name, opt_args_buf) < 0) {
-        perror("execvp");
-        exit(3);
-    };
+    return status;
 }
@@ -0,0 +1,11 @@
+# a PATH=... in front of a command is where the command is looked up, without hashing it
+dir=$(mktemp -d)
+printf '#!/bin/sh\necho "private tool $1"\n' > $dir/tool
+chmod +x $dir/tool
+PATH=$dir tool a
+tool b
+PATH=$dir:$PATH tool c | tr a-z A-Z
+PATH=/nonexistent tool d
+echo "status $?"
+tool e
+rm -r $dir
@@ -0,0 +1,11 @@
+# a cat stage the shell leaves out still has its PIPESTATUS entry, as 0
+false | cat | cat
+echo "$? ${PIPESTATUS[@]}"
+(exit 3) | cat | (exit 4) | cat
+echo "$? ${PIPESTATUS[1]} ${PIPESTATUS[2]}"
+(exit 3) | cat | (exit 4) | cat
+echo "$? ${PIPESTATUS[@]}"
+printf 'data\n' > cat_pipestatus.tmp
+cat cat_pipestatus.tmp | cat | (exit 5)
+echo "$? ${PIPESTATUS[@]} ${PIPESTATUS[2]}"
+rm cat_pipestatus.tmp
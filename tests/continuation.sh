@@ -0,0 +1,29 @@
+# an open quote goes on with the next line, the line end is part of the word
+echo 'single
+quoted'
+echo "double
+quoted" x
+echo "joined\
+ in double quotes"
+
+# backslash-newline joins the lines, also between words and in the middle of one
+echo a \
+b
+echo con\
+tinued
+if true; then echo \
+    in if; fi
+
+# an open $( goes on too, one command per line
+x=$(echo one
+echo two)
+echo "$x"
+echo "$(echo in
+echo quotes)"
+echo $(echo a # comment
+echo b)
+y=$(cat <<END
+here-document line
+END
+)
+echo "$y"
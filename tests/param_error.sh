@@ -0,0 +1,7 @@
+# ${NAME:?} ends a script, after the message. in a $(...) only that command fails
+x=$(echo ${unset_a:?inside})
+echo "after the substitution: $?"
+( echo ${unset_b?in a subshell} ; echo not reached )
+echo "after the subshell: $?"
+echo ${unset_c:?}
+echo not reached either
@@ -0,0 +1,9 @@
+# parallel leaves the status of every instance in PIPESTATUS
+parallel -k sh -c 'exit {}' ::: 0 3 1
+echo "$? ${PIPESTATUS[@]}"
+{ time parallel -k sh -c 'exit {}' ::: 2 0; } 2>/dev/null
+echo "$? ${PIPESTATUS[@]}"
+
+# any other builtin on its own leaves just its status
+false
+echo "$? ${PIPESTATUS[@]}"
@@ -0,0 +1,13 @@
+# time, timeout and limit take a compound command as well as a simple one
+{ time -p for i in 1 2; do echo "for $i"; done; } 2>/dev/null
+{ time { echo group; }; } 2>/dev/null
+timeout 1 while true; do :; done
+echo "while: $?"
+timeout -s KILL 5 if true; then echo if; fi
+limit files=64 -- { echo limit group; }
+limit files=64 ( echo limit subshell )
+timeout 5 limit files=64 for i in a b; do echo $i; done | tr ab AB
+
+# only the unquoted words at the start of a pipeline are prefixes
+echo time timeout limit
+limit files=1 -- ; echo not reached
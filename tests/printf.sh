@@ -0,0 +1,12 @@
+# floating point conversions, like printf(1)
+printf "%.2f\n" 3.14159
+printf "%8.3e|%g|%G|%E\n" 12345.678 0.0001 1e20 2.5
+printf "%a\n" 1
+printf "%-6.1f|%+f\n" 2.25 -1
+printf "%f\n" "'A"
+printf "%f\n" abc
+echo "status $?"
+
+# an invalid directive is reported once and stops the output
+printf "%d %z\n" 1 2 3 4
+echo "status $?"
@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# run.sh
+#
+# runs every tests/*.sh with mysh and compares what it prints (stdout and stderr) with the
+# tests/*.out next to it. a failing test shows the difference. the tests run in tests/, so
+# error messages name them the same way wherever this is started from
+#
+# usage: tests/run.sh [mysh binary]
+
+MYSH=${1:-./mysh}
+failed=0
+count=0
+
+if [ ! -x "$MYSH" ]; then
+    echo "run.sh: $MYSH: not built, run make first" >&2
+    exit 1
+fi
+case "$MYSH" in
+/*) ;;
+*) MYSH="$PWD/$MYSH" ;;
+esac
+cd "$(dirname "$0")" || exit 1
+
+for test in *.sh; do
+    name=$(basename "$test" .sh)
+    if [ "$name" = run ]; then
+        continue
+    fi
+    count=$((count + 1))
+    if ! "$MYSH" "$test" 2>&1 | diff -u "$name.out" - > /dev/null; then
+        echo "run.sh: $name: failed" >&2
+        "$MYSH" "$test" 2>&1 | diff -u "$name.out" - >&2
+        failed=1
+    fi
+done
+
+if [ $failed -eq 0 ]; then
+    echo "run.sh: $count tests: ok"
+fi
+exit $failed
@@ -0,0 +1,9 @@
+# timeout takes its options the ways timeout(1) does
+timeout -sKILL 0.2 sleep 5
+echo "$? ${PIPESTATUS[@]}"
+timeout --signal=INT --kill-after=1 0.2 sleep 5
+echo "$? ${PIPESTATUS[@]}"
+timeout --signal INT -k1 0.2 sleep 5
+echo "$? ${PIPESTATUS[@]}"
+timeout -x 1 true
+echo "status $?"
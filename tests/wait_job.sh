@@ -0,0 +1,14 @@
+# a job wait has returned the status of is gone from the table
+(exit 3) &
+pid=$!
+wait $pid
+echo "wait pid: $?"
+jobs
+wait $pid
+echo "again: $?"
+(exit 4) &
+wait %1
+echo "wait %1: $?"
+jobs
+wait %1
+echo "again: $?"